@@ -0,0 +1,67 @@
+""" Shared calls of cached coroutine functions.
+
+    Calling a coroutine function returns a coroutine, which can only be
+    awaited once.  The cache stores a SharedCall holding it instead, and
+    every call of the cached function, hit or miss, returns a new coroutine
+    from its wait() method.  The first one to run starts the call as a task
+    of its event loop.  Other awaiters in that loop await the task through
+    asyncio.shield, so that cancelling one of them, e.g. by a timeout, does
+    not cancel the call for the others, and awaiters in other loops await
+    its result through a future of their own loop.
+
+    This module is only imported for coroutine functions, on Python 3.5+.
+"""
+import asyncio
+import concurrent.futures
+import threading
+
+try:
+    _running_loop = asyncio.get_running_loop
+except AttributeError:      # Python < 3.7, where this is the running loop
+    _running_loop = asyncio.get_event_loop
+
+
+class SharedCall(object):
+    """ The call of a cached coroutine function, run once for all callers.
+
+        discard(self) is called once the call failed or was cancelled, to
+        drop it from the cache so that the next call retries.
+    """
+    __slots__ = ('_coro', '_discard', '_task', '_loop', '_result', '_lock',
+                 '__weakref__')
+
+    def __init__(self, coro, discard):
+        self._coro = coro
+        self._discard = discard
+        self._task = None           # running the call, until it is done
+        self._loop = None           # of the task
+        self._result = concurrent.futures.Future()
+        self._lock = threading.Lock()
+
+    async def wait(self):
+        """ Await the result of the call, starting it if need be. """
+        if self._result.done():
+            return self._result.result()
+        loop = _running_loop()
+        with self._lock:
+            coro, self._coro = self._coro, None
+        if coro is not None:
+            self._loop = loop
+            self._task = loop.create_task(coro)
+            self._task.add_done_callback(self._done)
+        task = self._task
+        if task is not None and self._loop is loop:
+            return await asyncio.shield(task)
+        return await asyncio.shield(asyncio.wrap_future(self._result,
+                                                        loop=loop))
+
+    def _done(self, task):
+        self._task = self._loop = None
+        if task.cancelled():
+            self._result.cancel()
+        elif task.exception() is not None:
+            self._result.set_exception(task.exception())
+        else:
+            self._result.set_result(task.result())
+            return
+        self._discard(self)
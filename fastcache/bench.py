@@ -0,0 +1,282 @@
+""" Microbenchmarks of clru_cache with machine readable results.
+
+    Run as
+
+        python -m fastcache.bench [-o results.json] [--compare old.json]
+
+    Measures the time of a hit, a miss and an eviction in ns, the extra
+    cost of building the key for each shape of arguments, the memory of an
+    entry in bytes (with tracemalloc, Python 3.4+) and the hit ratios of
+    the eviction policies on Zipfian and scan-mix traces.  The results are
+    written as JSON so that the numbers of two releases or builds can be
+    compared with --compare.
+
+    Times are the minimum over the repeats of a loop over prebuilt keys,
+    divided by the number of calls.  They include the loop and the call of
+    the cached function; 'call_ns' is the same loop calling the bare
+    function for reference.
+"""
+from __future__ import division, print_function
+
+import argparse
+import bisect
+import gc
+import json
+import platform
+import sys
+import time
+from random import Random
+
+import fastcache
+from fastcache import clru_cache
+
+try:
+    import tracemalloc
+except ImportError:           # Python < 3.4
+    tracemalloc = None
+
+try:
+    _timer = time.perf_counter
+except AttributeError:
+    import timeit
+    _timer = timeit.default_timer
+
+# first key of the ranges used below, large enough that the ints are not
+# shared with the small int cache
+BASE = 1 << 20
+# maxsize of the caches timed
+MAXSIZE = 1000
+
+
+def _none(*args, **kwargs):
+    pass
+
+
+# One loop per shape of arguments, so that only the call differs.
+def _loop_scalar(f, keys):
+    for k in keys:
+        f(k)
+
+def _loop_positional(f, keys):
+    for k in keys:
+        f(k, 'spam')
+
+def _loop_keyword(f, keys):
+    for k in keys:
+        f(k, b='spam')
+
+
+# name: (loop, clru_cache options)
+SHAPES = [
+    ('scalar', _loop_scalar, {}),
+    ('positional', _loop_positional, {}),
+    ('keyword', _loop_keyword, {}),
+    ('typed', _loop_positional, {'typed': True}),
+    ('state', _loop_positional, {'state': [1, 2]}),
+]
+
+
+def _best(run, repeat):
+    """ The shortest of repeat runs of run(), which times itself. """
+    times = []
+    for _ in range(repeat):
+        gc.collect()
+        enabled = gc.isenabled()
+        gc.disable()
+        try:
+            times.append(run())
+        finally:
+            if enabled:
+                gc.enable()
+    return min(times)
+
+
+def _timed(loop, f, keys):
+    start = _timer()
+    loop(f, keys)
+    return _timer() - start
+
+
+def time_calls(n, repeat):
+    """ ns per call of the bare function, per miss and per eviction, and
+    the ns of a hit for each shape of arguments with the cost of the key
+    over the scalar lookup, which builds no key.  The eviction is the
+    difference between a miss on a full cache and one on a cache with room.
+    """
+    keys = list(range(BASE, BASE + n))
+    res = {}
+    res['call_ns'] = 1e9 * _best(lambda: _timed(_loop_scalar, _none, keys),
+                                 repeat) / n
+
+    def miss():
+        # fill caches of MAXSIZE entries from empty
+        total = 0.0
+        for i in range(0, n, MAXSIZE):
+            f = clru_cache(maxsize=MAXSIZE)(_none)
+            total += _timed(_loop_scalar, f, keys[i:i + MAXSIZE])
+        return total
+
+    def evict():
+        # misses on a full cache of MAXSIZE entries, each evicts one
+        f = clru_cache(maxsize=MAXSIZE)(_none)
+        _loop_scalar(f, range(-MAXSIZE, 0))
+        return _timed(_loop_scalar, f, keys)
+
+    res['miss_ns'] = 1e9 * _best(miss, repeat) / n
+    res['miss_evict_ns'] = 1e9 * _best(evict, repeat) / n
+    res['eviction_ns'] = res['miss_evict_ns'] - res['miss_ns']
+
+    # hits on a working set of MAXSIZE keys, as hot as in a busy cache
+    hot = keys[:MAXSIZE] * max(1, n // MAXSIZE)
+    res['hit_ns'] = {}
+    res['key_ns'] = {}
+    for name, loop, options in SHAPES:
+        f = clru_cache(maxsize=MAXSIZE, **options)(_none)
+        loop(f, hot)
+        res['hit_ns'][name] = 1e9 * _best(lambda: _timed(loop, f, hot),
+                                          repeat) / len(hot)
+    for name, _, _ in SHAPES:
+        res['key_ns'][name] = res['hit_ns'][name] - res['hit_ns']['scalar']
+    return res
+
+
+def bytes_per_entry(n):
+    """ Memory allocated by the cache per entry, for n entries of each
+    shape of arguments, with prebuilt keys and a result of None.  Includes
+    the table, the key objects and the share of the free slots.
+    """
+    if tracemalloc is None:
+        return None
+    keys = list(range(BASE, BASE + n))
+    res = {}
+    for name, loop, options in SHAPES:
+        f = clru_cache(maxsize=None, **options)(_none)
+        gc.collect()
+        tracemalloc.start()
+        try:
+            before = tracemalloc.get_traced_memory()[0]
+            loop(f, keys)
+            after = tracemalloc.get_traced_memory()[0]
+        finally:
+            tracemalloc.stop()
+        res[name] = (after - before) / n
+    return res
+
+
+def zipf_trace(n, keys, alpha=1.0, seed=0):
+    """ n calls over keys keys, key i drawn with probability ~ 1/i**alpha. """
+    total = 0.0
+    cdf = []
+    for i in range(1, keys + 1):
+        total += 1.0 / i ** alpha
+        cdf.append(total)
+    rand = Random(seed)
+    return [bisect.bisect(cdf, rand.random() * total) for _ in range(n)]
+
+
+def scan_trace(n, keys, seed=0):
+    """ The Zipfian trace with a scan of keys/10 new keys every n/20 calls. """
+    trace = zipf_trace(n, keys, seed=seed)
+    step = max(n // 20, 1)
+    length = min(keys // 10, step)
+    for i in range(0, n, step):
+        trace[i:i + length] = range(keys + i, keys + i + length)
+    return trace
+
+
+def hit_ratios(n, keys, maxsize):
+    """ Hit ratios of each policy on the Zipfian and scan-mix traces of n
+    calls over keys keys.  They do not depend on the -n option, so that
+    runs with different loop lengths compare.
+    """
+    traces = [('zipf', zipf_trace(n, keys)), ('scan', scan_trace(n, keys))]
+    res = {}
+    for name, trace in traces:
+        res[name] = {}
+        for policy in ('lru', 'clock', 'tinylfu'):
+            f = clru_cache(maxsize=maxsize, policy=policy)(_none)
+            _loop_scalar(f, trace)
+            hits, misses = f.cache_info()[:2]
+            res[name][policy] = hits / (hits + misses)
+    return res
+
+
+def run(n=100000, repeat=5):
+    """ Run all benchmarks with loops of n calls and return the results. """
+    return {
+        'meta': {
+            'fastcache': fastcache.__version__,
+            'python': platform.python_version(),
+            'implementation': platform.python_implementation(),
+            'platform': platform.platform(),
+            'gil': getattr(sys, '_is_gil_enabled', lambda: True)(),
+            'time': time.strftime('%Y-%m-%dT%H:%M:%S'),
+            'n': n,
+            'repeat': repeat,
+        },
+        'results': dict(
+            time_calls(n, repeat),
+            bytes_per_entry=bytes_per_entry(n),
+            hit_ratio=hit_ratios(200000, 10000, MAXSIZE),
+        ),
+    }
+
+
+def _flatten(results, prefix=''):
+    """ {'a': {'b': 1}} -> {'a.b': 1}, leaving out missing values. """
+    flat = {}
+    for key, value in results.items():
+        if isinstance(value, dict):
+            flat.update(_flatten(value, prefix + key + '.'))
+        elif value is not None:
+            flat[prefix + key] = value
+    return flat
+
+
+def report(results, baseline=None, out=sys.stdout):
+    """ Print the results as a table, with their change from the baseline
+    results if given.
+    """
+    flat = _flatten(results['results'])
+    old = _flatten(baseline['results']) if baseline else {}
+    for key in sorted(flat):
+        line = '{:30s} {:10.3f}'.format(key, flat[key])
+        if key in old:
+            line += ' {:10.3f}'.format(old[key])
+            if old[key]:
+                line += ' {:+7.1f}%'.format(100 * (flat[key] / old[key] - 1))
+        print(line, file=out)
+
+
+def main(args=None):
+    parser = argparse.ArgumentParser(
+        prog='python -m fastcache.bench',
+        description='Benchmark clru_cache and write the results as JSON.')
+    parser.add_argument('-o', '--output', default=None,
+                        help='Write the JSON results to this file instead '
+                             'of stdout.')
+    parser.add_argument('-n', '--number', type=int, default=100000,
+                        help='Calls per timed loop.')
+    parser.add_argument('-r', '--repeat', type=int, default=5,
+                        help='Repeats of each loop, the fastest is kept.')
+    parser.add_argument('-c', '--compare', default=None,
+                        help='JSON results of an earlier run to compare '
+                             'with, printed to stderr.')
+    args = parser.parse_args(args)
+
+    results = run(args.number, args.repeat)
+    text = json.dumps(results, indent=2, sort_keys=True) + '\n'
+    if args.output is None:
+        sys.stdout.write(text)
+    else:
+        with open(args.output, 'w') as f:
+            f.write(text)
+    baseline = None
+    if args.compare is not None:
+        with open(args.compare) as f:
+            baseline = json.load(f)
+    report(results, baseline, sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -28,6 +28,30 @@ if sys.version_info[:2] >= (3, 3):
     _py_typed = functools.lru_cache(maxsize=100, typed=True)(_typed)
     _c_typed =  fastcache.clru_cache(maxsize=100, typed=True)(_typed)
 
+    _c_hit = fastcache.clru_cache(maxsize=100)(_untyped)
+    _c_hit_typed = fastcache.clru_cache(maxsize=100, typed=True)(_untyped)
+    _dict = {42: None, "name": None, (42, "name"): None}
+
+    _c_lru = fastcache.clru_cache(maxsize=1000)(_untyped)
+    _c_clock = fastcache.clru_cache(maxsize=1000, policy='clock')(_untyped)
+
+    def _skewed_trace(n=100000, keys=10000, seed=0):
+        """ Keys drawn with a Zipf-like skew, so that most calls hit. """
+        import random
+        rand = random.Random(seed)
+        return [int(keys ** rand.random()) for _ in range(n)]
+
+    def _scan_trace(n=100000, keys=10000, seed=0):
+        """ The skewed trace interrupted by one-off scans of new keys. """
+        trace = _skewed_trace(n, keys, seed)
+        for i in range(0, n, 5000):
+            trace[i:i + 1500] = range(keys + i, keys + i + 1500)
+        return trace
+
+    def _loop_trace(n=100000, keys=1200):
+        """ A loop over slightly more keys than the cache holds. """
+        return [i % keys for i in range(n)]
+
     def _arg_gen(min=1, max=100, repeat=3):
         for i in range(min, max):
             for r in range(repeat):
@@ -100,3 +124,65 @@ for i, j in _arg_gen():
 
         _print_single_speedup(init=True)
         _print_single_speedup(results)
+
+        print("\n\nTest Suite 3 :", end='\n\n')
+        print("Latency of a cache hit in ns.  Calls with builtin scalar")
+        print("arguments (int, str, float, bytes) and no keywords are looked")
+        print("up without building a key.  A dict lookup is shown for")
+        print("reference.", end='\n\n')
+        setup = "from fastcache.benchmark import _c_hit, _c_hit_typed, _dict"
+        cases = [('dict lookup', '_dict[42]'),
+                 ('f(42)', '_c_hit(42)'),
+                 ('f("name")', '_c_hit("name")'),
+                 ('f(42, "name")', '_c_hit(42, "name")'),
+                 ('f(a=42)', '_c_hit(a=42)'),
+                 ('f(42) typed', '_c_hit_typed(42)'),
+                 ('f(42, "name") typed', '_c_hit_typed(42, "name")')]
+        print('{:29s} {:>8s}'.format('function call', 'ns/hit'))
+        number = 100000
+        for name, s in cases:
+            t = min(timeit.repeat(s, setup=setup, repeat=5, number=number))
+            print('{:29s} {:8.1f}'.format(name, 1e9*t/number))
+
+        print("\n\nTest Suite 4 :", end='\n\n')
+        print("Eviction policies on a read-heavy skewed workload of 100000")
+        print("calls over 10000 keys with maxsize=1000.  With policy='clock'")
+        print("a hit only sets a reference byte and skips the cache lock.",
+              end='\n\n')
+        setup = "from fastcache.benchmark import {}, _skewed_trace\n" + \
+                "trace = _skewed_trace()"
+        print('{:9s} {:>9s} {:>9s} {:>9s}'.format('policy', 'hit ratio',
+                                                 'ns/call', 'ns/hit'))
+        number = 100000
+        for name, f in [('lru', '_c_lru'), ('clock', '_c_clock')]:
+            func = getattr(sys.modules[__name__], f)
+            func.cache_clear()
+            t = min(timeit.repeat('for k in trace: %s(k)' % f,
+                                  setup=setup.format(f), repeat=3, number=1))
+            hits, misses = func.cache_info()[:2]
+            hit = min(timeit.repeat('%s(42)' % f, setup=setup.format(f),
+                                    repeat=5, number=number))
+            print('{:9s} {:9.3f} {:9.1f} {:9.1f}'.format(
+                name, hits/float(hits + misses), 1e9*t/number,
+                1e9*hit/number))
+
+        print("\n\nTest Suite 5 :", end='\n\n')
+        print("Hit ratios of the eviction policies on synthetic traces of")
+        print("100000 calls with maxsize=1000: the skewed trace of suite 4,")
+        print("the same with one-off scans of 1500 new keys every 5000 calls")
+        print("and a loop over 1200 keys.", end='\n\n')
+        traces = [('skewed', _skewed_trace()), ('scan', _scan_trace()),
+                  ('loop', _loop_trace())]
+        print('{:9s}'.format('policy') +
+              ''.join('{:>9s}'.format(name) for name, _ in traces))
+        for policy in ['lru', 'clock', 'tinylfu']:
+            ratios = []
+            for name, trace in traces:
+                func = fastcache.clru_cache(maxsize=1000,
+                                            policy=policy)(_untyped)
+                for k in trace:
+                    func(k)
+                hits, misses = func.cache_info()[:2]
+                ratios.append(hits/float(hits + misses))
+            print('{:9s}'.format(policy) +
+                  ''.join('{:9.3f}'.format(r) for r in ratios))
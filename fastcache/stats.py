@@ -0,0 +1,120 @@
+""" Statistics of all caches in the process.
+
+    Every cache made by clru_cache (or lru_cache) is registered with a weak
+    reference, see fastcache.all_caches().  snapshot() collects their
+    cache_stats() and export() writes them in the Prometheus text format or
+    as JSON.  Each cache is only locked, shard by shard, while its counters
+    are copied.
+"""
+from __future__ import division
+
+import json
+import os
+
+from ._lrucache import all_caches
+
+# counters and gauges exported for every cache, with their help text
+_COUNTERS = [
+    ('hits', 'Calls answered from the cache.'),
+    ('misses', 'Calls of the wrapped function.'),
+    ('evictions', 'Entries evicted to make room.'),
+    ('expirations', 'Entries dropped after their ttl.'),
+    ('eq_calls', 'Keys compared after their hashes matched.'),
+    ('duplicates', 'Results dropped as stored by another call meanwhile.'),
+    ('collected', 'Entries dropped as their weakly held key or result died.'),
+    ('contended', 'Lock acquisitions that had to wait.'),
+]
+_GAUGES = [
+    ('currsize', 'Entries in the cache.'),
+    ('maxsize', 'Bound on the entries, absent if unbounded.'),
+    ('currweight', 'Total weight of the entries.'),
+    ('maxweight', 'Bound on the total weight.'),
+]
+
+
+def _name(cache):
+    """ module.qualname of the function of a cache. """
+    name = getattr(cache, '__qualname__', None) or cache.__name__
+    return '%s.%s' % (cache.__module__, name)
+
+
+def snapshot():
+    """ Return a list with the cache_stats() dict of every live cache,
+    oldest first.  Each dict also holds the 'name' of the cache, the module
+    and qualified name of its function.
+    """
+    result = []
+    for cache in all_caches():
+        stats = cache.cache_stats()
+        stats['name'] = _name(cache)
+        result.append(stats)
+    return result
+
+
+def _escape(value):
+    return (value.replace('\\', '\\\\').replace('"', '\\"')
+            .replace('\n', '\\n'))
+
+
+def _prometheus(stats):
+    """ The stats in the Prometheus text exposition format. """
+    labels = []
+    seen = {}
+    for s in stats:
+        # caches of functions with the same name are numbered
+        n = seen[s['name']] = seen.get(s['name'], 0) + 1
+        name = s['name'] if n == 1 else '%s#%d' % (s['name'], n)
+        labels.append('cache="%s"' % _escape(name))
+
+    lines = []
+    def metric(name, kind, doc, key):
+        lines.append('# HELP fastcache_%s %s' % (name, doc))
+        lines.append('# TYPE fastcache_%s %s' % (name, kind))
+        for s, label in zip(stats, labels):
+            if s.get(key) is not None:
+                lines.append('fastcache_%s{%s} %s' % (name, label, s[key]))
+    for key, doc in _COUNTERS:
+        metric(key + '_total', 'counter', doc, key)
+    for key, doc in _GAUGES:
+        metric(key, 'gauge', doc, key)
+
+    lines.append('# HELP fastcache_miss_seconds Time of the calls on '
+                 'misses.')
+    lines.append('# TYPE fastcache_miss_seconds histogram')
+    for s, label in zip(stats, labels):
+        total = 0
+        for i, count in enumerate(s['miss_time']):
+            total += count
+            le = (repr(2 ** i * 1e-6) if i < len(s['miss_time']) - 1
+                  else '+Inf')
+            lines.append('fastcache_miss_seconds_bucket{%s,le="%s"} %d' %
+                         (label, le, total))
+        lines.append('fastcache_miss_seconds_sum{%s} %r' %
+                     (label, s['miss_seconds']))
+        lines.append('fastcache_miss_seconds_count{%s} %d' % (label, total))
+    return '\n'.join(lines) + '\n'
+
+
+def export(path=None, format='prometheus'):
+    """ Export the statistics of all caches.
+
+    *format* is 'prometheus' for the Prometheus text format or 'json'.  The
+    text is returned if *path* is None and written to that file otherwise,
+    through a temporary file renamed over it, so that a reader such as the
+    node exporter's textfile collector never sees a partial file.
+    """
+    if format == 'prometheus':
+        text = _prometheus(snapshot())
+    elif format == 'json':
+        text = json.dumps(snapshot(), sort_keys=True) + '\n'
+    else:
+        raise ValueError("format must be 'prometheus' or 'json'")
+    if path is None:
+        return text
+    tmp = '%s.%d.tmp' % (path, os.getpid())
+    with open(tmp, 'w') as f:
+        f.write(text)
+    try:
+        os.replace(tmp, path)
+    except AttributeError:        # Python 2, rename replaces on POSIX
+        os.rename(tmp, path)
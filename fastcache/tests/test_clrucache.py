@@ -2,6 +2,11 @@ import pytest
 import fastcache
 import itertools
 import warnings
+import sys
+import random
+import inspect
+import os
+import textwrap
 
 try:
     itertools.count(start=0, step=-1)
@@ -90,6 +95,37 @@ def test_memory_leaks(cache):
     for i, j in arg_gen(max=1500, repeat=5):
         assert cfunc(i, j, c=i-j) == tfunc(i, j, c=i-j)
 
+def test_gc_cycles(cache):
+    """ Cycles through cached results and keys are collected. """
+    import gc, weakref
+
+    @cache(maxsize=None)
+    def cfunc(x):
+        return [cfunc, x]
+    cfunc(1)
+    ref = weakref.ref(cfunc)
+    del cfunc
+    gc.collect()
+    assert ref() is None
+
+    class A(object):
+        @cache(maxsize=10)
+        def method(self):
+            return 1
+    a = A()
+    assert a.method() == 1
+    ref = weakref.ref(a)
+    del A, a
+    gc.collect()
+    assert ref() is None
+
+    # stored tuples of plain values are not tracked
+    cfunc = cache(maxsize=None)(lambda x: (x, 'a'))
+    assert not gc.is_tracked(cfunc(1))
+    assert gc.is_tracked(cache(maxsize=None)(lambda x: (x, []))(1))
+    if cache is fastcache.clru_cache:
+        assert cfunc(1) in gc.get_referents(cfunc)
+
 def test_warn_unhashable_args(cache, recwarn):
     """ Function arguments must be hashable. """
 
@@ -172,3 +208,924 @@ def test_dynamic_attribute(cache):
     cfunc = cache()(f)
     cfunc.new_attr = 5
     assert cfunc.new_attr == 5
+
+def test_call_paths(cache):
+    """ Keys agree whether arguments arrive as a vector or a tuple/dict. """
+
+    for typed in (False, True):
+        @cache(typed=typed)
+        def cfunc(a, b=0, c=0):
+            return a + b + c
+
+        assert cfunc(1, b=2, c=3) == 6
+        assert cfunc(1, c=3, b=2) == 6
+        assert cfunc.__call__(1, b=2, c=3) == 6
+        assert cfunc(*(1, ), **{'c': 3, 'b': 2}) == 6
+        assert cfunc(1, 2, 3) == 6
+        assert cfunc.__call__(1, 2, 3) == 6
+        hits, misses, maxsize, currsize = cfunc.cache_info()
+        assert misses == 2
+        assert hits == 4
+
+def test_builtin_argument_keys(cache):
+    """ Builtin scalar arguments share the cache with other keys. """
+
+    @cache(maxsize=100)
+    def cfunc(*args):
+        return args
+
+    args = [(1, ), (1.0, ), ('a', ), (b'a', ), ((1, ), ), ((1, 2), ),
+            (1, 2), (1.0, 2), (1, 'a', b'a'), (None, ), ()]
+    for a in args:
+        assert cfunc(*a) == a
+    for a in args:
+        assert cfunc(*a) == a
+    hits, misses, maxsize, currsize = cfunc.cache_info()
+    assert misses == 9
+    assert hits == 13
+
+    # hits on builtin arguments must not allocate
+    if not hasattr(sys, 'getallocatedblocks'):
+        return
+    def run(n):
+        for i in range(n):
+            cfunc(1)
+            cfunc(1, 'a', b'a')
+    run(10)
+    blocks = sys.getallocatedblocks()
+    run(1000)
+    assert sys.getallocatedblocks() - blocks < 10
+
+def test_entry_reuse(cache):
+    """ Entries freed by evictions are reused without disturbing the LRU
+    order of the others. """
+    from collections import OrderedDict
+
+    @cache(maxsize=64)
+    def cfunc(*args):
+        return args
+
+    rand = random.Random(0)
+    model = OrderedDict()
+    hits = misses = 0
+    for i in range(20000):
+        a = rand.randrange(100)
+        args = [(a, ), (a, 'x'), ((a, ), )][a % 3]
+        if args in model:
+            model.pop(args)
+            hits += 1
+        else:
+            misses += 1
+            if len(model) == 64:
+                model.popitem(last=False)
+        model[args] = True
+        assert cfunc(*args) == args
+    assert cfunc.cache_info() == (hits, misses, 64, 64)
+
+def test_clear_releases(cache):
+    """ cache_clear releases the old entries before it returns. """
+    import gc
+    import weakref
+
+    class Result(object):
+        pass
+
+    @cache(maxsize=None)
+    def f(x):
+        return Result()
+
+    ref = weakref.ref(f(0))
+    f.cache_clear()
+    gc.collect()
+    assert ref() is None
+    refs = [weakref.ref(f(i)) for i in range(1000)]
+    f.cache_clear()
+    gc.collect()
+    assert all(r() is None for r in refs)
+    assert f.cache_info() == (0, 0, None, 0)
+    f.cache_clear()
+    assert f.cache_info() == (0, 0, None, 0)
+
+
+@pytest.mark.parametrize('policy', ['lru', 'clock', 'tinylfu'])
+def test_cache_resize(cache, policy):
+    """ cache_resize keeps the entries that fit the new maxsize. """
+    @cache(maxsize=4, policy=policy)
+    def f(x):
+        return [x]
+
+    for i in range(4):
+        f(i)
+    f.cache_resize(100)
+    assert f.cache_info() == (0, 4, 100, 4)
+    for i in range(4, 100):
+        f(i)
+    assert f.cache_info().currsize == 100
+    f(2)
+    f.cache_resize(10)
+    assert f.cache_info().currsize == 10
+    assert f.cache_info().maxsize == 10
+    assert f.cache_stats()['evictions'] == 90
+    if policy == 'lru':
+        assert f(2) == [2] and f.cache_info().hits == 2     # recently used
+        assert f(4) == [4] and f.cache_info().misses == 101
+    for i in range(50):
+        f(i)
+    assert f.cache_info().currsize == 10
+
+    with pytest.raises(ValueError):
+        f.cache_resize(0)
+    with pytest.raises(TypeError):
+        f.cache_resize('10')
+
+    @cache(maxsize=None)
+    def g(x):
+        return x
+    with pytest.raises(ValueError):
+        g.cache_resize(10)
+
+    @cache(maxsize=8, shards=4)
+    def h(x):
+        return x
+    with pytest.raises(ValueError):
+        h.cache_resize(2)
+    for i in range(8):
+        h(i)
+    h.cache_resize(4)
+    assert h.cache_info().currsize <= 4
+
+
+def test_reentrant_table_changes():
+    """ Lookups survive changes made to the cache by __eq__ and __del__. """
+
+    @fastcache.clru_cache(maxsize=None)
+    def cfunc(x):
+        return x
+
+    class Key(object):
+        def __init__(self, value, action=None):
+            self.value = value
+            self.action = action
+        def __hash__(self):
+            return 1
+        def __eq__(self, other):
+            if self.action is not None:
+                action, self.action = self.action, None
+                action()
+            return isinstance(other, Key) and self.value == other.value
+
+    # clear the cache in the middle of a lookup
+    stored = cfunc(Key(1))
+    stored.action = cfunc.cache_clear
+    k = Key(1)
+    assert cfunc(k) is k
+    assert cfunc.cache_info().currsize == 1
+
+    # grow the table in the middle of a lookup
+    stored = cfunc(Key(2))
+    stored.action = lambda: [cfunc(i) for i in range(1000)]
+    assert cfunc(Key(2)) is stored
+    assert cfunc.cache_info().currsize == 1002
+
+    # evicted results may call back into the cache when released
+    class Result(object):
+        def __del__(self):
+            lfunc(-1)
+
+    @fastcache.clru_cache(maxsize=2)
+    def lfunc(x):
+        return Result() if x >= 0 else None
+
+    for i in range(20):
+        lfunc(i)
+    assert lfunc.cache_info().currsize == 2
+
+def test_shards(cache):
+    """ A sharded cache splits maxsize between its shards. """
+
+    for shards in (1, 3, 8):
+        @cache(maxsize=20, shards=shards)
+        def f(x):
+            return x
+
+        for i in range(100):
+            assert f(i) == i
+        hits, misses, maxsize, currsize = f.cache_info()
+        assert (hits, misses, maxsize, currsize) == (0, 100, 20, 20)
+        # the most recent calls are in the cache
+        for i in range(96, 100):
+            f(i)
+        assert f.cache_info().hits == 4
+        f.cache_clear()
+        assert f.cache_info() == (0, 0, 20, 0)
+
+    # more shards than room in the cache
+    @cache(maxsize=3, shards=64)
+    def g(x):
+        return x
+    for i in range(10):
+        g(i)
+    assert g.cache_info().currsize <= 3
+
+    @cache(maxsize=None, shards=4)
+    def h(x):
+        return x
+    for i in range(1000):
+        h(i)
+    assert h.cache_info() == (0, 1000, None, 1000)
+
+    for bad in (0, -1, 10**6):
+        with pytest.raises(ValueError):
+            cache(shards=bad)(len)
+    with pytest.raises(TypeError):
+        cache(shards=1.5)(len)
+
+def test_clock_policy(cache):
+    """ CLOCK gives referenced entries a second chance before eviction. """
+
+    calls = []
+    @cache(maxsize=4, policy='clock')
+    def f(x):
+        calls.append(x)
+        return x
+
+    for i in range(4):
+        f(i)
+    f(0)                      # mark 0 as referenced
+    f(4)                      # evicts 1, the oldest unreferenced entry
+    del calls[:]
+    for i in (0, 2, 3, 4):
+        f(i)
+    assert calls == []
+    f(1)
+    assert calls == [1]
+    assert f.cache_info() == (5, 6, 4, 4)
+
+    rand = random.Random(0)
+    for i in range(10000):
+        x = rand.randint(0, 20)
+        assert f(x) == x
+    assert f.cache_info().currsize == 4
+
+    @cache(maxsize=None, policy='clock')
+    def g(x):
+        return x
+    for i in range(100):
+        g(i % 10)
+    assert g.cache_info() == (90, 10, None, 10)
+
+    with pytest.raises(ValueError):
+        cache(policy='fifo')(len)
+
+def test_tinylfu_policy(cache):
+    """ TinyLFU keeps frequently used entries through a scan. """
+
+    calls = []
+    @cache(maxsize=100, policy='tinylfu')
+    def f(x):
+        calls.append(x)
+        return x
+
+    for r in range(10):
+        for i in range(50):
+            assert f(i) == i
+    for i in range(1000, 1300):
+        assert f(i) == i      # one-off keys, an LRU cache would keep these
+    del calls[:]
+    for i in range(50):
+        f(i)
+    assert calls == []
+    info = f.cache_info()
+    assert info.currsize == 100
+    assert info.hits + info.misses == 850
+
+    rand = random.Random(0)
+    for i in range(10000):
+        x = int(1000 ** rand.random())
+        assert f(x) == x
+    assert f.cache_info().currsize == 100
+    f.cache_clear()
+    assert f.cache_info() == (0, 0, 100, 0)
+
+    with pytest.raises(ValueError):
+        cache(maxsize=None, policy='tinylfu')(len)
+
+@pytest.mark.skipif(not hasattr(inspect, 'iscoroutinefunction'),
+                    reason='requires coroutines')
+def test_coroutine(cache):
+    """ Coroutine functions share one call between all their callers. """
+
+    import asyncio
+    calls = []
+    ns = {'asyncio': asyncio, 'calls': calls}
+    # defined through exec so that this module still compiles on Python 2
+    exec(textwrap.dedent("""
+        async def fetch(x):
+            calls.append(x)
+            await asyncio.sleep(0.01 if x == 7 else 0)
+            if x < 0:
+                raise ValueError(x)
+            return 2 * x
+        """), ns)
+    f = cache(maxsize=10)(ns['fetch'])
+
+    async def main():
+        a, b = f(1), f(1)
+        assert a is not b
+        assert await asyncio.gather(a, b) == [2, 2]
+        assert await f(1) == 2
+        assert calls == [1]
+
+        with pytest.raises(ValueError):
+            await f(-1)
+        await asyncio.sleep(0)    # let the done callback run
+        with pytest.raises(ValueError):
+            await f(-1)
+        assert calls == [1, -1, -1]
+
+        task = asyncio.ensure_future(f(5))
+        task.cancel()
+        with pytest.raises(asyncio.CancelledError):
+            await task
+        assert await f(5) == 10
+        assert calls == [1, -1, -1, 5]  # cancelled before it started
+
+        # a caller that gives up does not cancel the call for the others
+        waiting = asyncio.ensure_future(f(7))
+        with pytest.raises(asyncio.TimeoutError):
+            await asyncio.wait_for(f(7), 0.001)
+        assert await waiting == 14
+        assert await f(7) == 14
+        assert calls == [1, -1, -1, 5, 7]
+
+    loop = asyncio.new_event_loop()
+    try:
+        loop.run_until_complete(main())
+    finally:
+        loop.close()
+    assert f.cache_info().currsize == 3
+
+    # each call returns a new coroutine, which any event loop can run
+    if hasattr(asyncio, 'run'):
+        assert asyncio.run(f(8)) == 16
+        assert asyncio.run(f(8)) == 16
+        assert asyncio.run(f(1)) == 2
+        assert calls == [1, -1, -1, 5, 7, 8]
+
+
+def test_cache_map(cache):
+    """ Batches look up and store many calls at once. """
+
+    calls = []
+    @cache(maxsize=10, shards=2)
+    def f(x, y=0):
+        calls.append(x)
+        return 10 * x + y
+
+    assert f(1) == 10
+    assert f.cache_map([(1,), (2,), (2,), (3, 1)]) == [10, 20, 20, 31]
+    assert calls == [1, 2, 3]
+    assert f.cache_info() == (2, 3, 10, 3)
+    assert f.cache_map(iter([])) == []
+
+    loads = []
+    def loader(keys):
+        loads.append(keys)
+        return [-k for k in keys]
+    assert f.cache_get_many([2, 4, 5, 4], loader) == {2: 20, 4: -4, 5: -5}
+    assert loads == [[4, 5]]
+    assert f(4) == -4
+    assert calls == [1, 2, 3]
+    assert f.cache_get_many([4, 6]) == {4: -4, 6: 60}
+
+    with pytest.raises(ValueError):
+        f.cache_get_many([7], loader=lambda keys: [])
+    with pytest.raises(TypeError):
+        f.cache_map([7])
+    with pytest.raises(ZeroDivisionError):
+        f.cache_map([(8,), (0, 1), (9,)], loader=lambda args: 1 // 0)
+    assert f.cache_info().currsize == 6
+
+def _dumped(x, y=0):
+    return [x, y]
+
+def test_dump_load(cache, tmpdir):
+    """ Entries written by cache_dump are read back by cache_load. """
+
+    path = str(tmpdir.join('cache.dump'))
+    f = cache(maxsize=4)(_dumped)
+    for args in [(1,), ('a', 2), (3,), (1,)]:
+        f(*args)
+    f(4, y=5)
+    assert f.cache_dump(path) == 4
+
+    g = cache(maxsize=4)(_dumped)
+    assert g.cache_load(path) == 4
+    assert g.cache_info() == (0, 0, 4, 4)
+    g(6)                      # evicts ('a', 2), the least recently used
+    assert [g(1), g(3), g(4, y=5), g(6)] == [[1, 0], [3, 0], [4, 5], [6, 0]]
+    assert g.cache_info() == (4, 1, 4, 4)
+    g('a', 2)
+    assert g.cache_info().misses == 2
+
+    # entries keep their age and expire on time
+    now = [0.0]
+    f = cache(ttl=10, clock=lambda: now[0])(_dumped)
+    f(1)
+    now[0] = 8
+    f(2)
+    f.cache_dump(path)
+    g = cache(ttl=10, clock=lambda: now[0])(_dumped)
+    assert g.cache_load(path) == 2
+    now[0] = 11
+    g(1)
+    g(2)
+    assert g.cache_info()[:2] == (1, 1)
+
+    class Repr(object):
+        dumps = staticmethod(lambda obj: repr(obj).encode())
+        loads = staticmethod(lambda b: eval(bytes(b).decode()))
+    assert f.cache_dump(path, serializer=Repr) == 1   # f(1) expired
+    assert g.cache_load(path, Repr) == 1
+
+    with pytest.raises(ValueError):
+        cache()(lambda x: x).cache_load(path)
+    with open(path, 'wb') as fp:
+        fp.write(b'not a cache dump')
+    with pytest.raises(ValueError):
+        g.cache_load(path)
+
+@pytest.mark.skipif(not hasattr(os, 'fork') or sys.platform == 'win32',
+                    reason="the shared tier needs fork")
+def test_shared(cache, tmpdir):
+    """ A result computed in one process is a hit in another. """
+
+    path = str(tmpdir.join('cache.shm'))
+    calls = []
+    def make():
+        @cache(maxsize=2, shared=path, shared_size=1 << 20)
+        def f(x, y=0):
+            calls.append(x)
+            return [x, y]
+        return f
+
+    pid = os.fork()
+    if pid == 0:
+        f = make()
+        ok = [f(x, 1) for x in range(10)] == [[x, 1] for x in range(10)]
+        os._exit(0 if ok and len(calls) == 10 else 1)
+    assert os.waitpid(pid, 0)[1] == 0
+
+    f = make()
+    assert [f(x, 1) for x in range(10)] == [[x, 1] for x in range(10)]
+    assert calls == []
+    assert f.cache_info()[:2] == (10, 0)
+    f(3)                      # other arguments, a miss
+    f.cache_clear()           # local only
+    f(3)
+    assert calls == [3]
+    assert f.cache_map([(4,), (5, 1)]) == [[4, 0], [5, 1]]
+    assert calls == [3, 4]
+
+    # a function of another name does not see the results
+    g = cache(maxsize=2, shared=path)(lambda x, y=0: calls.append(x))
+    g(5, 1)
+    assert calls == [3, 4, 5]
+
+    with pytest.raises(TypeError):
+        cache(shared_size=1 << 20)(lambda x: x)
+    with pytest.raises(ValueError):
+        cache(shared=path, shared_size=1)(lambda x: x)
+    with pytest.raises(ValueError):
+        cache(maxsize=0, shared=path)(lambda x: x)
+    with open(path, 'wb') as fp:
+        fp.write(b'not a shared cache' * 100)
+    with pytest.raises(ValueError):
+        cache(shared=path)(lambda x: x)
+
+    # files others could write to, or links to them, are refused
+    path = str(tmpdir.join('other.shm'))
+    cache(shared=path)(lambda x: x)
+    os.chmod(path, 0o620)
+    with pytest.raises(OSError):
+        cache(shared=path)(lambda x: x)
+    os.chmod(path, 0o600)
+    link = str(tmpdir.join('link.shm'))
+    os.symlink(path, link)
+    with pytest.raises(OSError):
+        cache(shared=link)(lambda x: x)
+
+def test_expiry(cache):
+    """ Entries expire after they were stored or last used. """
+
+    now = [1000.0]
+    clock = lambda: now[0]
+
+    calls = []
+    @cache(maxsize=10, ttl=10, clock=clock)
+    def f(x):
+        calls.append(x)
+        return x
+
+    f(1)
+    now[0] += 9.9
+    f(1)
+    assert calls == [1]
+    now[0] += 0.1
+    f(1)
+    assert calls == [1, 1]
+    assert f.cache_info() == (1, 2, 10, 1)
+
+    del calls[:]
+    @cache(maxsize=None, expire_after_access=10, expire_after_write=25,
+           clock=clock)
+    def g(x):
+        calls.append(x)
+        return x
+
+    for dt in (0, 8, 8, 8):
+        now[0] += dt
+        g(1)
+    assert calls == [1]
+    now[0] += 1            # 25 seconds after it was stored
+    g(1)
+    assert calls == [1, 1]
+    now[0] += 10.5         # not used for 10 seconds
+    g(1)
+    assert calls == [1, 1, 1]
+
+    # expired entries are reaped in bulk as time passes
+    @cache(maxsize=None, ttl=1, clock=clock, policy='clock')
+    def h(x):
+        return x
+    for i in range(1000):
+        h(i)
+    assert h.cache_info().currsize == 1000
+    now[0] += 1.5
+    assert h(0) == 0
+    assert h.cache_info() == (0, 1001, None, 1)
+
+    for kwargs in ({'ttl': 0}, {'ttl': -1}, {'expire_after_access': 'a'},
+                   {'ttl': 1, 'expire_after_write': 1}, {'clock': 1}):
+        with pytest.raises((TypeError, ValueError)):
+            cache(**kwargs)(len)
+
+    def bad_clock():
+        raise ZeroDivisionError
+    with pytest.raises(ZeroDivisionError):
+        cache(ttl=1, clock=bad_clock)(lambda x: x)('a')
+
+    # the builtin clock
+    @cache(maxsize=10, ttl=60)
+    def k(x):
+        return [x]
+    assert k(1) is k(1)
+
+def test_maxweight(cache):
+    """ Weighted caches evict until the total weight fits. """
+
+    @cache(maxsize=None, maxweight=10, weigher=len)
+    def f(x):
+        return 'a' * x
+
+    for x in (3, 3, 4):
+        f(x)
+    info = f.cache_info()
+    assert (info.currsize, info.maxweight, info.currweight) == (2, 10, 7)
+    f(1)
+    f(3)                      # refresh 3 so that 4 is the oldest
+    f(5)                      # evicts 4
+    info = f.cache_info()
+    assert (info.hits, info.currsize, info.currweight) == (2, 3, 9)
+    f(11)                     # too heavy to be cached
+    assert f.cache_info().currweight == 9
+    f.cache_clear()
+    assert f.cache_info() == (0, 0, None, 0, 10, 0)
+
+    # both bounds apply
+    @cache(maxsize=2, maxweight=100, weigher=len)
+    def g(x):
+        return 'a' * x
+    for x in (1, 2, 3):
+        g(x)
+    assert g.cache_info()[2:] == (2, 2, 100, 5)
+
+    import array
+    @cache(maxsize=None, maxweight=10**6, weigher='nbytes')
+    def h(x):
+        return array.array('d', range(x)) if isinstance(x, int) else x
+    h(10)
+    h(b'abc')
+    assert h.cache_info().currweight == 83
+    h(None)                   # no buffer, weighed with sys.getsizeof
+    assert h.cache_info().currweight == 83 + sys.getsizeof(None)
+
+    @cache(maxweight=10**6)
+    def k(x):
+        return (x,)
+    k(1)
+    assert k.cache_info().currweight == sys.getsizeof((1,))
+
+    @cache(maxweight=10, weigher=lambda r: r)
+    def neg(x):
+        return x
+    with pytest.raises(ValueError):
+        neg(-1)
+    with pytest.raises(TypeError):
+        neg('a')
+    assert neg.cache_info().currsize == 0
+
+    for kwargs in ({'maxweight': 0}, {'maxweight': 'a'},
+                   {'maxweight': 1, 'weigher': 'len'}, {'weigher': len}):
+        with pytest.raises((TypeError, ValueError)):
+            cache(**kwargs)(lambda x: x)
+
+def test_weak_values(cache):
+    """ Entries go away with their weakly held results. """
+
+    class Result(object):
+        pass
+
+    calls = []
+    @cache(maxsize=None, weak_values=True)
+    def f(x):
+        calls.append(x)
+        return Result() if x >= 0 else x
+    r = f(1)
+    assert f(1) is r
+    assert f.cache_info().currsize == 1
+    del r
+    assert f.cache_info().currsize == 0
+    assert f.cache_stats()['collected'] == 1
+    f(1)                      # dropped at once, nothing else holds it
+    assert calls == [1, 1]
+    f(-1)                     # an int cannot be held weakly
+    f(-1)
+    assert calls == [1, 1, -1, -1]
+    assert f.cache_info().currsize == 0
+
+    # cache_map stores weakly as well
+    @cache(maxsize=2, weak_values=True)
+    def g(x):
+        return Result()
+    rs = g.cache_map([(1,), (2,), (3,)])
+    assert g.cache_info().currsize == 2
+    assert g(3) is rs[2]
+    del rs
+    assert g.cache_info().currsize == 0
+
+def test_weak_keys(cache, tmpdir):
+    """ Entries go away with their weakly held keys. """
+
+    class A(object):
+        def __init__(self, x):
+            self.x = x
+        def __eq__(self, other):
+            return self.x == other.x
+        def __hash__(self):
+            return hash(self.x)
+
+        @cache(maxsize=10, weak_keys=True)
+        def double(self):
+            return [self.x] * 2
+
+    a, b = A(1), A(2)
+    assert a.double() == [1, 1]
+    assert a.double() is a.double()
+    assert A(1).double() is a.double()      # keys compare by equality
+    b.double()
+    info = A.double.cache_info()
+    assert (info.hits, info.currsize) == (4, 2)
+    del a
+    assert A.double.cache_info().currsize == 1
+    assert A.double.cache_stats()['collected'] == 1
+    A.double.cache_clear()
+    assert A.double.cache_info().currsize == 0
+    assert b.double() == [2, 2]
+
+    # other calls are made without caching
+    @cache(maxsize=None, weak_keys=True)
+    def f(*args):
+        return len(args)
+    assert f(1) == f(1) == 1
+    assert f(A(1), A(2)) == 2
+    assert f.cache_info() == (0, 3, None, 0)
+    keys = [A(i) for i in range(5)]
+    assert f.cache_map([(k,) for k in keys]) == [1] * 5
+    assert f.cache_info().currsize == 5
+    del keys
+    assert f.cache_info().currsize == 0
+
+    with pytest.raises(TypeError):
+        f.cache_dump(str(tmpdir.join('weak.dump')))
+    for kwargs in ({'typed': True}, {'state': []}):
+        with pytest.raises(ValueError):
+            cache(weak_keys=True, **kwargs)(lambda x: x)
+
+def test_cached_method():
+    """ Every instance has a cache of its own, freed with the instance. """
+    import gc
+    import weakref
+
+    calls = []
+
+    class A(object):
+        __hash__ = None                 # instances need not be hashable
+
+        def __init__(self, x):
+            self.x = x
+
+        @fastcache.cached_method(maxsize=2)
+        def add(self, y, z=0):
+            """ Add to x. """
+            calls.append(y)
+            return [self.x + y + z]
+
+    a, b = A(1), A(10)
+    assert a.add(1) == [2]
+    assert a.add(1) is a.add(1)
+    assert b.add(1) == [11]
+    assert A.add(a, 1) is a.add(1)
+    assert a.add(1, z=1) == [3]
+    assert calls == [1, 1, 1]
+    assert a.add.cache_info() == (4, 2, 2, 2)
+    assert b.add.cache_info() == (0, 1, 2, 1)
+    assert a.add is a.add
+    assert A.add.__name__ == 'add'
+    assert A.add.__doc__ == A.add.__wrapped__.__doc__
+    assert A.add.__wrapped__(a, 2) == [3]
+
+    ref = weakref.ref(a.add)
+    del a
+    gc.collect()
+    assert ref() is None
+    assert b.add(1) == [11]
+
+    with pytest.raises(TypeError):
+        A.add()
+
+    class B(object):
+        __slots__ = ()
+
+        @fastcache.cached_method()
+        def f(self):
+            return 1
+
+    with pytest.raises(TypeError):
+        B().f()
+    with pytest.raises(ValueError):
+        fastcache.cached_method(shared='x')
+
+
+def test_cached_method_instance_dict():
+    """ Per-instance caches live in the instance __dict__, where the cycle
+    collector sees them, and copies of an instance get caches of their own.
+    """
+    import copy
+    import gc
+    import weakref
+
+    class A(object):
+        def __init__(self, x):
+            self.x = x
+
+        @fastcache.cached_method()
+        def pair(self, y):
+            return (self, self.x + y)
+
+    a = A(1)
+    assert a.pair(1) == (a, 2)
+    assert vars(a)['__cached_method_pair'] is a.pair
+    ref = weakref.ref(a)
+    del a
+    gc.collect()
+    assert ref() is None
+
+    a, b = A(1), A(2)
+    a.pair.tag = 'a'
+    assert not hasattr(b.pair, 'tag')
+    assert a.pair.tag == 'a'
+
+    a.pair(1)
+    c = copy.copy(a)
+    c.x = 10
+    assert c.pair(1) == (c, 11)
+    assert c.pair is not a.pair
+    d = copy.deepcopy(a)
+    assert d.pair(1) == (d, 2) and d.pair.cache_info().hits == 0
+
+    class S(object):
+        __slots__ = ('__weakref__',)
+
+        @fastcache.cached_method()
+        def f(self, y):
+            return y
+
+    s = S()
+    assert s.f(1) == 1 and s.f(1) == 1
+    assert s.f.cache_info().hits == 1
+
+
+def test_cache_stats(cache):
+    """ cache_stats reports evictions, comparisons, duplicates and times. """
+
+    now = [0.0]
+    nested = [True]
+    @cache(maxsize=3, ttl=10, clock=lambda: now[0])
+    def f(x):
+        if x == 'again' and nested:
+            nested.pop()
+            f(x)              # stores the key before this call does
+        return x
+
+    for x in range(5):
+        f(x)
+    now[0] = 20
+    f(0)                      # reaps the expired entries
+    f('again')
+    stats = f.cache_stats()
+    info = f.cache_info()
+    assert (stats['hits'], stats['misses'], stats['maxsize'],
+            stats['currsize']) == info
+    assert stats['evictions'] == 2
+    assert stats['expirations'] == 3
+    assert stats['duplicates'] == 1
+    assert stats['contended'] == 0
+    assert len(stats['miss_time']) == 24
+    assert sum(stats['miss_time']) == 8
+    f.cache_clear()
+    stats = f.cache_stats()
+    assert stats['evictions'] == stats['expirations'] == 0
+    assert sum(stats['miss_time']) == 0
+
+    class Key(object):
+        def __hash__(self):
+            return 1
+    @cache(maxsize=None)
+    def g(x):
+        return x
+    keys = [Key() for i in range(3)]
+    for k in keys:
+        g(k)
+    assert g.cache_stats()['eq_calls'] >= 3
+    assert g.cache_stats()['maxsize'] is None
+
+def test_registry(cache, tmpdir):
+    """ all_caches finds live caches, whose stats can be exported. """
+
+    import gc, json
+    def registered(f):
+        return f.cache_info in [c.cache_info for c in fastcache.all_caches()]
+
+    @cache(maxsize=2)
+    def f(x):
+        return x
+    f(1)
+    f(1)
+    assert registered(f)
+    name = '%s.%s' % (f.__module__, getattr(f, '__qualname__', f.__name__))
+    stats = [s for s in fastcache.stats_snapshot() if s['name'] == name][-1]
+    assert (stats['hits'], stats['misses']) == (1, 1)
+
+    text = fastcache.export_stats()
+    assert '# TYPE fastcache_hits_total counter' in text
+    assert 'fastcache_miss_seconds_bucket{cache="%s",le="+Inf"} 1' % (
+        stats['name']) in text
+
+    path = str(tmpdir.join('stats.json'))
+    assert fastcache.export_stats(path, format='json') is None
+    with open(path) as fp:
+        assert stats['name'] in [s['name'] for s in json.load(fp)]
+    with pytest.raises(ValueError):
+        fastcache.export_stats(format='xml')
+
+    gc.collect()
+    n = len(fastcache.all_caches())
+    del f, stats
+    gc.collect()
+    assert len(fastcache.all_caches()) == n - 1
+
+def test_cache_mrc(cache):
+    """ cache_mrc estimates the hit ratio at other sizes. """
+
+    @cache(maxsize=10, mrc=1.0)
+    def f(x):
+        return x
+    for i in range(1000):     # a loop over 100 keys only hits in 100 entries
+        f(i % 100)
+    assert f.cache_info().hits == 0
+    assert f.cache_mrc([64, 128, 1000]) == [(64, 0.0), (128, 0.9),
+                                            (1000, 0.9)]
+    sizes = [s for s, ratio in f.cache_mrc()]
+    assert sizes[:5] == [1, 2, 4, 8, 10] and sizes[-1] >= 100
+
+    f.cache_clear()
+    f(1)
+    f(1)
+    assert f.cache_mrc([1]) == [(1, 0.5)]
+
+    with pytest.raises(ValueError):
+        cache()(lambda x: x).cache_mrc()
+    for rate in (0, 2, 'a'):
+        with pytest.raises((TypeError, ValueError)):
+            cache(mrc=rate)(lambda x: x)
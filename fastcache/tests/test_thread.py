@@ -33,6 +33,11 @@ from random import randint
 import unittest
 from fastcache import clru_cache as lru_cache
 from threading import Thread
+from time import sleep
+try:
+    from threading import Barrier
+except ImportError:
+    Barrier = None
 try:
     from sys import setswitchinterval as setinterval
 except ImportError:
@@ -105,3 +110,59 @@ class Test_Threading(unittest.TestCase):
         hits, misses, maxsize, currsize = fib.cache_info()
         self.assertEqual(misses, CACHE_SIZE)
         self.assertEqual(currsize, CACHE_SIZE)
+
+    @unittest.skipIf(Barrier is None, "requires threading.Barrier")
+    def test_single_flight(self):
+        """ Concurrent misses on one key call the function once. """
+        setinterval(5e-3)
+        calls = []
+        barrier = Barrier(self.numthreads)
+
+        @lru_cache(maxsize=16, single_flight=True)
+        def slow(x):
+            calls.append(x)
+            sleep(0.05)
+            if x < 0:
+                raise ValueError(x)
+            return [x]
+
+        def run(x, out):
+            barrier.wait()
+            try:
+                out.append(slow(x))
+            except ValueError as e:
+                out.append(e)
+
+        out = []
+        run_threads([Thread(target=run, args=(1, out))
+                     for _ in range(self.numthreads)])
+        self.assertEqual(calls, [1])
+        self.assertTrue(all(r is out[0] for r in out))
+        hits, misses, _, currsize = slow.cache_info()
+        self.assertEqual((hits, misses, currsize), (self.numthreads - 1, 1, 1))
+
+        # an exception is shared by the waiters but not cached
+        out = []
+        run_threads([Thread(target=run, args=(-1, out))
+                     for _ in range(self.numthreads)])
+        self.assertEqual(calls, [1, -1])
+        self.assertEqual(len(out), self.numthreads)
+        self.assertTrue(all(isinstance(e, ValueError) for e in out))
+        self.assertEqual(slow.cache_info().currsize, 1)
+        self.assertRaises(ValueError, slow, -1)
+        self.assertEqual(calls, [1, -1, -1])
+
+    def test_single_flight_recursion(self):
+        """ A flight owner calling back into the cache never waits. """
+
+        @lru_cache(maxsize=None, single_flight=True)
+        def same(n):
+            same.calls += 1
+            return same(n) if same.calls < 3 else n
+        same.calls = 0
+
+        threads = [Thread(target=same, args=(7,))
+                   for _ in range(self.numthreads)]
+        run_threads(threads)
+        self.assertEqual(same(7), 7)
+        self.assertEqual(same.cache_info().currsize, 1)
@@ -0,0 +1,132 @@
+"""Benchmark and stress test for the shared tier (shared=path).
+
+Forked worker processes cache the same function with a shared file behind
+their local caches.  The benchmark runs every worker over the same keys and
+reports how many calls each one made: with the shared tier a key is only
+computed by the first worker to miss on it, the others load the result.
+
+The stress test uses a small file so the arena is cleared over and over
+while all workers read and write it, and checks every result against the
+value it must have.  A torn or stale entry raises in the worker.
+"""
+from __future__ import division, print_function
+
+import argparse
+import os
+import sys
+import tempfile
+import time
+from random import Random
+
+from fastcache import clru_cache
+
+COST = 1e-4   # seconds spent computing a value
+
+
+def value(x):
+    """ The result expected for x, of varying size. """
+    return (x, str(x) * (x % 97))
+
+
+def worker(path, size, keys, seed, check, out):
+    """ Call a shared cached function on the keys in a random order. """
+    calls = []
+
+    @clru_cache(maxsize=256, shared=path, shared_size=size)
+    def compute(x):
+        calls.append(x)
+        if not check:
+            time.sleep(COST)
+        return value(x)
+
+    order = list(keys)
+    Random(seed).shuffle(order)
+    start = time.time()
+    for x in order:
+        if compute(x) != value(x):
+            raise ValueError("Wrong result for %d" % x)
+    elapsed = time.time() - start
+    hits, misses, _, _ = compute.cache_info()
+    os.write(out, ("%d %d %d %f\n" % (len(calls), hits, misses,
+                                      elapsed)).encode())
+
+
+def run(nprocs, keys, size, check, shared=True):
+    """ Fork nprocs workers and collect their reports. """
+    tmpdir = tempfile.mkdtemp()
+    path = os.path.join(tmpdir, 'cache.fcshm')
+    r, w = os.pipe()
+    pids = []
+    for n in range(nprocs):
+        pid = os.fork()
+        if pid == 0:
+            status = 1
+            try:
+                # without sharing every worker has a file of its own
+                worker(path if shared else path + str(n), size, keys, n,
+                       check, w)
+                status = 0
+            finally:
+                os._exit(status)
+        pids.append(pid)
+    os.close(w)
+    failed = sum(os.waitpid(pid, 0)[1] != 0 for pid in pids)
+    with os.fdopen(r) as f:
+        reports = [tuple(float(v) for v in line.split()) for line in f]
+    for n in range(nprocs):
+        for p in (path, path + str(n)):
+            if os.path.exists(p):
+                os.unlink(p)
+    os.rmdir(tmpdir)
+    if failed:
+        raise ValueError("%d workers failed" % failed)
+    return reports
+
+
+def benchmark(nprocs, nkeys):
+    keys = range(nkeys)
+    print("%d workers calling %d keys, %g ms per call" %
+          (nprocs, nkeys, COST * 1e3))
+    for shared in (False, True):
+        reports = run(nprocs, keys, 64 << 20, False, shared)
+        calls = sum(r[0] for r in reports)
+        hits = sum(r[1] for r in reports)
+        slowest = max(r[3] for r in reports)
+        print("  shared=%-5s calls %6d  hits %6d  slowest worker %.3f s" %
+              (shared, calls, hits, slowest))
+
+
+def stress(nprocs, nkeys, repeat):
+    keys = list(range(nkeys)) * repeat
+    reports = run(nprocs, keys, 1 << 20, True)
+    calls = sum(r[0] for r in reports)
+    print("stress: %d workers, %d calls checked, %d computed" %
+          (nprocs, nprocs * len(keys), calls))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Run shared tier tests.')
+    parser.add_argument('-n', '--numprocs',
+                        type=int,
+                        default=4,
+                        dest='n',
+                        help='Number of worker processes.')
+    parser.add_argument('-k', '--keys',
+                        type=int,
+                        default=2000,
+                        dest='k',
+                        help='Number of distinct keys.')
+    parser.add_argument('-r', '--repeat',
+                        type=int,
+                        default=20,
+                        dest='r',
+                        help='Passes over the keys in the stress test.')
+    args = parser.parse_args()
+    if not hasattr(os, 'fork'):
+        sys.exit("The shared tier needs os.fork")
+    benchmark(args.n, args.k)
+    stress(args.n, args.k, args.r)
+
+
+if __name__ == "__main__":
+    main()
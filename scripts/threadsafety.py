@@ -14,6 +14,14 @@ The test should not only ensure that the correct result is acheived (and no
 segfaults) but also assess memory leaks.
 
 The thread switching interval can be altered using sys.setswitchinterval.
+
+With --sweep the script is a contention benchmark instead.  Every
+combination of thread count, target hit ratio, switch interval, key
+distribution, shard count and cache_clear racing with the calls is run in
+turn, and the throughput, the latency percentiles, the hit ratio reached,
+the contended lock acquisitions and the reference count and allocated
+block deltas left after the cache is cleared are reported per
+configuration, as a table and optionally as JSON.
 """
 
 class PythonInt:
@@ -113,6 +121,199 @@ def run_test2(n, r, i):
         raise ValueError("Expected %d currsize, Got %d" %
                          (CACHE_SIZE//2+1, currsize))
 
+# Contention sweep.
+
+import gc
+import itertools
+import json
+import sys
+import time
+from random import Random
+
+try:
+    from sys import getswitchinterval as getinterval
+except ImportError:
+    from sys import getcheckinterval as getinterval
+
+try:
+    timer = time.perf_counter
+except AttributeError:
+    from timeit import default_timer as timer
+
+SWEEP_SIZE = 1000       # maxsize of the swept caches
+HOT_KEYS = SWEEP_SIZE // 2
+BASE = 1 << 20          # keys start here to not be shared small ints
+
+
+def allocated():
+    """ Allocated memory blocks, or references in a debug build. """
+    if hasattr(sys, 'gettotalrefcount'):
+        return sys.gettotalrefcount()
+    if hasattr(sys, 'getallocatedblocks'):
+        return sys.getallocatedblocks()
+    return 0
+
+
+def key_stream(calls, hit, dist, seed):
+    """ calls keys, a hot key from HOT_KEYS with probability hit and a key
+    never seen before otherwise.  Hot keys are drawn uniformly or with a
+    Zipf skew.
+    """
+    rand = Random(seed)
+    if dist == 'zipf':
+        from bisect import bisect
+        cdf = [1.0]
+        for i in range(2, HOT_KEYS + 1):
+            cdf.append(cdf[-1] + 1.0 / i)
+        hot = lambda: bisect(cdf, rand.random() * cdf[-1])
+    elif dist == 'uniform':
+        hot = lambda: rand.randrange(HOT_KEYS)
+    else:
+        raise ValueError("Unknown key distribution %r" % dist)
+    # cold keys of each thread are distinct from all others
+    cold = itertools.count(HOT_KEYS + seed * calls)
+    return [BASE + (hot() if rand.random() < hit else next(cold))
+            for _ in range(calls)]
+
+
+def value(x):
+    return 2 * x + 1
+
+
+def counted(func, calls):
+    """ func counting its calls in the list calls. """
+    def wrapper(x):
+        calls.append(1)
+        return func(x)
+    return wrapper
+
+
+def sweep_worker(f, keys, latencies, errors):
+    """ Call f on the keys, recording the latency of every call. """
+    lat = []
+    append = lat.append
+    try:
+        for k in keys:
+            start = timer()
+            res = f(k)
+            append(timer() - start)
+            if res != value(k):
+                raise ValueError("Expected %d, Got %d" % (value(k), res))
+    except Exception as e:
+        errors.append(e)
+    latencies.extend(lat)
+
+
+def sweep_clearer(f, done, clears):
+    """ Clear f every millisecond until done is set, keeping the contended
+    count that cache_clear resets.
+    """
+    while not done.is_set():
+        contended = f.cache_stats()['contended']
+        f.cache_clear()
+        clears.append(contended)
+        time.sleep(1e-3)
+
+
+def percentile(ordered, q):
+    return ordered[min(int(q * len(ordered)), len(ordered) - 1)]
+
+
+def run_config(threads, hit, interval, dist, shards, clear, calls):
+    """ Run one configuration and return its measurements. """
+    import threading
+
+    streams = [key_stream(calls, hit, dist, n) for n in range(threads)]
+    keys = [k for s in streams for k in s[:100]]
+    gc.collect()
+    refs = sum(sys.getrefcount(k) for k in keys)
+    blocks = allocated()
+
+    latencies, errors, clears, misses = [], [], [], []
+    f = clru_cache(maxsize=SWEEP_SIZE, shards=shards)(counted(value, misses))
+    done = threading.Event()
+    workers = [Thread(target=sweep_worker, args=(f, s, latencies, errors))
+               for s in streams]
+    clearer = Thread(target=sweep_clearer, args=(f, done, clears))
+    old = getinterval()
+    setinterval(interval)
+    try:
+        start = timer()
+        if clear:
+            clearer.start()
+        run_threads(workers)
+        elapsed = timer() - start
+        done.set()
+        if clear:
+            clearer.join()
+    finally:
+        setinterval(old)
+    if errors:
+        raise errors[0]
+
+    latencies.sort()
+    result = {
+        'threads': threads, 'hit': hit, 'interval': interval, 'dist': dist,
+        'shards': shards, 'clear': clear, 'calls': threads * calls,
+        'throughput': threads * calls / elapsed,
+        'p50': percentile(latencies, 0.5),
+        'p99': percentile(latencies, 0.99),
+        'p999': percentile(latencies, 0.999),
+        'max': latencies[-1],
+        'hit_ratio': 1 - len(misses) / (threads * calls),
+        'contended': f.cache_stats()['contended'] + sum(clears),
+        'clears': len(clears),
+    }
+    # everything made by the run is gone once the cache is cleared, but
+    # for the few dozen blocks of the result
+    f.cache_clear()
+    del f, workers, clearer, latencies, errors, clears, misses
+    gc.collect()
+    result['refs_delta'] = sum(sys.getrefcount(k) for k in keys) - refs
+    result['blocks_delta'] = allocated() - blocks
+    return result
+
+
+HEADER = ('%7s %5s %8s %7s %6s %5s %10s %8s %8s %8s %6s %9s %6s %7s' %
+          ('threads', 'hit', 'interval', 'dist', 'shards', 'clear',
+           'calls/s', 'p50 us', 'p99 us', 'p999 us', 'ratio', 'contended',
+           'refs', 'blocks'))
+
+
+def format_row(r):
+    return ('%7d %5g %8g %7s %6d %5s %10.0f %8.2f %8.2f %8.2f %6.3f %9d '
+            '%6d %7d' % (r['threads'], r['hit'], r['interval'], r['dist'],
+                         r['shards'], 'yes' if r['clear'] else 'no',
+                         r['throughput'], 1e6 * r['p50'], 1e6 * r['p99'],
+                         1e6 * r['p999'], r['hit_ratio'], r['contended'],
+                         r['refs_delta'], r['blocks_delta']))
+
+
+def sweep(threads, hits, intervals, dists, shards, clears, calls,
+          output=None):
+    """ Run every combination of the parameters and report each. """
+    print(HEADER)
+    results = []
+    for config in itertools.product(threads, hits, intervals, dists, shards,
+                                    clears):
+        r = run_config(*config, calls=calls)
+        results.append(r)
+        print(format_row(r))
+        sys.stdout.flush()
+    leaks = [r for r in results if r['refs_delta']]
+    if leaks:
+        raise ValueError("Reference counts of the keys changed by %s" %
+                         [r['refs_delta'] for r in leaks])
+    if output is not None:
+        with open(output, 'w') as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+    return results
+
+
+def comma_list(kind):
+    return lambda text: [kind(v) for v in text.split(',')]
+
+
 import argparse
 
 def main():
@@ -133,9 +334,41 @@ def main():
                         default=1e-6,
                         dest='i',
                         help='Time in seconds for sys.setswitchinterval.')
+    sweeping = parser.add_argument_group(
+        'sweep', 'Contention benchmark over all combinations of the '
+        'comma separated values.')
+    sweeping.add_argument('--sweep', action='store_true',
+                          help='Run the sweep instead of the test.')
+    sweeping.add_argument('--threads', type=comma_list(int),
+                          default=[1, 2, 4, 8],
+                          help='Thread counts.')
+    sweeping.add_argument('--hits', type=comma_list(float),
+                          default=[0.5, 0.9, 0.99],
+                          help='Target hit ratios.')
+    sweeping.add_argument('--intervals', type=comma_list(float),
+                          default=[5e-3, 1e-6],
+                          help='Switch intervals in seconds.')
+    sweeping.add_argument('--dists', type=comma_list(str),
+                          default=['uniform', 'zipf'],
+                          help='Key distributions, uniform or zipf.')
+    sweeping.add_argument('--shards', type=comma_list(int), default=[1],
+                          help='Shard counts of the cache.')
+    sweeping.add_argument('--clear', type=comma_list(int), default=[0, 1],
+                          help='Whether a thread runs cache_clear every '
+                          'millisecond, 0 or 1.')
+    sweeping.add_argument('--calls', type=int, default=20000,
+                          help='Calls per thread in each configuration.')
+    sweeping.add_argument('-o', '--output', default=None,
+                          help='Write the results to this JSON file.')
+    args = parser.parse_args()
 
-    run_test(**dict(vars(parser.parse_args())))
-    run_test2(**dict(vars(parser.parse_args())))
+    if args.sweep:
+        sweep(args.threads, args.hits, args.intervals, args.dists,
+              args.shards, [bool(c) for c in args.clear], args.calls,
+              args.output)
+    else:
+        run_test(args.n, args.r, args.i)
+        run_test2(args.n, args.r, args.i)
 
 
 if __name__ == "__main__":
@@ -57,7 +57,8 @@ long_description = '''
 C implementation of Python 3 functools.lru_cache.  Provides speedup of 10-30x
 over standard library.  Passes test suite from standard library for lru_cache.
 
-Provides 2 Least Recently Used caching function decorators:
+Provides 2 Least Recently Used caching function decorators and a method
+decorator:
 
   clru_cache - built-in (faster)
              >>> from fastcache import clru_cache, __version__
@@ -91,8 +92,26 @@ Provides 2 Least Recently Used caching function decorators:
              >>> type(f)
              >>> <class 'function'>
 
+  cached_method - per-instance cache of a method, freed with the instance
+             >>> from fastcache import cached_method
+             >>> class A(object):
+             ...     @cached_method(maxsize=128)
+             ...     def f(self, b):
+             ...         return (self, b)
+             ...
+             >>> a = A()
+             >>> a.f(1) is a.f(1)
+             True
+             >>> a.f.cache_info()
+             CacheInfo(hits=1, misses=1, maxsize=128, currsize=1)
+
 
-  (c)lru_cache(maxsize=128, typed=False, state=None, unhashable='error')
+  (c)lru_cache(maxsize=128, typed=False, state=None, unhashable='error',
+               single_flight=False, shards=None, policy='lru', ttl=None,
+               expire_after_write=None, expire_after_access=None,
+               clock=None, maxweight=None, weigher=None, shared=None,
+               shared_size=None, mrc=None, weak_keys=False,
+               weak_values=False)
 
       Least-recently-used cache decorator.
 
@@ -119,11 +138,122 @@ Provides 2 Least Recently Used caching function decorators:
           with the supplied arguments. A miss will will be recorded in
           the cache statistics.
 
+      If *single_flight* is True, threads that miss on a key which is already
+      being computed wait for that call and share its result (or exception)
+      instead of calling the wrapped function again.  A shared result is
+      recorded as a hit.
+
+      *shards* splits the cache into that many independently locked parts
+      (rounded up to a power of two), each holding an equal share of *maxsize*
+      with its own LRU order.  Threads using different shards do not contend,
+      which matters on free-threaded builds where it defaults to 16; otherwise
+      the default is a single shard.
+
+      *policy* selects the entry evicted from a full cache.  'lru' evicts the
+      least recently used one.  'clock' approximates LRU: a hit only marks the
+      entry as referenced and eviction gives marked entries a second chance.
+      Hits are then read-only and do not need the cache lock.  'tinylfu'
+      admits a new entry into the main cache only if it was requested more
+      often than the entry it would evict, according to a frequency sketch.
+      New entries first pass a small LRU window, so bursts still hit, while
+      one-off scans no longer flush popular entries.  It needs a positive
+      *maxsize*.
+
+      If *ttl* (or its alias *expire_after_write*) is set, entries expire that
+      many seconds after they were stored.  If *expire_after_access* is set,
+      entries expire that many seconds after they were last used.  Expired
+      entries are dropped when looked up and reaped in bulk as time passes.
+      *clock* is a callable returning the current time in seconds and defaults
+      to a coarse monotonic clock.
+
+      If *maxweight* is set, the total weight of the cached results is kept
+      at or below it by evicting entries, and a result heavier than that is
+      not cached.  *weigher* gives the weight of a result: a callable taking
+      the result, 'sizeof' for sys.getsizeof (the default) or 'nbytes' for the
+      size of the buffer of bytes, arrays and the like.  *maxsize* still
+      applies, use maxsize=None to bound the cache by weight alone.  Weighted
+      caches add maxweight and currweight to cache_info().
+
+      If the wrapped function is a coroutine function (async def), every call
+      returns a new coroutine awaiting one shared call of the function, which
+      is what the cache stores.  The call runs as a task of the event loop of
+      the first awaiter, and the others await it through asyncio.shield, so a
+      caller that is cancelled, e.g. by a timeout, leaves it to the rest.  A
+      call that failed or was cancelled is dropped from the cache once done.
+
+      Batches of calls can be made with f.cache_map(iterable_of_args) and
+      f.cache_get_many(keys), which look up all keys and store the new
+      results with one lock acquisition per shard.  Misses are computed by
+      calling the function, or by a single call of an optional loader given
+      the list of missing arguments.
+
+      f.cache_dump(path) writes the entries to a file from which
+      f.cache_load(path) reads them back, e.g. to warm up a new process.  The
+      dump records the module and qualified name of the function and is read
+      through a memory map.  Keys and results are pickled unless another
+      *serializer* with dumps() and loads() is given.
+
+      If *shared* is the path of a file, results are also published to that
+      file, memory mapped by every process using it, and looked up there on a
+      local miss.  Forked workers thus compute each result once between them.
+      Keys and results are pickled, and entries are namespaced by the module
+      and qualified name of the function.  *shared_size* is the size in bytes
+      of a new file (64 MiB by default).  A full file is emptied as a whole,
+      cache_clear() only clears the local cache.  Not available on Windows.
+      Results read from the file are unpickled, so any process that can write
+      to it can run code in every process using it: only share files with
+      processes you trust.  A new file is made readable by its owner only,
+      and an existing one must be a regular file of the user that others
+      cannot write to.
+
+      If *mrc* is a rate in (0, 1], or True for 0.01, the cache samples that
+      fraction of its keys to track their reuse distances, and
+      f.cache_mrc(sizes) estimates the hit ratio an LRU cache of each size
+      would have had (a miss ratio curve).  Sample more keys for functions
+      called with few distinct arguments.  At most 4096 keys are tracked, the
+      rate is lowered as more keys show up.
+
+      If *weak_values* is True, results are held through weak references and
+      an entry goes away as soon as nothing else refers to its result.
+      Results that cannot be weakly referenced (int, str, tuple, ...) are not
+      cached.  If *weak_keys* is True, calls are keyed by their only
+      positional argument, held through a weak reference, and an entry goes
+      away with its argument, e.g. with self for a method taking no other
+      arguments.  Other calls, and arguments that cannot be weakly
+      referenced, are not cached.  Either way the memory held by the cache
+      follows the objects in use rather than *maxsize*, which still applies.
+      Weak caches cannot be dumped or loaded, and cache_stats() counts the
+      entries dropped as collected.
+
       View the cache statistics named tuple (hits, misses, maxsize, currsize)
-      with f.cache_info().  Clear the cache and statistics with f.cache_clear().
+      with f.cache_info().  f.cache_stats() adds evictions, expirations, key
+      comparisons, discarded duplicate results, lock contention and a
+      histogram of the time taken by misses.  Clear the cache and statistics
+      with f.cache_clear().
       Access the underlying function with f.__wrapped__.
+      f.cache_resize(maxsize) changes the maxsize of a bounded cache and keeps
+      the entries that still fit.
+
+      Caches are registered with weak references: fastcache.all_caches() lists
+      the live ones and fastcache.export_stats() writes the cache_stats() of
+      all of them in the Prometheus text format or as JSON.
 
       See:  http://en.wikipedia.org/wiki/Cache_algorithms#Least_Recently_Used
+
+
+  cached_method(maxsize=128, ...)
+
+      Method cache decorator taking the arguments of clru_cache.
+
+      Every instance gets a cache of its own, made on first use and freed
+      with the instance, which is held through a weak reference.  The cache
+      of obj.f is kept in obj.__dict__ as '__cached_method_f', or by the
+      decorator for instances without a __dict__, and a copy of obj gets a
+      new one.  Keys are built from the arguments after self, so instances
+      need not be hashable but must support weak references, and *maxsize*
+      bounds each cache.  obj.f(x) finds the cache of obj without making a
+      bound method, and obj.f is that cache, e.g. obj.f.cache_info() or
+      obj.f.cache_clear().  The *shared* option is not supported.
 '''
 
 # the overall logic here is that by default macros can be only be passed if
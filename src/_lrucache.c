@@ -1,6 +1,23 @@
 #include <Python.h>
 #include "structmember.h"
 #include "pythread.h"
+#include <math.h>
+#ifdef MS_WINDOWS
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/* the shared tier maps a file into every process and needs GCC atomics */
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(MS_WINDOWS)
+#define FC_SHARED
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -9,12 +26,30 @@ extern "C" {
 #if PY_MAJOR_VERSION == 2
 #define _PY2
 typedef long Py_hash_t;
+typedef unsigned long Py_uhash_t;
+#endif
+
+#ifndef Py_RETURN_NOTIMPLEMENTED
+#define Py_RETURN_NOTIMPLEMENTED \
+  return Py_INCREF(Py_NotImplemented), Py_NotImplemented
+#endif
+
+#ifndef Py_SET_TYPE
+#define Py_SET_TYPE(ob, type) (Py_TYPE(ob) = (type))
+#endif
+#ifndef Py_SET_REFCNT
+#define Py_SET_REFCNT(ob, refcnt) (Py_REFCNT(ob) = (refcnt))
 #endif
 
 #if PY_MAJOR_VERSION == 3 && PY_MINOR_VERSION == 2
 #define _PY32
 #endif
 
+/* PEP 590 vectorcall is public API from 3.9 onward */
+#if PY_VERSION_HEX >= 0x03090000
+#define _FC_VECTORCALL
+#endif
+
 #ifdef LLTRACE
 #define TBEGIN(x, line) printf("Beginning Trace of %s at lineno %d....", x);
 #define TEND(x) printf("Finished!\n")
@@ -23,6 +58,21 @@ typedef long Py_hash_t;
 #define TEND(x)
 #endif
 
+/* Relaxed atomic access to fields that are read without their lock.  The
+ * GIL orders these accesses when there is one. */
+#ifdef Py_GIL_DISABLED
+#if !defined(__GNUC__)
+#error "free-threaded builds need the GCC atomic builtins"
+#endif
+#define FC_LOAD(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define FC_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
+#define FC_ADD(p, v) ((void)__atomic_fetch_add(p, v, __ATOMIC_RELAXED))
+#else
+#define FC_LOAD(p) (*(p))
+#define FC_STORE(p, v) ((void)(*(p) = (v)))
+#define FC_ADD(p, v) ((void)(*(p) += (v)))
+#endif
+
 #ifdef WITH_THREAD
 #ifdef _PY2
 typedef int PyLockStatus;
@@ -31,23 +81,16 @@ static PyLockStatus PY_LOCK_ACQUIRED = 1;
 static PyLockStatus PY_LOCK_INTR = -999999;
 #endif
 
+/* Acquire a plain lock, releasing the GIL while blocked.  If intr is set
+ * the wait can be interrupted by signals and exceptions raised by signal
+ * handlers are propagated (returns -1).  If contended is not NULL it is
+ * incremented, with the lock held, when the lock was busy. */
 static int
-rlock_acquire(PyThread_type_lock lock, long* rlock_owner, unsigned long* rlock_count)
+lock_acquire(PyThread_type_lock lock, int intr, Py_ssize_t *contended)
 {
-    long tid;
     PyLockStatus r;
+    int blocked = 0;
 
-    tid = PyThread_get_thread_ident();
-    if (*rlock_count > 0 && tid == (*rlock_owner)) {
-        unsigned long count = *rlock_count + 1;
-        if (count <= *rlock_count) {
-            PyErr_SetString(PyExc_OverflowError,
-                            "Internal lock count overflowed");
-            return -1;
-        }
-        *rlock_count = count;
-        return 1;
-    }
     /* do/while loop from acquire_timed */
     do {
         /* first a simple non-blocking try without releasing the GIL */
@@ -57,11 +100,12 @@ rlock_acquire(PyThread_type_lock lock, long* rlock_owner, unsigned long* rlock_c
         r = PyThread_acquire_lock_timed(lock, 0, 0);
 #endif
         if (r == PY_LOCK_FAILURE) {
+            blocked = 1;
             Py_BEGIN_ALLOW_THREADS
 #ifdef _PY2
             r = PyThread_acquire_lock(lock, 1);
 #else
-            r = PyThread_acquire_lock_timed(lock, -1, 1);
+            r = PyThread_acquire_lock_timed(lock, -1, intr);
 #endif
             Py_END_ALLOW_THREADS
         }
@@ -75,9 +119,36 @@ rlock_acquire(PyThread_type_lock lock, long* rlock_owner, unsigned long* rlock_c
             }
         }
     } while (r == PY_LOCK_INTR);  /* Retry if we were interrupted. */
-    if (r == PY_LOCK_ACQUIRED) {
-        *rlock_owner = tid;
-        *rlock_count = 1;
+    if (r != PY_LOCK_ACQUIRED)
+        return -1;
+    if (blocked && contended != NULL)
+        (*contended)++;
+    return 1;
+}
+
+/* The owner and count of a reentrant lock are read by threads that do not
+ * hold it, to find out whether they do.  Only the owner writes them, so a
+ * thread only ever reads its own id back if it holds the lock. */
+static int
+rlock_acquire(PyThread_type_lock lock, long* rlock_owner, unsigned long* rlock_count,
+              Py_ssize_t *contended, int intr)
+{
+    long tid;
+
+    tid = PyThread_get_thread_ident();
+    if (FC_LOAD(rlock_count) > 0 && tid == FC_LOAD(rlock_owner)) {
+        unsigned long count = *rlock_count + 1;
+        if (count <= *rlock_count) {
+            PyErr_SetString(PyExc_OverflowError,
+                            "Internal lock count overflowed");
+            return -1;
+        }
+        FC_STORE(rlock_count, count);
+        return 1;
+    }
+    if (lock_acquire(lock, intr, contended) == 1) {
+        FC_STORE(rlock_owner, tid);
+        FC_STORE(rlock_count, 1);
         return 1;
     }
     return -1;
@@ -88,24 +159,30 @@ rlock_release(PyThread_type_lock lock, long* rlock_owner, unsigned long* rlock_c
 {
     long tid = PyThread_get_thread_ident();
 
-    if (*rlock_count == 0 || *rlock_owner != tid) {
+    if (FC_LOAD(rlock_count) == 0 || FC_LOAD(rlock_owner) != tid) {
         PyErr_SetString(PyExc_RuntimeError,
                         "cannot release un-acquired lock");
         return -1;
     }
 
-    if (--(*rlock_count) == 0) {
-        *rlock_owner = 0;
+    if (*rlock_count == 1) {
+        FC_STORE(rlock_count, 0);
+        FC_STORE(rlock_owner, 0);
         PyThread_release_lock(lock);
     }
+    else
+        FC_STORE(rlock_count, *rlock_count - 1);
     return 1;
 }
 
-#define ACQUIRE_LOCK(obj) rlock_acquire((obj)->lock, &((obj)->rlock_owner), &((obj)->rlock_count))
+#define ACQUIRE_LOCK(obj) rlock_acquire((obj)->lock, &((obj)->rlock_owner), &((obj)->rlock_count), &((obj)->contended), 1)
+/* for clean up that must not be interrupted by signals */
+#define ACQUIRE_LOCK_NOINTR(obj) rlock_acquire((obj)->lock, &((obj)->rlock_owner), &((obj)->rlock_count), &((obj)->contended), 0)
 #define RELEASE_LOCK(obj) rlock_release((obj)->lock, &((obj)->rlock_owner), &((obj)->rlock_count))
-#define FREE_LOCK(obj) PyThread_free_lock((obj)->lock)
+#define FREE_LOCK(obj) if ((obj)->lock) PyThread_free_lock((obj)->lock)
 #else
 #define ACQUIRE_LOCK(obj) 1
+#define ACQUIRE_LOCK_NOINTR(obj) 1
 #define RELEASE_LOCK(obj) 1
 #define FREE_LOCK(obj)
 #endif
@@ -117,118 +194,82 @@ rlock_release(PyThread_type_lock lock, long* rlock_owner, unsigned long* rlock_c
 // threads in between instructions.
 // To make this threadsafe care needs to be taken one such that global objects
 // are left in a consistent between calls to python bytecode.
-// The relevant global objects are co->root, and co->cache_dict
-// The stats are global as well but are modified in one line: stat++
-
-/* HashedArgs -- internal *****************************************/
-typedef struct {
-  PyObject_HEAD
-  PyObject *args;
-  Py_hash_t hashvalue;
-} HashedArgs;
-
-
-static void
-HashedArgs_dealloc(HashedArgs *self)
-{
-  Py_XDECREF(self->args);
-  Py_TYPE(self)->tp_free(self);
-  return;
-}
-
+// The relevant global objects are the shard tables, co->shards[n].table
+// The stats are kept per shard and modified under the shard lock, except
+// for co->misses which counts calls that never reach a shard.
+
+/* Hash of a sequence of objects, combined as in the xxHash based tuple
+ * hash of Python 3.8.  Key tuples are hashed with this function rather
+ * than their own hash so that a call can also be looked up straight from
+ * its argument array. */
+#if SIZEOF_VOID_P > 4
+#define _FC_HASH_PRIME1 ((Py_uhash_t)11400714785074694791ULL)
+#define _FC_HASH_PRIME2 ((Py_uhash_t)14029467366897019727ULL)
+#define _FC_HASH_PRIME5 ((Py_uhash_t)2870177450012600261ULL)
+#define _FC_HASH_ROTATE(x) ((x << 31) | (x >> 33))
+#else
+#define _FC_HASH_PRIME1 ((Py_uhash_t)2654435761UL)
+#define _FC_HASH_PRIME2 ((Py_uhash_t)2246822519UL)
+#define _FC_HASH_PRIME5 ((Py_uhash_t)374761393UL)
+#define _FC_HASH_ROTATE(x) ((x << 13) | (x >> 19))
+#endif
 
-/* return precomputed tuple hash for speed */
 static Py_hash_t
-HashedArgs_hash(HashedArgs *self)
+hash_items(PyObject *const *items, Py_ssize_t size)
 {
-  return self->hashvalue;
+  Py_uhash_t acc = _FC_HASH_PRIME5;
+  Py_ssize_t i;
+
+  for(i = 0; i < size; i++){
+    Py_uhash_t lane = (Py_uhash_t)PyObject_Hash(items[i]);
+    if (lane == (Py_uhash_t)-1)
+      return -1;
+    acc += lane * _FC_HASH_PRIME2;
+    acc = _FC_HASH_ROTATE(acc);
+    acc *= _FC_HASH_PRIME1;
+  }
+  acc += size ^ (_FC_HASH_PRIME5 ^ 3527539UL);
+  if (acc == (Py_uhash_t)-1)
+    return 1546275796;
+  return (Py_hash_t)acc;
 }
 
 
-/* Delegate comparison to tuples */
-static PyObject *
-HashedArgs_richcompare(PyObject *v, PyObject *w, int op)
+/* compare two sequences of objects for equality, returns -1 on error */
+static int
+items_equal(PyObject *const *a, PyObject *const *b, Py_ssize_t size)
 {
-  HashedArgs *hv = (HashedArgs *) v;
-  HashedArgs *hw = (HashedArgs *) w;
-  PyObject *res = PyObject_RichCompare(hv->args, hw->args, op);
-  return res;
+  Py_ssize_t i;
+  for(i = 0; i < size; i++){
+    int k = PyObject_RichCompareBool(a[i], b[i], Py_EQ);
+    if (k <= 0)
+      return k;
+  }
+  return 1;
 }
 
 
-static PyTypeObject HashedArgs_type = {
-  PyVarObject_HEAD_INIT(NULL, 0)
-  "_lrucache.HashedArgs",          /* tp_name */
-  sizeof(HashedArgs),              /* tp_basicsize */
-  0,                            /* tp_itemsize */
-  (destructor)HashedArgs_dealloc,  /* tp_dealloc */
-  0,                            /* tp_print */
-  0,                            /* tp_getattr */
-  0,                            /* tp_setattr */
-  0,                            /* tp_reserved */
-  0,                            /* tp_repr */
-  0,                            /* tp_as_number */
-  0,                            /* tp_as_sequence */
-  0,                            /* tp_as_mapping */
-  (hashfunc)HashedArgs_hash,    /* tp_hash */
-  0,                            /* tp_call */
-  0,                            /* tp_str */
-  0,                            /* tp_getattro */
-  0,                            /* tp_setattro */
-  0,                            /* tp_as_buffer */
-  Py_TPFLAGS_DEFAULT,             /* tp_flags */
-  0,                              /* tp_doc */
-  0,                        /* tp_traverse */
-  0,                       /* tp_clear */
-  HashedArgs_richcompare,     /* tp_richcompare */
-};
-
-/***************************************************
- End of HashedArgs
-***************************************************/
-
 /***********************************************************
- circular doubly linked list
+ weak entries
 ************************************************************/
-typedef struct clist{
-  PyObject_HEAD
-  struct clist *prev;
-  struct clist *next;
-  PyObject *key;
-  PyObject *result;
-} clist;
-
-
-static void
-clist_dealloc(clist *co)
-{
-  clist *prev = co->prev;
-  clist *next = co->next;
-
-  // THREAD SAFETY NOTES:
-  // Calls to DECREF can result in bytecode and thread switching.
-  // Do DECREF after the linked list has been modified and is in
-  // an acceptable state.
-  if(prev != co){
-    // adjust neighbor pointers
-    prev->next = next;
-    next->prev = prev;
-  }
-  co->prev = NULL;
-  co->next = NULL;
-  Py_XDECREF(co->key);
-  Py_XDECREF(co->result);
-  Py_TYPE(co)->tp_free(co);
-  return;
-}
-
+/* With weak_keys or weak_values the table stores weak references to the
+ * key or the result instead.  They are instances of a subtype of
+ * weakref.ref that also keeps the hash of the key of their entry, like
+ * weakref.KeyedRef, so that the callback run when a referent dies can
+ * find the entry and unlink it in O(1).  Every entry has references of
+ * its own, and they never compare equal to anything but themselves as
+ * far as the table is concerned. */
+typedef struct {
+  PyWeakReference ref;
+  Py_hash_t key_hash;     // hash of the key of the entry
+} weakentryobject;
 
-static PyTypeObject clist_type = {
+static PyTypeObject weakentry_type = {
   PyVarObject_HEAD_INIT(NULL, 0)
-  "_lrucache.clist",   /* tp_name */
-  sizeof(clist),       /* tp_basicsize */
+  "_lrucache.weakentry",   /* tp_name */
+  sizeof(weakentryobject),  /* tp_basicsize */
   0,                       /* tp_itemsize */
-  (destructor)clist_dealloc,   /* tp_dealloc */
+  0,                       /* tp_dealloc */
   0,                       /* tp_print */
   0,                       /* tp_getattr */
   0,                       /* tp_setattr */
@@ -243,633 +284,5685 @@ static PyTypeObject clist_type = {
   0,                       /* tp_getattro */
   0,                       /* tp_setattro */
   0,                       /* tp_as_buffer */
-  Py_TPFLAGS_DEFAULT,      /* tp_flags */
+  Py_TPFLAGS_DEFAULT,      /* tp_flags, GC support is inherited */
 };
 
-
-static int
-insert_first(clist *root, PyObject *key, PyObject *result){
-  // first element will be inserted at root->next
-  clist *first = PyObject_New(clist, &clist_type);
-  clist *oldfirst = root->next;
-
-  if(!first)
-    return -1;
-
-  first->result = result;
-  // This will be the only reference to key (HashedArgs), do not INCREF
-  first->key = key;
-
-  root->next = first;
-  first->next = oldfirst;
-  first->prev = root;
-  oldfirst->prev = first;
-  // INCREF result since it will be used by clist and returned to the caller
-  return  Py_INCREF(result), 1;
-}
+#define WEAK_ENTRY_CHECK(op) (Py_TYPE(op) == &weakentry_type)
+/* borrowed referent of a weak entry, None once it is gone */
+#define WEAK_REFERENT(op) (((PyWeakReference *)(op))->wr_object)
+#define WEAK_DEAD(op) (WEAK_REFERENT(op) == Py_None)
 
 
+/* new reference to the referent of a weak reference, NULL if it is gone */
 static PyObject *
-make_first(clist *root, clist *node){
-  // make node the first node and return new reference to result
-  // save previous first position
-  clist *oldfirst = root->next;
-
-  if (oldfirst != node) {
-    // first adjust pointers around node's position
-    node->prev->next = node->next;
-    node->next->prev = node->prev;
-
-    root->next = node;
-    node->next = oldfirst;
-    node->prev = root;
-    oldfirst->prev = node;
+weak_deref(PyObject *ref)
+{
+#if PY_VERSION_HEX >= 0x030D0000
+  PyObject *op;
+  if (PyWeakref_GetRef(ref, &op) <= 0){
+    PyErr_Clear();
+    return NULL;
   }
-  INC_RETURN(node->result);
+  return op;
+#else
+  PyObject *op = PyWeakref_GET_OBJECT(ref);
+  if (op == Py_None)
+    return NULL;
+  Py_INCREF(op);
+  return op;
+#endif
 }
 
-/**********************************************************
- cachedobject is the actual function with the cached results
-***********************************************************/
 
-/* how will unhashable arguments be handled */
-enum unhashable {FC_ERROR, FC_WARNING, FC_IGNORE, FC_FAIL};
+/***********************************************************
+ hash table with intrusive LRU list
+************************************************************/
+/* All entries of a cache live in a dense array of entries indexed by a
+ * sparse open addressing table with linear probing.  Each entry holds the
+ * stored hash, the key, the result and the 32-bit indices of its
+ * neighbours in the LRU list; the index only holds 32-bit entry numbers.
+ * An entry is 32 bytes and the index adds 4 bytes per slot, so with the
+ * load factor of 2/3 the table costs about 38 bytes per entry when full,
+ * and no entry carries an object header.  A hit touches one index slot,
+ * the entry and its two list neighbours.  The list is circular and rooted
+ * at the extra entry slots[capacity], which is never indexed.  Deletion
+ * shifts the following index slots of the probe run back, so there are no
+ * tombstones, and puts the entry on a free list threaded through its next
+ * field.  Entries never move while they are in the table.
+ *
+ * With the CLOCK policy the list is kept in insertion order and serves as
+ * the ring, and a hit only sets the entry's byte in t->marks.  Eviction
+ * gives referenced entries at the tail a second chance by clearing their
+ * byte and moving them to the front.  The marks array shares the table
+ * allocation, so hits never write to the entries.
+ *
+ * With the TinyLFU policy the entries are split into three lists, the
+ * window, probation and protected queues, rooted at slots[capacity + q].
+ * The queue of an entry is its byte in t->marks and t->queued counts the
+ * entries of each queue.
+ *
+ * With a ttl each entry also has a timer holding its deadline, linked into
+ * a timer wheel of HT_WHEEL_SIZE buckets that each span t->tick seconds.
+ * The durations are fixed per cache and every deadline lies within one
+ * span (HT_WHEEL_SIZE - 1 ticks) of the time it was set, so a single
+ * wheel level covers all of them and needs no cascading.  Advancing the
+ * wheel reaps the buckets it passes in bulk; expired entries found by a
+ * lookup are dropped on the spot.  The bucket roots are the timers after
+ * the last entry, timers[capacity + n].
+ *
+ * A weighted table keeps the weight of every entry in t->weights and their
+ * sum in t->weight.
+ *
+ * The cache visits the keys and results for the cycle collector.  Tables
+ * count the entries holding a GC object in t->gc_entries and are skipped
+ * while there are none, and stored tuples of atomic values are untracked
+ * right away, as the collector would on its next pass, so that caches of
+ * plain values cost collections next to nothing.
+ *
+ * With weak_keys the key of an entry is a weak entry referring to the only
+ * argument of the call, and with weak_values its result is one referring
+ * to the result (t->weak_values).  The callback of a weak entry unlinks
+ * its entry once the referent died, so dead entries are only ever seen in
+ * between, e.g. while a comparison runs.  Lookups treat an entry whose
+ * result died as missing and never match a key that died.
+ *
+ * THREAD SAFETY NOTES:
+ * Comparing keys can run Python code (__eq__), which may switch threads or
+ * re-enter the cache from the same thread.  The table is only touched with
+ * the cache lock held, so only a re-entrant call from the same thread can
+ * change it during a comparison.  Every structural change bumps
+ * t->version and a lookup starts over if the version moved while it was
+ * comparing.  Objects removed from the table are handed back to the caller
+ * so they can be DECREF'd once the table is consistent again. */
+typedef uint32_t hindex;
 
+typedef struct {
+  Py_hash_t hash;
+  PyObject *key;      // NULL for a free entry
+  PyObject *result;
+  hindex prev;
+  hindex next;        // next free entry for a free entry
+} hslot;
 
+/* expiry of an entry and its links in the timer wheel */
 typedef struct {
-  PyObject_HEAD
-  PyObject *fn ; // original function
-  PyObject *func_module, *func_name, *func_qualname, *func_annotations;
-  PyObject *func_dict;
-  PyObject *cache_dict;
-  PyObject *ex_state;
-  int typed;
-  enum unhashable err;
-  PyObject *cinfo; // named tuple constructor
-  Py_ssize_t maxsize, hits, misses;
-  clist *root;
-  // lock for cache access
-#ifdef WITH_THREAD
-  PyThread_type_lock lock;
-  long rlock_owner;
-  unsigned long rlock_count;
+  double written;     // time the result was stored
+  double deadline;
+  hindex prev;
+  hindex next;
+} htimer;
+
+typedef struct {
+  hslot *slots;       // capacity + HT_ROOTS(t) entries, the last are roots
+  htimer *timers;     // capacity + HT_WHEEL_SIZE timers, NULL without ttl
+  Py_ssize_t *weights;  // entry weights, NULL for an unweighted table
+  hindex *index;      // size slots, entry number + 1 or 0 if empty
+  unsigned char *marks; // CLOCK reference bits or TinyLFU queues, or NULL
+  hindex size;        // index slots, a power of two
+  hindex capacity;    // entries, HT_USABLE(size)
+  hindex fill;        // entries handed out since the table was made
+  hindex free;        // first free entry below fill, or HT_NONE
+  int shift;          // bits dropped when mapping a hash to a slot
+  int clock;          // use the CLOCK policy
+  int lfu;            // use the TinyLFU queues
+  Py_ssize_t queued[3];   // entries in each TinyLFU queue
+  Py_ssize_t window_max, protected_max;   // TinyLFU queue bounds
+  int weighted;       // keep entry weights
+  int weak_values;    // results are weak entries
+  Py_ssize_t weight;  // sum of the entry weights
+  double ttl_write;   // expire entries this long after they were stored
+  double ttl_access;  // expire entries this long after they were used
+  double tick;        // span of a wheel bucket, 0 without ttl
+  PY_LONG_LONG wheel;   // bucket number of the wheel position, -1 if unset
+  Py_ssize_t used;
+  Py_ssize_t gc_entries;  // entries whose key or result is a GC object
+  size_t version;
+  Py_ssize_t eq_calls;  // keys compared after their hashes matched
+} htable;
+
+#define HT_MIN_CAPACITY ((Py_ssize_t)8)
+#define HT_MAX_CAPACITY ((Py_ssize_t)1 << 31)
+#define HT_NONE ((hindex)-1)
+#define HT_WHEEL_SIZE 64
+/* TinyLFU queues */
+#define HT_WINDOW 0
+#define HT_PROBATION 1
+#define HT_PROTECTED 2
+#define HT_ROOTS(t) ((t)->lfu ? 3 : 1)
+/* keep the load factor at or below 2/3 */
+#define HT_USABLE(size) ((Py_ssize_t)(size) * 2 / 3)
+/* bytes needed for the entries, timers, weights, index and marks of a
+ * table with size index slots */
+#define HT_ALLOC_SIZE(t, size) \
+  (((size_t)HT_USABLE(size) + HT_ROOTS(t)) * sizeof(hslot) + \
+   ((t)->tick > 0 ? \
+    ((size_t)HT_USABLE(size) + HT_WHEEL_SIZE) * sizeof(htimer) : 0) + \
+   ((t)->weighted ? (size_t)HT_USABLE(size) * sizeof(Py_ssize_t) : 0) + \
+   (size_t)(size) * sizeof(hindex) + \
+   ((t)->clock || (t)->lfu ? (size_t)HT_USABLE(size) : 0))
+#define HT_ROOT(t) ((t)->capacity)
+#define HT_QROOT(t, q) ((t)->capacity + (hindex)(q))
+/* root of the list holding entry i */
+#define HT_ROOT_OF(t, i) ((t)->lfu ? HT_QROOT(t, (t)->marks[i]) : HT_ROOT(t))
+#define HT_NEXT(t, p) (((p) + 1) & ((t)->size - 1))
+
+/* Fibonacci hashing spreads runs of small integer hashes over the table */
+#if SIZEOF_SIZE_T > 4
+#define HT_GOLDEN ((size_t)11400714819323198485ULL)
+#else
+#define HT_GOLDEN ((size_t)2654435769UL)
 #endif
-} cacheobject ;
+#define HT_HOME(t, h) ((hindex)(((size_t)(h) * HT_GOLDEN) >> (t)->shift))
 
+#define HT_EXPIRED(t, i, now) \
+  ((t)->timers != NULL && (t)->timers[i].deadline <= (now))
+/* whether the weakly held result of entry i died */
+#define HT_DEAD(t, i) ((t)->weak_values && WEAK_DEAD((t)->slots[i].result))
 
-#define OFF(x) offsetof(cacheobject, x)
-// attributes from wrapped function
-static PyMemberDef cache_memberlist[] = {
-  {"__wrapped__", T_OBJECT, OFF(fn), RESTRICTED | READONLY},
-  {"__module__",  T_OBJECT, OFF(func_module), RESTRICTED | READONLY},
-  {"__name__",    T_OBJECT, OFF(func_name), RESTRICTED | READONLY},
-  {"__qualname__",T_OBJECT, OFF(func_qualname), RESTRICTED | READONLY},
-  {"__annotations__", T_OBJECT, OFF(func_annotations), RESTRICTED | READONLY},
-  {NULL} /* Sentinel */
-};
 
+/* A key being looked up: an object, or for calls on builtin scalars the
+ * borrowed array of arguments (obj == NULL), compared item by item with
+ * a stored key tuple. */
+typedef struct {
+  Py_hash_t hash;
+  PyObject *obj;
+  PyObject *const *items;
+  Py_ssize_t size;
+} probekey;
 
-// getsetters from wrapped function
-static PyObject *
-cache_get_doc(cacheobject * co, void *closure)
-{
-  PyFunctionObject * fn = (PyFunctionObject *) co->fn;
-  if (fn->func_doc == NULL)
-    Py_RETURN_NONE;
 
-  INC_RETURN(fn->func_doc);
+static void *
+ht_calloc(size_t n, size_t size)
+{
+#if PY_VERSION_HEX >= 0x03050000
+  return PyMem_Calloc(n, size);
+#else
+  void *p = PyMem_Malloc(n * size);
+  if (p != NULL)
+    memset(p, 0, n * size);
+  return p;
+#endif
 }
 
-#if defined(_PY2) || defined (_PY32)
 
+/* (Re)initialise t as an empty table with size index slots, a power of
+ * two.  The version keeps counting up so that lookups in progress notice,
+ * and the policy and ttl settings are kept as well. */
 static int
-restricted(void)
+htable_init(htable *t, Py_ssize_t size)
 {
-#ifdef _PY2
-    if (!PyEval_GetRestricted())
-#endif
-        return 0;
-    PyErr_SetString(PyExc_RuntimeError,
-        "function attributes not accessible in restricted mode");
-    return 1;
+  int bits = 0;
+  hindex n, capacity = (hindex)HT_USABLE(size);
+  hslot *slots = (hslot *)ht_calloc(HT_ALLOC_SIZE(t, size), 1);
+  char *extra = (char *)(slots + capacity + HT_ROOTS(t));
+
+  if (slots == NULL){
+    PyErr_NoMemory();
+    return -1;
+  }
+  while (((Py_ssize_t)1 << bits) < size)
+    bits++;
+  t->slots = slots;
+  t->timers = NULL;
+  if (t->tick > 0){
+    t->timers = (htimer *)extra;
+    extra += ((size_t)capacity + HT_WHEEL_SIZE) * sizeof(htimer);
+    for(n = capacity; n < capacity + HT_WHEEL_SIZE; n++)
+      t->timers[n].prev = t->timers[n].next = n;
+  }
+  t->weights = NULL;
+  if (t->weighted){
+    t->weights = (Py_ssize_t *)extra;
+    extra += (size_t)capacity * sizeof(Py_ssize_t);
+  }
+  t->index = (hindex *)extra;
+  extra += (size_t)size * sizeof(hindex);
+  t->marks = t->clock || t->lfu ? (unsigned char *)extra : NULL;
+  t->size = (hindex)size;
+  t->capacity = capacity;
+  t->fill = 0;
+  t->free = HT_NONE;
+  t->shift = 8 * SIZEOF_SIZE_T - bits;
+  t->wheel = -1;
+  t->weight = 0;
+  t->queued[0] = t->queued[1] = t->queued[2] = 0;
+  t->used = 0;
+  t->gc_entries = 0;
+  t->version++;
+  for(n = capacity; n < capacity + HT_ROOTS(t); n++)
+    slots[n].prev = slots[n].next = n;
+  return 0;
 }
 
 
-static PyObject *
-func_get_dict(PyFunctionObject *op)
+/* Release the entries and memory of a table that is no longer reachable
+ * from the cache. */
+static void
+htable_free_slots(hslot *slots, hindex capacity)
 {
-    if (restricted())
-        return NULL;
-    if (op->func_dict == NULL) {
-        op->func_dict = PyDict_New();
-        if (op->func_dict == NULL)
-            return NULL;
+  hindex i;
+  for(i = 0; i < capacity; i++){
+    if (slots[i].key != NULL){
+      Py_DECREF(slots[i].key);
+      Py_DECREF(slots[i].result);
     }
-    Py_INCREF(op->func_dict);
-    return op->func_dict;
+  }
+  PyMem_Free(slots);
 }
 
-static int
-func_set_dict(PyFunctionObject *op, PyObject *value)
-{
-    PyObject *tmp;
 
-    if (restricted())
-        return -1;
-    /* It is illegal to del f.func_dict */
-    if (value == NULL) {
-        PyErr_SetString(PyExc_TypeError,
-                        "function's dictionary may not be deleted");
-        return -1;
-    }
-    /* Can only set func_dict to a dictionary */
-    if (!PyDict_Check(value)) {
-        PyErr_SetString(PyExc_TypeError,
-                        "setting function's dictionary to a non-dict");
-        return -1;
+/* entries released between two chances for other threads to run */
+#define HT_RELEASE_CHUNK 64
+
+/* Like htable_free_slots, for a large table swapped out by cache_clear.
+ * The GIL is let go after each chunk of entries, so that other threads do
+ * not wait for all of them to be released. */
+static void
+htable_release_slots(hslot *slots, hindex capacity)
+{
+  hindex i, n = 0;
+  for(i = 0; i < capacity; i++){
+    if (slots[i].key != NULL){
+      Py_DECREF(slots[i].key);
+      Py_DECREF(slots[i].result);
+      if (++n % HT_RELEASE_CHUNK == 0){
+        Py_BEGIN_ALLOW_THREADS
+        Py_END_ALLOW_THREADS
+      }
     }
-    tmp = op->func_dict;
-    Py_INCREF(value);
-    op->func_dict = value;
-    Py_XDECREF(tmp);
-    return 0;
+  }
+  PyMem_Free(slots);
 }
 
-static PyGetSetDef cache_getset[] = {
-  {"__doc__", (getter)cache_get_doc, NULL, NULL, NULL},
-  {"__dict__", (getter)func_get_dict, (setter)func_set_dict},
-  {NULL} /* Sentinel */
-};
 
-#else
+static void
+ht_unlink(hslot *slots, hindex i)
+{
+  slots[slots[i].prev].next = slots[i].next;
+  slots[slots[i].next].prev = slots[i].prev;
+}
 
-static PyGetSetDef cache_getset[] = {
-  {"__doc__", (getter)cache_get_doc, NULL, NULL, NULL},
-  {"__dict__", PyObject_GenericGetDict, PyObject_GenericSetDict},
-  {NULL} /* Sentinel */
-};
 
-#endif
+static void
+ht_link_first(hslot *slots, hindex root, hindex i)
+{
+  hindex oldfirst = slots[root].next;
+  slots[i].prev = root;
+  slots[i].next = oldfirst;
+  slots[oldfirst].prev = i;
+  slots[root].next = i;
+}
 
 
-/* Bind a function to an object */
-static PyObject *
-cache_descr_get(PyObject *func, PyObject *obj, PyObject *type)
+/* make entry i the most recently used entry of its list, or with CLOCK the
+ * newest */
+static void
+ht_make_first(htable *t, hindex i)
 {
-    if (obj == Py_None || obj == NULL)
-      INC_RETURN(func);
+  hindex root = HT_ROOT_OF(t, i);
+  if (t->slots[root].next != i){
+    ht_unlink(t->slots, i);
+    ht_link_first(t->slots, root, i);
+  }
+}
 
-#ifdef _PY2
-    return PyMethod_New(func, obj, type);
-#else
-    return PyMethod_New(func, obj);
-#endif
+
+/* Take a free entry, which must exist, and index it under hash */
+static hindex
+ht_new_entry(htable *t, Py_hash_t hash)
+{
+  hindex p = HT_HOME(t, hash), i;
+
+  if (t->free != HT_NONE){
+    i = t->free;
+    t->free = t->slots[i].next;
+  }
+  else
+    i = t->fill++;
+  while (t->index[p] != 0)
+    p = HT_NEXT(t, p);
+  t->index[p] = i + 1;
+  t->slots[i].hash = hash;
+  return i;
 }
 
 
+/* add timer i to the wheel bucket of its deadline */
 static void
-cache_dealloc(cacheobject *co)
+ht_timer_link(htable *t, hindex i)
 {
-  Py_CLEAR(co->fn);
-  Py_CLEAR(co->func_module);
-  Py_CLEAR(co->func_name);
-  Py_CLEAR(co->func_qualname);
-  Py_CLEAR(co->func_annotations);
-  Py_CLEAR(co->func_dict);
-  Py_CLEAR(co->cache_dict);
-  Py_CLEAR(co->ex_state);
-  Py_CLEAR(co->cinfo);
-  Py_CLEAR(co->root);
-  FREE_LOCK(co);
-  Py_TYPE(co)->tp_free(co);
+  htimer *tm = t->timers;
+  PY_LONG_LONG bucket = (PY_LONG_LONG)floor(tm[i].deadline / t->tick);
+  hindex root;
+
+  // a deadline in a bucket the wheel has passed goes to the current one
+  if (bucket < t->wheel)
+    bucket = t->wheel;
+  root = t->capacity + (hindex)(bucket & (HT_WHEEL_SIZE - 1));
+  // at the tail, so that reaping a bucket never revisits a relinked timer
+  tm[i].next = root;
+  tm[i].prev = tm[root].prev;
+  tm[tm[root].prev].next = i;
+  tm[root].prev = i;
+}
+
 
+static void
+ht_timer_unlink(htimer *tm, hindex i)
+{
+  tm[tm[i].prev].next = tm[i].next;
+  tm[tm[i].next].prev = tm[i].prev;
 }
 
 
-/*
- * attempt to set hs->hashvalue to hash(hs->args)  Does not do alter any
- * reference counts.  Returns NULL on error.  If hs->hashvalue==-1 on return
- * then hs->args is Unhashable
- */
-static PyObject *
-set_hash_value(cacheobject *co, HashedArgs *hs)
+/* Move all entries to a fresh table with size index slots, keeping the LRU
+ * order.  No comparisons are needed since every entry stores its hash, and
+ * the entries end up packed at the front of the new array. */
+static int
+htable_resize(htable *t, Py_ssize_t size)
 {
-  if ((hs->hashvalue = PyObject_Hash(hs->args)) == -1) {
-    // unhashable
-    if (co->err == FC_ERROR) {
-      return NULL;
-    }
-    // if error was something other than a TypeError, exit
-    if (!PyErr_GivenExceptionMatches(PyErr_Occurred(), PyExc_TypeError)) {
-      return NULL;
-    }
-    PyErr_Clear();
+  htable nt;
+  hslot *old = t->slots;
+  hindex oroot, i, j;
+  int q;
 
-    if (co->err == FC_WARNING) {
-      // try to issue warning
-      if( PyErr_WarnEx(PyExc_UserWarning,
-          "Unhashable arguments cannot be cached",1) < 0){
-        // warning becomes exception
-        PyErr_SetString(PyExc_TypeError,
-                        "Cached function arguments must be hashable");
-        return NULL;
+  nt = *t;
+  if (htable_init(&nt, size) < 0)
+    return -1;
+  nt.wheel = t->wheel;
+  for(q = 0; q < HT_ROOTS(t); q++){
+    oroot = HT_QROOT(t, q);
+    // walk from least to most recently used, linking each entry first
+    for(i = old[oroot].prev; i != oroot; i = old[i].prev){
+      j = ht_new_entry(&nt, old[i].hash);
+      nt.slots[j].key = old[i].key;
+      nt.slots[j].result = old[i].result;
+      if (nt.marks != NULL)
+        nt.marks[j] = t->marks[i];
+      if (nt.weights != NULL)
+        nt.weights[j] = t->weights[i];
+      if (nt.timers != NULL){
+        nt.timers[j] = t->timers[i];
+        ht_timer_link(&nt, j);
       }
+      ht_link_first(nt.slots, HT_QROOT(&nt, q), j);
     }
   }
-  // success!
-  return (PyObject *) hs;
+  nt.used = t->used;
+  nt.gc_entries = t->gc_entries;
+  nt.weight = t->weight;
+  memcpy(nt.queued, t->queued, sizeof(t->queued));
+  PyMem_Free(old);
+  *t = nt;
+  return 0;
 }
 
-// compute the hash of function args and kwargs
-// THREAD SAFTEY NOTES:
-// We access global data: co->ex_state and co->typed.
-// These data are defined at co creation time and are not
-// changed so we do not need to worry about thread safety here
-static PyObject *
-make_key(cacheobject *co, PyObject *args, PyObject *kw)
+
+/* index slots of a table holding n entries without resizing */
+static Py_ssize_t
+htable_size_for(Py_ssize_t n)
 {
-  PyObject *item, *keys, *key;
-  Py_ssize_t ex_size = 0;
-  Py_ssize_t arg_size = 0;
-  Py_ssize_t kw_size = 0;
-  Py_ssize_t i, size, off;
-  HashedArgs *hs;
-  int is_list = 1;
+  Py_ssize_t size = HT_MIN_CAPACITY;
 
-  // determine size of arguments and types
-  if (PyList_Check(co->ex_state))
-    ex_size = Py_SIZE(co->ex_state);
-  else if (PyDict_CheckExact(co->ex_state)){
-    is_list = 0;
-    ex_size = PyDict_Size(co->ex_state);
-  }
-  if (args && PyTuple_CheckExact(args))
-    arg_size = PyTuple_GET_SIZE(args);
-  if (kw && PyDict_CheckExact(kw))
-    kw_size = PyDict_Size(kw);
+  while (HT_USABLE(size) < n && size < HT_MAX_CAPACITY)
+    size <<= 1;
+  return size;
+}
 
-  // allocate HashedArgs Object
-  if(!(hs = PyObject_New(HashedArgs, &HashedArgs_type)))
-    return NULL;
 
-  // total size
-  if (co->typed)
-    size = (2-is_list)*ex_size+2*arg_size+3*kw_size;
-  else
-    size = (2-is_list)*ex_size+arg_size+2*kw_size;
-  // initialize new tuple
-  if(!(hs->args = PyTuple_New(size))){
-    return NULL;
-  }
-  // incorporate extra state
-  if(is_list){
-    for(i = 0; i < ex_size; i++){
-      PyObject *tmp = PyList_GET_ITEM(co->ex_state, i);
-      PyTuple_SET_ITEM(hs->args, i, tmp);
-      Py_INCREF(tmp);
-    }
+/* Grow t so that it holds n entries without resizing again */
+static int
+htable_reserve(htable *t, Py_ssize_t n)
+{
+  Py_ssize_t size = htable_size_for(n);
+
+  if (size <= (Py_ssize_t)t->size)
+    return 0;
+  return htable_resize(t, size);
+}
+
+
+static int
+key_equal(PyObject *stored, probekey *pk)
+{
+  if (WEAK_ENTRY_CHECK(stored)){
+    // a weak key is compared through its referent, a dead one never matches
+    PyObject *op = weak_deref(stored);
+    int k = 0;
+    if (op != NULL && pk->obj != NULL)
+      k = op == pk->obj ? 1 : PyObject_RichCompareBool(op, pk->obj, Py_EQ);
+    Py_XDECREF(op);
+    return k;
   }
-  else if(ex_size > 0){
-    if(!(keys = PyDict_Keys(co->ex_state))){
-      Py_DECREF(hs);
-      return NULL;
-    }
-    if( PyList_Sort(keys) < 0){
-      Py_DECREF(keys);
-      Py_DECREF(hs);
-      return NULL;
-    }
-    for(i = 0; i < ex_size; i++){
-      key = PyList_GET_ITEM(keys, i);
-      Py_INCREF(key);
-      PyTuple_SET_ITEM(hs->args, 2*i, key);
+  if (pk->obj != NULL)
+    return PyObject_RichCompareBool(stored, pk->obj, Py_EQ);
+  if (!PyTuple_CheckExact(stored) || PyTuple_GET_SIZE(stored) != pk->size)
+    return 0;
+  return items_equal(((PyTupleObject *)stored)->ob_item, pk->items,
+                     pk->size);
+}
 
-      if(!(item = PyDict_GetItem(co->ex_state, key))){
-        Py_DECREF(keys);
-        Py_DECREF(hs);
-        return NULL;
+
+/* Find pk in the table.  Returns 1 and sets *index to its entry if found,
+ * 0 if not and -1 if a comparison raised. */
+static int
+htable_lookup(htable *t, probekey *pk, hindex *index)
+{
+  hindex p, i;
+  size_t version;
+  PyObject *stored;
+  int k;
+
+ restart:
+  p = HT_HOME(t, pk->hash);
+  while ((i = t->index[p]) != 0){
+    i--;
+    stored = t->slots[i].key;
+    if (stored == pk->obj){
+      *index = i;
+      return 1;
+    }
+    if (t->slots[i].hash == pk->hash){
+      version = t->version;
+      // the comparison may run Python code that removes the stored key
+      Py_INCREF(stored);
+      t->eq_calls++;
+      k = key_equal(stored, pk);
+      Py_DECREF(stored);
+      if (k < 0)
+        return -1;
+      if (t->version != version)
+        goto restart;
+      if (k){
+        *index = i;
+        return 1;
       }
-      Py_INCREF(item);
-      PyTuple_SET_ITEM(hs->args, 2*i+1, item);
     }
-    Py_DECREF(keys);
+    p = HT_NEXT(t, p);
   }
-  off = (2-is_list)*ex_size;
+  return 0;
+}
 
-  // incorporate arguments
-  for(i = 0; i < arg_size; i++){
-    PyObject *tmp = PyTuple_GET_ITEM(args, i);
-    PyTuple_SET_ITEM(hs->args, off+i, tmp);
-    Py_INCREF(tmp);
-    if(co->typed) {
-      off += 1;
-      tmp = (PyObject *)Py_TYPE(tmp);
-      Py_INCREF(tmp);
-      PyTuple_SET_ITEM(hs->args, off+i, tmp);
+
+/* The entry holding the weak entry ref as its key or result, found by
+ * identity so that no key is compared, or HT_NONE if there is none. */
+static hindex
+htable_find_ref(htable *t, PyObject *ref)
+{
+  hindex p = HT_HOME(t, ((weakentryobject *)ref)->key_hash), i;
+
+  while ((i = t->index[p]) != 0){
+    i--;
+    if (t->slots[i].key == ref || t->slots[i].result == ref)
+      return i;
+    p = HT_NEXT(t, p);
+  }
+  return HT_NONE;
+}
+
+
+#if PY_VERSION_HEX >= 0x03090000
+#define FC_GC_IS_TRACKED(o) PyObject_GC_IsTracked(o)
+#else
+#define FC_GC_IS_TRACKED(o) _PyObject_GC_IS_TRACKED(o)
+#endif
+
+/* whether the cycle collector needs to see an entry */
+#define HT_GC_ENTRY(key, result) (PyObject_IS_GC(key) || PyObject_IS_GC(result))
+
+/* Untrack a tuple that cannot be part of a cycle, one whose items are not
+ * GC objects or are untracked tuples themselves, as the collector does. */
+static void
+ht_untrack_tuple(PyObject *op)
+{
+  Py_ssize_t i;
+
+  if (!PyTuple_CheckExact(op) || !FC_GC_IS_TRACKED(op))
+    return;
+  for(i = 0; i < PyTuple_GET_SIZE(op); i++){
+    PyObject *item = PyTuple_GET_ITEM(op, i);
+    if (PyObject_IS_GC(item) &&
+        (!PyTuple_CheckExact(item) || FC_GC_IS_TRACKED(item)))
+      return;
+  }
+  PyObject_GC_UnTrack(op);
+}
+
+
+/* Insert a key known not to be in the table as the most recently used
+ * entry of the given weight, stored at time now.  On success the
+ * references to key and result are stolen and the entry is returned.
+ * Returns -1 with an exception set on failure. */
+static Py_ssize_t
+htable_insert(htable *t, Py_hash_t hash, PyObject *key, PyObject *result,
+              Py_ssize_t weight, double now)
+{
+  hindex i;
+
+  if (t->used >= (Py_ssize_t)t->capacity){
+    if ((Py_ssize_t)t->size >= HT_MAX_CAPACITY){
+      PyErr_SetString(PyExc_OverflowError, "cache table is full");
+      return -1;
     }
+    if (htable_resize(t, (Py_ssize_t)t->size << 1) < 0)
+      return -1;
   }
-  off += arg_size;
+  i = ht_new_entry(t, hash);
+  t->slots[i].key = key;
+  t->slots[i].result = result;
+  ht_untrack_tuple(key);
+  ht_untrack_tuple(result);
+  if (HT_GC_ENTRY(key, result))
+    t->gc_entries++;
+  if (t->marks != NULL)
+    t->marks[i] = 0;      // unreferenced, or in the TinyLFU window
+  if (t->lfu)
+    t->queued[HT_WINDOW]++;
+  if (t->weights != NULL){
+    t->weights[i] = weight;
+    t->weight += weight;
+  }
+  if (t->timers != NULL){
+    htimer *tm = &t->timers[i];
+    tm->written = now;
+    tm->deadline = now + (t->ttl_write > 0 ? t->ttl_write : t->ttl_access);
+    if (t->ttl_access > 0 && now + t->ttl_access < tm->deadline)
+      tm->deadline = now + t->ttl_access;
+    ht_timer_link(t, i);
+  }
+  ht_link_first(t->slots, HT_ROOT(t), i);
+  t->used++;
+  t->version++;
+  return i;
+}
 
-  // incorporate keyword arguments
-  if(kw_size > 0){
-    if(!(keys = PyDict_Keys(kw))){
-      Py_DECREF(hs);
-      return NULL;
+
+/* Remove entry i.  The references it held are returned through key and
+ * result for the caller to release once the table is consistent. */
+static void
+htable_remove(htable *t, hindex i, PyObject **key, PyObject **result)
+{
+  hslot *slots = t->slots;
+  hindex p = HT_HOME(t, slots[i].hash), q, home;
+
+  *key = slots[i].key;
+  *result = slots[i].result;
+  if (HT_GC_ENTRY(*key, *result))
+    t->gc_entries--;
+  ht_unlink(slots, i);
+  if (t->lfu)
+    t->queued[t->marks[i]]--;
+  if (t->weights != NULL)
+    t->weight -= t->weights[i];
+  if (t->timers != NULL)
+    ht_timer_unlink(t->timers, i);
+  while (t->index[p] != i + 1)
+    p = HT_NEXT(t, p);
+  // shift back the rest of the probe run so lookups need no tombstones
+  for(q = p;;){
+    q = HT_NEXT(t, q);
+    if (t->index[q] == 0)
+      break;
+    home = HT_HOME(t, slots[t->index[q] - 1].hash);
+    // leave slot q alone if its home lies cyclically in (p, q]
+    if (p <= q ? (p < home && home <= q) : (p < home || home <= q))
+      continue;
+    t->index[p] = t->index[q];
+    p = q;
+  }
+  t->index[p] = 0;
+  slots[i].key = NULL;
+  slots[i].result = NULL;
+  slots[i].next = t->free;
+  t->free = i;
+  t->used--;
+  t->version++;
+}
+
+
+/* move entry i to the front of TinyLFU queue q */
+static void
+ht_requeue(htable *t, hindex i, int q)
+{
+  ht_unlink(t->slots, i);
+  t->queued[t->marks[i]]--;
+  t->marks[i] = (unsigned char)q;
+  t->queued[q]++;
+  ht_link_first(t->slots, HT_QROOT(t, q), i);
+}
+
+
+/* Record a hit on entry i of a TinyLFU table.  A second hit promotes a
+ * probation entry to the protected queue, whose least recently used
+ * entries fall back to probation when it grows past its bound. */
+static void
+htable_lfu_hit(htable *t, hindex i)
+{
+  if (t->marks[i] != HT_PROBATION){
+    ht_make_first(t, i);
+    return;
+  }
+  ht_requeue(t, i, HT_PROTECTED);
+  while (t->queued[HT_PROTECTED] > t->protected_max)
+    ht_requeue(t, t->slots[HT_QROOT(t, HT_PROTECTED)].prev, HT_PROBATION);
+}
+
+
+/* The least recently used entry of the TinyLFU main queues, probation
+ * first, or the root if both are empty. */
+static hindex
+ht_lfu_main_victim(htable *t)
+{
+  hindex i = t->slots[HT_QROOT(t, HT_PROBATION)].prev;
+  if (i == HT_QROOT(t, HT_PROBATION))
+    i = t->slots[HT_QROOT(t, HT_PROTECTED)].prev;
+  return i;
+}
+
+
+/* The entry to evict: the least recently used one, or with CLOCK the
+ * oldest entry not referenced since the hand last passed it.  TinyLFU
+ * tables evict from the main queues before the window. */
+static hindex
+htable_victim(htable *t)
+{
+  hindex root = HT_ROOT(t), i;
+
+  if (t->lfu){
+    i = ht_lfu_main_victim(t);
+    return i < t->capacity ? i : t->slots[HT_QROOT(t, HT_WINDOW)].prev;
+  }
+  if (t->clock){
+    while (t->marks[i = t->slots[root].prev]){
+      t->marks[i] = 0;
+      ht_make_first(t, i);
     }
-    if( PyList_Sort(keys) < 0){
-      Py_DECREF(keys);
-      Py_DECREF(hs);
-      return NULL;
+  }
+  return t->slots[root].prev;
+}
+
+
+/* Keys and results removed from a table while the lock is held.  They are
+ * released with garbage_release once the lock is dropped, since their
+ * destructors may run Python code that calls back into the cache. */
+#define GARBAGE_SMALL 16
+
+typedef struct {
+  PyObject **items;
+  Py_ssize_t size, allocated;
+  PyObject *small[GARBAGE_SMALL];
+} garbage;
+
+
+static void
+garbage_init(garbage *g)
+{
+  g->items = g->small;
+  g->size = 0;
+  g->allocated = GARBAGE_SMALL;
+}
+
+
+/* make room for removing one more entry, returns -1 if out of memory */
+static int
+garbage_reserve(garbage *g)
+{
+  PyObject **items;
+  Py_ssize_t allocated;
+
+  if (g->size + 2 <= g->allocated)
+    return 0;
+  allocated = g->allocated * 2;
+  if (g->items == g->small){
+    items = PyMem_New(PyObject *, allocated);
+    if (items != NULL)
+      memcpy(items, g->small, g->size * sizeof(PyObject *));
+  }
+  else
+    items = PyMem_Resize(g->items, PyObject *, allocated);
+  if (items == NULL)
+    return -1;
+  g->items = items;
+  g->allocated = allocated;
+  return 0;
+}
+
+
+/* Remove entry i into g, which must have room for it */
+static void
+htable_remove_into(htable *t, hindex i, garbage *g)
+{
+  htable_remove(t, i, &g->items[g->size], &g->items[g->size + 1]);
+  g->size += 2;
+}
+
+
+static void
+garbage_release(garbage *g)
+{
+  Py_ssize_t i;
+  for(i = 0; i < g->size; i++)
+    Py_DECREF(g->items[i]);
+  if (g->items != g->small)
+    PyMem_Free(g->items);
+  garbage_init(g);
+}
+
+
+/* Advance the timer wheel to now, reaping the entries in the buckets it
+ * passes into g.  Stops early, leaving entries for a later call, if g
+ * cannot grow. */
+static void
+htable_expire(htable *t, double now, garbage *g)
+{
+  PY_LONG_LONG bucket = (PY_LONG_LONG)floor(now / t->tick);
+  htimer *tm = t->timers;
+  hindex root, i;
+  Py_ssize_t n, passed = 0;
+
+  if (t->wheel < 0 || t->used == 0){
+    t->wheel = bucket;
+    return;
+  }
+  while (t->wheel < bucket){
+    // after a full turn every bucket has been visited
+    if (passed++ == HT_WHEEL_SIZE){
+      t->wheel = bucket;
+      break;
     }
-    for(i = 0; i < kw_size; i++){
-      key = PyList_GET_ITEM(keys, i);
-      Py_INCREF(key);
-      PyTuple_SET_ITEM(hs->args, off+i, key);
-      if(!(item = PyDict_GetItem(kw, key))){
-        Py_DECREF(keys);
-        Py_DECREF(hs);
-        return NULL;
+    root = t->capacity + (hindex)(t->wheel & (HT_WHEEL_SIZE - 1));
+    t->wheel++;
+    // count first, timers that have not expired are moved to the tail
+    for(n = 0, i = tm[root].next; i != root; i = tm[i].next)
+      n++;
+    while (n-- > 0){
+      i = tm[root].next;
+      if (tm[i].deadline <= now){
+        if (garbage_reserve(g) < 0)
+          return;
+        htable_remove_into(t, i, g);
       }
-      off += 1;
-      Py_INCREF(item);
-      PyTuple_SET_ITEM(hs->args, off+i, item);
-      if (co->typed){
-          off += 1;
-          item = (PyObject *)Py_TYPE(item);
-          Py_INCREF(item);
-          PyTuple_SET_ITEM(hs->args, off+i, item);
+      else {
+        ht_timer_unlink(tm, i);
+        ht_timer_link(t, i);
       }
     }
-    Py_DECREF(keys);
   }
-  // check for an error we may have missed
-  if( PyErr_Occurred() ){
-    Py_DECREF(hs);
+}
+
+
+/* Restart the expire_after_access period of entry i at time now */
+static void
+htable_touch(htable *t, hindex i, double now)
+{
+  htimer *tm = &t->timers[i];
+  double deadline = now + t->ttl_access;
+
+  if (t->ttl_write > 0 && tm->written + t->ttl_write < deadline)
+    deadline = tm->written + t->ttl_write;
+  tm->deadline = deadline;
+  ht_timer_unlink(t->timers, i);
+  ht_timer_link(t, i);
+}
+
+/***************************************************
+ End of hash table
+***************************************************/
+
+/***********************************************************
+ single flight
+************************************************************/
+/* With single_flight=True a miss registers a flight for its key while the
+ * wrapped function runs.  Other threads that miss on the same key wait for
+ * the flight instead of calling the function again, and share its result
+ * or exception.  The flight lock works as an event: the owner holds it
+ * until the flight lands and every waiter passes it on by acquiring and
+ * immediately releasing it.
+ *
+ * A thread that owns a flight (in any cache) never waits for another
+ * flight, it computes the result itself instead.  Waiting threads thus own
+ * nothing and waits cannot form a cycle, e.g. between mutually recursive
+ * cached functions. */
+#ifdef WITH_THREAD
+
+#if defined(_MSC_VER)
+#define FC_THREAD_LOCAL __declspec(thread)
+#else
+#define FC_THREAD_LOCAL __thread
+#endif
+
+/* number of flights owned by the current thread */
+static FC_THREAD_LOCAL int flights_owned = 0;
+
+typedef struct flightobject {
+  PyObject_HEAD
+  struct flightobject *next;  // list of the flights of a cache
+  Py_hash_t hash;
+  PyObject *key;
+  long owner;                 // thread calling the wrapped function
+  PyObject *result;           // outcome, set when the flight lands
+  PyObject *exc_type, *exc_value, *exc_tb;
+  PyThread_type_lock lock;
+} flightobject;
+
+
+static void
+flight_dealloc(flightobject *fl)
+{
+  Py_XDECREF(fl->key);
+  Py_XDECREF(fl->result);
+  Py_XDECREF(fl->exc_type);
+  Py_XDECREF(fl->exc_value);
+  Py_XDECREF(fl->exc_tb);
+  if (fl->lock)
+    PyThread_free_lock(fl->lock);
+  Py_TYPE(fl)->tp_free(fl);
+}
+
+
+static PyTypeObject flight_type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "_lrucache.flight",      /* tp_name */
+  sizeof(flightobject),    /* tp_basicsize */
+  0,                       /* tp_itemsize */
+  (destructor)flight_dealloc,  /* tp_dealloc */
+  0,                       /* tp_print */
+  0,                       /* tp_getattr */
+  0,                       /* tp_setattr */
+  0,                       /* tp_reserved */
+  0,                       /* tp_repr */
+  0,                       /* tp_as_number */
+  0,                       /* tp_as_sequence */
+  0,                       /* tp_as_mapping */
+  0,                       /* tp_hash */
+  0,                       /* tp_call */
+  0,                       /* tp_str */
+  0,                       /* tp_getattro */
+  0,                       /* tp_setattro */
+  0,                       /* tp_as_buffer */
+  Py_TPFLAGS_DEFAULT,      /* tp_flags */
+};
+
+
+/* new flight for key, owned by the current thread (lock held) */
+static flightobject *
+flight_new(PyObject *key, Py_hash_t hash)
+{
+  flightobject *fl = PyObject_New(flightobject, &flight_type);
+  if (fl == NULL)
+    return NULL;
+  fl->next = NULL;
+  fl->hash = hash;
+  fl->key = key;
+  Py_INCREF(key);
+  fl->owner = PyThread_get_thread_ident();
+  fl->result = fl->exc_type = fl->exc_value = fl->exc_tb = NULL;
+  if ((fl->lock = PyThread_allocate_lock()) == NULL){
+    Py_DECREF(fl);
+    PyErr_NoMemory();
     return NULL;
   }
-  // set hash value
-  if( !set_hash_value(co, hs) ) {
-    Py_DECREF(hs);
+  PyThread_acquire_lock(fl->lock, 1);
+  return fl;
+}
+
+
+/* Wait for fl to land and return its result, or raise its exception */
+static PyObject *
+flight_wait(flightobject *fl)
+{
+  if (lock_acquire(fl->lock, 1, NULL) == -1)
     return NULL;
+  PyThread_release_lock(fl->lock);
+  if (fl->result != NULL)
+    INC_RETURN(fl->result);
+  Py_XINCREF(fl->exc_type);
+  Py_XINCREF(fl->exc_value);
+  Py_XINCREF(fl->exc_tb);
+  PyErr_Restore(fl->exc_type, fl->exc_value, fl->exc_tb);
+  return NULL;
+}
+
+
+/* wake the waiters of a landed flight and drop the owner's reference */
+static void
+flight_done(flightobject *fl)
+{
+  if (fl != NULL){
+    PyThread_release_lock(fl->lock);
+    Py_DECREF(fl);
+  }
+}
+
+#else
+#define flight_land(sh, fl, result)
+#define flight_done(fl)
+#endif /* WITH_THREAD */
+
+/***************************************************
+ End of single flight
+***************************************************/
+
+/**********************************************************
+ cachedobject is the actual function with the cached results
+***********************************************************/
+
+/* how will unhashable arguments be handled */
+enum unhashable {FC_ERROR, FC_WARNING, FC_IGNORE, FC_FAIL};
+
+/* which entry is evicted from a full cache */
+enum policy {FC_LRU, FC_CLOCK, FC_TINYLFU, FC_POLICY_FAIL};
+
+
+/* Count-min sketch estimating how often each key was requested recently,
+ * for the TinyLFU admission policy.  The counters are 4 bits wide, 16 to a
+ * word, and every key increments one counter per row of FS_DEPTH rows
+ * sharing the same words.  Once sample increments were counted all
+ * counters are halved, so that old popularity fades. */
+#define FS_DEPTH 4
+
+typedef struct {
+  uint64_t *table;
+  size_t mask;        // counters - 1, the number of counters is a power of 2
+  Py_ssize_t size, sample;
+} fsketch;
+
+static const uint64_t fs_seeds[FS_DEPTH] = {
+  0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL,
+  0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL};
+
+
+/* size the sketch for a cache of maxsize entries, -1 if out of memory */
+static int
+fsketch_init(fsketch *fs, Py_ssize_t maxsize)
+{
+  size_t words = 8;
+  while (words < (size_t)maxsize)
+    words <<= 1;
+  fs->table = PyMem_New(uint64_t, words);
+  if (fs->table == NULL)
+    return -1;
+  memset(fs->table, 0, words * sizeof(uint64_t));
+  fs->mask = words * 16 - 1;
+  fs->size = 0;
+  fs->sample = 10 * maxsize;
+  return 0;
+}
+
+
+static void
+fsketch_clear(fsketch *fs)
+{
+  if (fs->table != NULL)
+    memset(fs->table, 0, (fs->mask + 1) / 16 * sizeof(uint64_t));
+  fs->size = 0;
+}
+
+
+/* counter of hash in row r */
+static size_t
+fs_index(fsketch *fs, Py_hash_t hash, int r)
+{
+  // small ints hash to themselves, so mix the bits before indexing
+  uint64_t h = ((uint64_t)(Py_uhash_t)hash + fs_seeds[r]) * fs_seeds[r];
+  return (size_t)(h ^ (h >> 32)) & fs->mask;
+}
+
+
+static int
+fsketch_frequency(fsketch *fs, Py_hash_t hash)
+{
+  int r, f = 15;
+  for(r = 0; r < FS_DEPTH; r++){
+    size_t k = fs_index(fs, hash, r);
+    int c = (int)(fs->table[k >> 4] >> ((k & 15) << 2)) & 15;
+    if (c < f)
+      f = c;
+  }
+  return f;
+}
+
+
+static void
+fsketch_increment(fsketch *fs, Py_hash_t hash)
+{
+  int r, added = 0;
+  size_t n;
+  for(r = 0; r < FS_DEPTH; r++){
+    size_t k = fs_index(fs, hash, r);
+    int shift = (int)(k & 15) << 2;
+    if (((fs->table[k >> 4] >> shift) & 15) != 15){
+      fs->table[k >> 4] += (uint64_t)1 << shift;
+      added = 1;
+    }
+  }
+  if (added && ++fs->size >= fs->sample){
+    for(n = 0; n <= fs->mask >> 4; n++)
+      fs->table[n] = (fs->table[n] >> 1) & 0x7777777777777777ULL;
+    fs->size /= 2;
+  }
+}
+
+
+/***********************************************************
+ miss ratio curve
+************************************************************/
+/* With mrc=rate the cache estimates its LRU hit ratio at every size from
+ * the reuse distances of its keys, the number of distinct other keys used
+ * between two uses of a key: a use hits in an LRU cache of more entries
+ * than that.  Following SHARDS, only keys whose mixed hash falls below a
+ * threshold are tracked, a spatial sample of about rate of the keys, and
+ * distances among them are scaled up by 1/rate.
+ *
+ * The last use of every tracked key is a time stamp, counting uses of
+ * tracked keys, and a Fenwick tree over the stamps gives the number of
+ * keys used since a stamp in O(log n).  When the stamps run out they are
+ * renumbered in order.  At most MRC_MAX_KEYS keys are tracked: beyond that
+ * the threshold is halved and the keys above it dropped, each use being
+ * weighed by the inverse of the rate it was sampled at.  Distances go to
+ * a histogram with 8 buckets per power of two. */
+#define MRC_MAX_KEYS 4096
+#define MRC_STAMPS (4 * MRC_MAX_KEYS)
+#define MRC_BUCKETS 320
+
+typedef struct {
+  uint64_t mix;           // mixed hash of the key
+  Py_ssize_t stamp;       // of the last use, 0 for an empty slot
+} mrckey;
+
+typedef struct {
+  uint64_t threshold;     // keys whose mixed hash is below are tracked
+  double rate;            // threshold / 2**64
+  mrckey keys[2 * MRC_MAX_KEYS];    // open addressing on the mixed hash
+  Py_ssize_t nkeys;
+  Py_ssize_t tree[MRC_STAMPS + 1];  // Fenwick tree, 1 at each last use
+  Py_ssize_t now;         // last stamp handed out
+  double hist[MRC_BUCKETS];         // weight of the uses by distance
+  double cold;            // weight of the first uses
+  mrckey scratch[MRC_MAX_KEYS + 1];  // for renumbering
+#ifdef Py_GIL_DISABLED
+  PyMutex mutex;
+#endif
+} mrctracker;
+
+#ifdef Py_GIL_DISABLED
+#define MRC_LOCK(m) PyMutex_Lock(&(m)->mutex)
+#define MRC_UNLOCK(m) PyMutex_Unlock(&(m)->mutex)
+#else
+/* with the GIL held an update is atomic, since it runs no Python code */
+#define MRC_LOCK(m)
+#define MRC_UNLOCK(m)
+#endif
+
+
+/* the tracker state of a new or cleared cache sampling rate of its keys */
+static void
+mrc_reset(mrctracker *m, double rate)
+{
+  memset(m->keys, 0, sizeof(m->keys));
+  memset(m->tree, 0, sizeof(m->tree));
+  memset(m->hist, 0, sizeof(m->hist));
+  m->nkeys = 0;
+  m->now = 0;
+  m->cold = 0;
+  m->rate = rate;
+  FC_STORE(&m->threshold, rate >= 1.0 ? UINT64_MAX :
+           (uint64_t)(rate * 18446744073709551616.0));
+}
+
+
+/* splitmix64 finalizer, hashes of small ints are the ints themselves */
+static uint64_t
+mrc_mix(Py_hash_t hash)
+{
+  uint64_t z = (uint64_t)(Py_uhash_t)hash + 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+
+static void
+mrc_tree_add(mrctracker *m, Py_ssize_t stamp, Py_ssize_t v)
+{
+  for(; stamp <= MRC_STAMPS; stamp += stamp & -stamp)
+    m->tree[stamp] += v;
+}
+
+
+/* number of tracked keys last used at or before stamp */
+static Py_ssize_t
+mrc_tree_sum(mrctracker *m, Py_ssize_t stamp)
+{
+  Py_ssize_t s = 0;
+  for(; stamp > 0; stamp -= stamp & -stamp)
+    s += m->tree[stamp];
+  return s;
+}
+
+
+static mrckey *
+mrc_find(mrctracker *m, uint64_t mix)
+{
+  size_t mask = 2 * MRC_MAX_KEYS - 1, i = (size_t)(mix >> 17) & mask;
+  while (m->keys[i].stamp != 0 && m->keys[i].mix != mix)
+    i = (i + 1) & mask;
+  return &m->keys[i];
+}
+
+
+static int
+mrc_cmp_stamp(const void *a, const void *b)
+{
+  Py_ssize_t x = ((const mrckey *)a)->stamp, y = ((const mrckey *)b)->stamp;
+  return (x > y) - (x < y);
+}
+
+
+/* Drop the keys at or above the threshold and renumber the stamps of the
+ * others from 1 in the order of their last use */
+static void
+mrc_compact(mrctracker *m)
+{
+  mrckey *tmp = m->scratch;
+  Py_ssize_t i, n = 0;
+
+  for(i = 0; i < 2 * MRC_MAX_KEYS; i++)
+    if (m->keys[i].stamp != 0 && m->keys[i].mix < m->threshold)
+      tmp[n++] = m->keys[i];
+  qsort(tmp, (size_t)n, sizeof(mrckey), mrc_cmp_stamp);
+  memset(m->keys, 0, sizeof(m->keys));
+  memset(m->tree, 0, sizeof(m->tree));
+  for(i = 0; i < n; i++){
+    mrckey *k = mrc_find(m, tmp[i].mix);
+    k->mix = tmp[i].mix;
+    k->stamp = i + 1;
+    mrc_tree_add(m, i + 1, 1);
+  }
+  m->nkeys = n;
+  m->now = n;
+}
+
+
+/* histogram bucket of a distance: exact below 8, then 8 per power of 2 */
+static int
+mrc_bucket(double d)
+{
+  int e;
+  double f;
+
+  if (d < 8)
+    return (int)d;
+  f = frexp(d, &e);       // d = f * 2**e with 0.5 <= f < 1
+  e = 8 + (e - 4) * 8 + (int)((f - 0.5) * 16);
+  return e < MRC_BUCKETS ? e : MRC_BUCKETS - 1;
+}
+
+
+/* smallest distance of bucket b */
+static double
+mrc_bucket_start(int b)
+{
+  if (b < 8)
+    return b;
+  return ldexp(1.0 + (b - 8) % 8 / 8.0, 3 + (b - 8) / 8);
+}
+
+
+/* Record a use of the key with the given hash */
+static void
+mrc_access(mrctracker *m, Py_hash_t hash)
+{
+  uint64_t mix = mrc_mix(hash);
+  mrckey *k;
+  double w;
+
+  // most keys are not sampled; a stale threshold at worst skips a use, and
+  // the check is repeated under the lock
+  if (mix >= FC_LOAD(&m->threshold))
+    return;
+  MRC_LOCK(m);
+  if (mix >= m->threshold){
+    MRC_UNLOCK(m);
+    return;
+  }
+  if (m->now == MRC_STAMPS)
+    mrc_compact(m);
+  w = 1.0 / m->rate;
+  k = mrc_find(m, mix);
+  if (k->stamp != 0){
+    // the keys used since, scaled up to all keys
+    Py_ssize_t d = mrc_tree_sum(m, m->now) - mrc_tree_sum(m, k->stamp);
+    m->hist[mrc_bucket(d * w)] += w;
+    mrc_tree_add(m, k->stamp, -1);
+  }
+  else {
+    m->cold += w;
+    k->mix = mix;
+    m->nkeys++;
+  }
+  k->stamp = ++m->now;
+  mrc_tree_add(m, k->stamp, 1);
+  // sample half as many keys from now on
+  while (m->nkeys > MRC_MAX_KEYS){
+    FC_STORE(&m->threshold, m->threshold >> 1);
+    m->rate /= 2;
+    mrc_compact(m);
+  }
+  MRC_UNLOCK(m);
+}
+
+
+/* Estimated hit ratio of an LRU cache of size entries from a histogram
+ * of distances and the weight of first uses */
+static double
+mrc_hit_ratio(const double *hist, double cold, double size)
+{
+  double hits = 0, total = cold, lo, hi;
+  int b;
+
+  for(b = 0; b < MRC_BUCKETS; b++){
+    total += hist[b];
+    lo = mrc_bucket_start(b);
+    hi = b + 1 < MRC_BUCKETS ? mrc_bucket_start(b + 1) : lo * 2;
+    // a use at distance d hits in a cache of more than d entries
+    if (size >= hi)
+      hits += hist[b];
+    else if (size > lo)
+      hits += hist[b] * (size - lo) / (hi - lo);
+  }
+  return total > 0 ? hits / total : 0.0;
+}
+
+
+/* Calls computing a missing result are timed into buckets of powers of two
+ * microseconds: bucket 0 counts calls under 1us, bucket i calls under
+ * 2**i us and the last bucket all longer calls. */
+#define FC_TIME_BUCKETS 24
+
+/* The entries of a cache are split into shards selected by the low bits of
+ * the key hash.  Each shard has its own table, LRU order, statistics and
+ * lock, so threads working on different shards do not contend with each
+ * other once the GIL is gone. */
+typedef struct {
+  htable table;
+  Py_ssize_t maxsize;       // bound of this shard, -1 if unbounded
+  Py_ssize_t maxweight;     // bound on table.weight, 0 if unbounded
+  Py_ssize_t reserved;      // entries cache_resize made room for
+  Py_ssize_t hits, misses;
+  Py_ssize_t evictions, expirations;
+  Py_ssize_t duplicates;    // results discarded as stored in the meantime
+  Py_ssize_t collected;     // entries dropped as a weak referent died
+  Py_ssize_t miss_time[FC_TIME_BUCKETS];    // histogram of call times
+  double miss_seconds;      // total time of the calls
+  fsketch sketch;           // request frequencies, only for TinyLFU
+#ifdef WITH_THREAD
+  flightobject *flights;    // keys being computed with single_flight
+  size_t flights_version;
+  // lock for shard access
+  PyThread_type_lock lock;
+  long rlock_owner;
+  unsigned long rlock_count;
+#endif
+  Py_ssize_t contended;     // lock acquisitions that had to wait
+} cacheshard;
+
+/* default number of shards */
+#ifdef Py_GIL_DISABLED
+#define FC_DEFAULT_SHARDS 16
+#else
+#define FC_DEFAULT_SHARDS 1
+#endif
+#define FC_MAX_SHARDS 1024
+
+/* statistics of a cache updated outside of the shard locks */
+#define FC_STAT_INC(co, x) FC_ADD(&(co)->x, 1)
+
+
+/* TinyLFU queue bounds for the maxsize of sh: a window of 1% in front of
+ * the probation and protected queues */
+static void
+shard_lfu_bounds(cacheshard *sh)
+{
+  sh->table.window_max = sh->maxsize / 100 > 1 ? sh->maxsize / 100 : 1;
+  sh->table.protected_max = (sh->maxsize - sh->table.window_max) * 4 / 5;
+}
+
+
+#ifdef FC_SHARED
+typedef struct sharedtier sharedtier;   // see shared tier below
+static void shared_free(sharedtier *st);
+#define CACHE_SHARED(co) ((co)->shared != NULL)
+#else
+#define CACHE_SHARED(co) 0
+#endif
+
+typedef struct {
+  PyObject_HEAD
+  PyObject *fn ; // original function
+  PyObject *func_module, *func_name, *func_qualname, *func_annotations;
+  PyObject *func_dict;
+  PyObject *ex_state;
+  int typed;
+  enum unhashable err;
+  PyObject *cinfo; // named tuple constructor
+  Py_ssize_t maxsize;
+  Py_ssize_t misses;        // calls that bypass the shards
+  cacheshard *shards;
+  Py_ssize_t nshards;       // a power of two
+  enum policy policy;
+  PyObject *clock;          // time source for expiry, NULL for the builtin
+  Py_ssize_t maxweight;     // 0 if unweighted
+  PyObject *weigher;        // weight of a result, NULL if unweighted
+  int weigh_nbytes;         // weigh buffers by their size
+  PyObject *async_call;     // SharedCall for coroutines, NULL otherwise
+  int single_flight;
+  int weak_keys;            // key calls by their only argument, weakly
+  int weak_values;          // hold results weakly
+  PyObject *weak_callback;  // unlinks dead weak entries, NULL if not weak
+  PyObject *instance;       // weak reference to the instance of a method
+  PyObject *method_name;    // attribute of the instance for that method
+#ifdef FC_SHARED
+  sharedtier *shared;       // NULL without shared=path
+#endif
+  PyObject *weakreflist;    // the registry refers to caches weakly
+  mrctracker *mrc;          // reuse distances, NULL without mrc=rate
+  double mrc_rate;
+#ifdef _FC_VECTORCALL
+  vectorcallfunc vectorcall;
+#endif
+} cacheobject ;
+
+/* cached_method descriptor, see cached methods below */
+typedef struct {
+  PyObject_HEAD
+  cacheobject *proto;       // cache of the function, template for the others
+  PyObject *lru;            // configuration of the per-instance caches
+  cacheshard instances;     // caches of instances without a __dict__
+  PyObject *weak_callback;  // drops the cache of an instance that died
+  PyObject *name;           // attribute name, from __set_name__
+  PyObject *dict_key;       // of the caches in the instance __dict__
+  PyObject *weakreflist;
+#ifdef _FC_VECTORCALL
+  vectorcallfunc vectorcall;
+#endif
+} cachedmethodobject;
+
+static PyTypeObject cache_type;
+static PyTypeObject cachedmethod_type;
+
+/* whether a shard has an LRU order to keep */
+#define SHARD_BOUNDED(sh) ((sh)->maxsize > 0 || (sh)->maxweight > 0)
+/* whether an entry of the given weight only fits after an eviction */
+#define SHARD_FULL(sh, w) \
+  (((sh)->maxsize > 0 && (sh)->table.used >= (sh)->maxsize) || \
+   ((sh)->maxweight > 0 && (sh)->table.weight + (w) > (sh)->maxweight) || \
+   (sh)->table.used >= HT_USABLE(HT_MAX_CAPACITY))
+/* whether a shard holds more than its bounds allow */
+#define SHARD_OVER(sh) \
+  (((sh)->maxsize > 0 && (sh)->table.used > (sh)->maxsize) || \
+   ((sh)->maxweight > 0 && (sh)->table.weight > (sh)->maxweight))
+
+#define SHARD_OF(co, hash) \
+  (&(co)->shards[(Py_uhash_t)(hash) & (Py_uhash_t)((co)->nshards - 1)])
+
+
+#define OFF(x) offsetof(cacheobject, x)
+// attributes from wrapped function
+static PyMemberDef cache_memberlist[] = {
+  {"__wrapped__", T_OBJECT, OFF(fn), RESTRICTED | READONLY},
+  {"__module__",  T_OBJECT, OFF(func_module), RESTRICTED | READONLY},
+  {"__name__",    T_OBJECT, OFF(func_name), RESTRICTED | READONLY},
+  {"__qualname__",T_OBJECT, OFF(func_qualname), RESTRICTED | READONLY},
+  {"__annotations__", T_OBJECT, OFF(func_annotations), RESTRICTED | READONLY},
+  {NULL} /* Sentinel */
+};
+
+
+// getsetters from wrapped function
+static PyObject *
+cache_get_doc(cacheobject * co, void *closure)
+{
+  PyFunctionObject * fn = (PyFunctionObject *) co->fn;
+  if (fn == NULL || fn->func_doc == NULL)
+    Py_RETURN_NONE;
+
+  INC_RETURN(fn->func_doc);
+}
+
+#if defined(_PY2) || defined (_PY32)
+
+static int
+restricted(void)
+{
+#ifdef _PY2
+    if (!PyEval_GetRestricted())
+#endif
+        return 0;
+    PyErr_SetString(PyExc_RuntimeError,
+        "function attributes not accessible in restricted mode");
+    return 1;
+}
+
+
+static PyObject *
+func_get_dict(PyFunctionObject *op)
+{
+    if (restricted())
+        return NULL;
+    if (op->func_dict == NULL) {
+        op->func_dict = PyDict_New();
+        if (op->func_dict == NULL)
+            return NULL;
+    }
+    Py_INCREF(op->func_dict);
+    return op->func_dict;
+}
+
+static int
+func_set_dict(PyFunctionObject *op, PyObject *value)
+{
+    PyObject *tmp;
+
+    if (restricted())
+        return -1;
+    /* It is illegal to del f.func_dict */
+    if (value == NULL) {
+        PyErr_SetString(PyExc_TypeError,
+                        "function's dictionary may not be deleted");
+        return -1;
+    }
+    /* Can only set func_dict to a dictionary */
+    if (!PyDict_Check(value)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "setting function's dictionary to a non-dict");
+        return -1;
+    }
+    tmp = op->func_dict;
+    Py_INCREF(value);
+    op->func_dict = value;
+    Py_XDECREF(tmp);
+    return 0;
+}
+
+static PyGetSetDef cache_getset[] = {
+  {"__doc__", (getter)cache_get_doc, NULL, NULL, NULL},
+  {"__dict__", (getter)func_get_dict, (setter)func_set_dict},
+  {NULL} /* Sentinel */
+};
+
+#else
+
+static PyGetSetDef cache_getset[] = {
+  {"__doc__", (getter)cache_get_doc, NULL, NULL, NULL},
+  {"__dict__", PyObject_GenericGetDict, PyObject_GenericSetDict},
+  {NULL} /* Sentinel */
+};
+
+#endif
+
+
+/* Bind a function to an object */
+static PyObject *
+cache_descr_get(PyObject *func, PyObject *obj, PyObject *type)
+{
+    if (obj == Py_None || obj == NULL)
+      INC_RETURN(func);
+
+#ifdef _PY2
+    return PyMethod_New(func, obj, type);
+#else
+    return PyMethod_New(func, obj);
+#endif
+}
+
+
+/* Drop the entries of every shard.  Each table is swapped for an empty
+ * one first, so the destructors of the entries find a consistent cache. */
+static void
+cache_drop_entries(cacheobject *co)
+{
+  Py_ssize_t n;
+  htable old;
+
+  for(n = 0; n < co->nshards; n++){
+    cacheshard *sh = &co->shards[n];
+    if (sh->table.slots == NULL || sh->table.used == 0)
+      continue;
+    old = sh->table;
+    if (htable_init(&sh->table, HT_MIN_CAPACITY) < 0){
+      PyErr_Clear();
+      sh->table = old;
+      continue;
+    }
+    sh->table.eq_calls = old.eq_calls;
+    htable_free_slots(old.slots, old.capacity);
+  }
+}
+
+
+/* The cache takes part in cycle collection, since results can refer back
+ * to the cached function and keys of methods hold self.  See the hash
+ * table notes for how tables of plain values are kept cheap to visit. */
+static int
+cache_traverse(cacheobject *co, visitproc visit, void *arg)
+{
+  Py_ssize_t n;
+  hindex i;
+
+  Py_VISIT(co->fn);
+  Py_VISIT(co->func_module);
+  Py_VISIT(co->func_name);
+  Py_VISIT(co->func_qualname);
+  Py_VISIT(co->func_annotations);
+  Py_VISIT(co->func_dict);
+  Py_VISIT(co->ex_state);
+  Py_VISIT(co->cinfo);
+  Py_VISIT(co->clock);
+  Py_VISIT(co->weigher);
+  Py_VISIT(co->async_call);
+  Py_VISIT(co->instance);
+  for(n = 0; n < co->nshards; n++){
+    htable *t = &co->shards[n].table;
+    if (t->slots == NULL || t->gc_entries == 0)
+      continue;
+    for(i = 0; i < t->fill; i++){
+      if (t->slots[i].key != NULL){
+        Py_VISIT(t->slots[i].key);
+        Py_VISIT(t->slots[i].result);
+      }
+    }
+  }
+  return 0;
+}
+
+
+/* Break the cycles through the cache.  The names and the CacheInfo type
+ * cannot be part of one and stay, so that the cache still works as far as
+ * it can: calls raise once the function is gone. */
+static int
+cache_tp_clear(cacheobject *co)
+{
+  PyObject *state = co->ex_state;
+
+  cache_drop_entries(co);
+  Py_CLEAR(co->fn);
+  Py_CLEAR(co->func_annotations);
+  Py_CLEAR(co->func_dict);
+  if (state != NULL && state != Py_None){
+    Py_INCREF(Py_None);
+    co->ex_state = Py_None;
+    Py_DECREF(state);
+  }
+  Py_CLEAR(co->clock);
+  Py_CLEAR(co->weigher);
+  Py_CLEAR(co->async_call);
+  return 0;
+}
+
+
+static void
+cache_dealloc(cacheobject *co)
+{
+  PyObject_GC_UnTrack(co);
+  if (co->weakreflist != NULL)
+    PyObject_ClearWeakRefs((PyObject *)co);
+  Py_CLEAR(co->fn);
+  Py_CLEAR(co->func_module);
+  Py_CLEAR(co->func_name);
+  Py_CLEAR(co->func_qualname);
+  Py_CLEAR(co->func_annotations);
+  Py_CLEAR(co->func_dict);
+  Py_CLEAR(co->ex_state);
+  Py_CLEAR(co->cinfo);
+  Py_CLEAR(co->clock);
+  Py_CLEAR(co->weigher);
+  Py_CLEAR(co->async_call);
+  Py_CLEAR(co->weak_callback);
+  Py_CLEAR(co->instance);
+  Py_CLEAR(co->method_name);
+  PyMem_Free(co->mrc);
+  co->mrc = NULL;
+#ifdef FC_SHARED
+  if (co->shared != NULL){
+    shared_free(co->shared);
+    co->shared = NULL;
+  }
+#endif
+  if (co->shards != NULL){
+    Py_ssize_t n;
+    for(n = 0; n < co->nshards; n++){
+      cacheshard *sh = &co->shards[n];
+      if (sh->table.slots != NULL)
+        htable_free_slots(sh->table.slots, sh->table.capacity);
+      PyMem_Free(sh->sketch.table);
+      FREE_LOCK(sh);
+    }
+    PyMem_Free(co->shards);
+    co->shards = NULL;
+  }
+  Py_TYPE(co)->tp_free(co);
+
+}
+
+
+/* Handle the failure to hash the arguments of a call as co->err says.
+ * Returns -1 if the call fails, 0 if it goes ahead without caching. */
+static int
+key_unhashable(cacheobject *co)
+{
+  if (co->err == FC_ERROR) {
+    return -1;
+  }
+  // if error was something other than a TypeError, exit
+  if (!PyErr_GivenExceptionMatches(PyErr_Occurred(), PyExc_TypeError)) {
+    return -1;
+  }
+  PyErr_Clear();
+
+  if (co->err == FC_WARNING) {
+    // try to issue warning
+    if( PyErr_WarnEx(PyExc_UserWarning,
+        "Unhashable arguments cannot be cached",1) < 0){
+      // warning becomes exception
+      PyErr_SetString(PyExc_TypeError,
+                      "Cached function arguments must be hashable");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+/* Set *hash to the hash of the key tuple args.  Returns -1 on error.  If
+ * *hash is -1 on success the arguments are unhashable and the call is not
+ * cached. */
+static int
+key_hash(cacheobject *co, PyObject *args, Py_hash_t *hash)
+{
+  *hash = hash_items(((PyTupleObject *)args)->ob_item, PyTuple_GET_SIZE(args));
+  if (*hash == -1)
+    return key_unhashable(co);
+  // success!
+  return 0;
+}
+
+/* Arguments of a single call to the cached function.  Calls arrive either
+ * through tp_call (an args tuple and a kwargs dict) or, on Python 3.9+,
+ * through vectorcall (a C array and a tuple of keyword names).  Either way
+ * the positional arguments are seen as a C array so the key can be built
+ * straight from the caller's arguments. */
+typedef struct {
+  PyObject *const *stack; // positional arguments (followed by kw values)
+  Py_ssize_t nargs;       // number of positional arguments
+  PyObject *args;         // tp_call: argument tuple, NULL for vectorcall
+  PyObject *kw;           // tp_call: keyword dict or NULL
+#ifdef _FC_VECTORCALL
+  size_t nargsf;          // vectorcall: nargs and flags
+  PyObject *kwnames;      // vectorcall: keyword names or NULL
+#endif
+} callargs;
+
+
+/* Number of keyword arguments in the call */
+static Py_ssize_t
+kw_size(callargs *ca)
+{
+#ifdef _FC_VECTORCALL
+  if (ca->kwnames)
+    return PyTuple_GET_SIZE(ca->kwnames);
+#endif
+  if (ca->kw && PyDict_CheckExact(ca->kw))
+    return PyDict_Size(ca->kw);
+  return 0;
+}
+
+
+/* Sorted list of keyword names (new reference) */
+static PyObject *
+kw_sorted_names(callargs *ca)
+{
+  PyObject *keys;
+#ifdef _FC_VECTORCALL
+  if (ca->kwnames)
+    keys = PySequence_List(ca->kwnames);
+  else
+#endif
+    keys = PyDict_Keys(ca->kw);
+  if (keys && PyList_Sort(keys) < 0){
+    Py_DECREF(keys);
+    return NULL;
+  }
+  return keys;
+}
+
+
+/* Value of keyword argument name (borrowed reference) */
+static PyObject *
+kw_value(callargs *ca, PyObject *name)
+{
+#ifdef _FC_VECTORCALL
+  if (ca->kwnames){
+    // the sorted list holds the very same name objects as kwnames
+    Py_ssize_t j, n = PyTuple_GET_SIZE(ca->kwnames);
+    for(j = 0; j < n; j++){
+      if (PyTuple_GET_ITEM(ca->kwnames, j) == name)
+        return ca->stack[ca->nargs + j];
+    }
+    return NULL;
+  }
+#endif
+  return PyDict_GetItem(ca->kw, name);
+}
+
+
+/* Call the function of the per-instance cache of a method with its
+ * instance in front of the arguments.  Only misses get here. */
+static PyObject *
+call_method_fn(cacheobject *co, callargs *ca)
+{
+  PyObject *self = weak_deref(co->instance), *r;
+  Py_ssize_t i, n;
+
+  if (self == NULL){
+    PyErr_SetString(PyExc_ReferenceError,
+                    "the instance of the cached method is gone");
+    return NULL;
+  }
+#ifdef _FC_VECTORCALL
+  if (!ca->args && (ca->nargsf & PY_VECTORCALL_ARGUMENTS_OFFSET)){
+    // the caller lets us borrow the slot in front of the arguments, which
+    // for calls through the cached_method descriptor already holds self
+    PyObject **stack = (PyObject **)ca->stack - 1, *saved = stack[0];
+    stack[0] = self;
+    r = PyObject_Vectorcall(co->fn, stack, ca->nargs + 1, ca->kwnames);
+    stack[0] = saved;
+    Py_DECREF(self);
+    return r;
+  }
+  if (!ca->args){
+    PyObject *small[8], **stack = small;
+    n = ca->nargs + (ca->kwnames ? PyTuple_GET_SIZE(ca->kwnames) : 0);
+    if (n >= 8 && (stack = PyMem_New(PyObject *, n + 1)) == NULL){
+      Py_DECREF(self);
+      return PyErr_NoMemory();
+    }
+    stack[0] = self;
+    memcpy(stack + 1, ca->stack, n * sizeof(PyObject *));
+    r = PyObject_Vectorcall(co->fn, stack, ca->nargs + 1, ca->kwnames);
+    if (stack != small)
+      PyMem_Free(stack);
+    Py_DECREF(self);
+    return r;
+  }
+#endif
+  n = ca->nargs;
+  if ((r = PyTuple_New(n + 1)) == NULL){
+    Py_DECREF(self);
+    return NULL;
+  }
+  PyTuple_SET_ITEM(r, 0, self);   // steals the reference
+  for(i = 0; i < n; i++){
+    Py_INCREF(ca->stack[i]);
+    PyTuple_SET_ITEM(r, i + 1, ca->stack[i]);
+  }
+  self = r;
+  r = PyObject_Call(co->fn, self, ca->kw);
+  Py_DECREF(self);
+  return r;
+}
+
+
+/* Call the wrapped function with the original arguments */
+static PyObject *
+call_fn(cacheobject *co, callargs *ca)
+{
+  // a cache cleared by the cycle collector may still be called by the
+  // finalizers of the objects in its cycle
+  if (co->fn == NULL){
+    PyErr_SetString(PyExc_RuntimeError,
+                    "the cache was cleared by the garbage collector");
+    return NULL;
+  }
+  if (co->instance != NULL)
+    return call_method_fn(co, ca);
+#ifdef _FC_VECTORCALL
+  if (!ca->args)
+    return PyObject_Vectorcall(co->fn, ca->stack, ca->nargsf, ca->kwnames);
+#endif
+  return PyObject_Call(co->fn, ca->args, ca->kw);
+}
+
+
+// build the key tuple of the function args and kwargs and its hash
+// THREAD SAFTEY NOTES:
+// We access global data: co->ex_state and co->typed.
+// These data are defined at co creation time and are not
+// changed so we do not need to worry about thread safety here
+static PyObject *
+make_key(cacheobject *co, callargs *ca, Py_hash_t *hash)
+{
+  PyObject *item, *keys, *key, *args;
+  Py_ssize_t ex_size = 0;
+  Py_ssize_t arg_size = ca->nargs;
+  Py_ssize_t kw_count = kw_size(ca);
+  Py_ssize_t i, size, off;
+  int is_list = 1;
+
+  // determine size of arguments and types
+  if (PyList_Check(co->ex_state))
+    ex_size = Py_SIZE(co->ex_state);
+  else if (PyDict_CheckExact(co->ex_state)){
+    is_list = 0;
+    ex_size = PyDict_Size(co->ex_state);
+  }
+
+  // total size
+  if (co->typed)
+    size = (2-is_list)*ex_size+2*arg_size+3*kw_count;
+  else
+    size = (2-is_list)*ex_size+arg_size+2*kw_count;
+  // initialize new tuple
+  if(!(args = PyTuple_New(size)))
+    return NULL;
+  // incorporate extra state
+  if(is_list){
+    for(i = 0; i < ex_size; i++){
+      PyObject *tmp = PyList_GET_ITEM(co->ex_state, i);
+      PyTuple_SET_ITEM(args, i, tmp);
+      Py_INCREF(tmp);
+    }
+  }
+  else if(ex_size > 0){
+    if(!(keys = PyDict_Keys(co->ex_state))){
+      Py_DECREF(args);
+      return NULL;
+    }
+    if( PyList_Sort(keys) < 0){
+      Py_DECREF(keys);
+      Py_DECREF(args);
+      return NULL;
+    }
+    for(i = 0; i < ex_size; i++){
+      key = PyList_GET_ITEM(keys, i);
+      Py_INCREF(key);
+      PyTuple_SET_ITEM(args, 2*i, key);
+
+      if(!(item = PyDict_GetItem(co->ex_state, key))){
+        Py_DECREF(keys);
+        Py_DECREF(args);
+        return NULL;
+      }
+      Py_INCREF(item);
+      PyTuple_SET_ITEM(args, 2*i+1, item);
+    }
+    Py_DECREF(keys);
+  }
+  off = (2-is_list)*ex_size;
+
+  // incorporate arguments
+  for(i = 0; i < arg_size; i++){
+    PyObject *tmp = ca->stack[i];
+    PyTuple_SET_ITEM(args, off+i, tmp);
+    Py_INCREF(tmp);
+    if(co->typed) {
+      off += 1;
+      tmp = (PyObject *)Py_TYPE(tmp);
+      Py_INCREF(tmp);
+      PyTuple_SET_ITEM(args, off+i, tmp);
+    }
+  }
+  off += arg_size;
+
+  // incorporate keyword arguments
+  if(kw_count > 0){
+    if(!(keys = kw_sorted_names(ca))){
+      Py_DECREF(args);
+      return NULL;
+    }
+    for(i = 0; i < kw_count; i++){
+      key = PyList_GET_ITEM(keys, i);
+      Py_INCREF(key);
+      PyTuple_SET_ITEM(args, off+i, key);
+      if(!(item = kw_value(ca, key))){
+        Py_DECREF(keys);
+        Py_DECREF(args);
+        return NULL;
+      }
+      off += 1;
+      Py_INCREF(item);
+      PyTuple_SET_ITEM(args, off+i, item);
+      if (co->typed){
+          off += 1;
+          item = (PyObject *)Py_TYPE(item);
+          Py_INCREF(item);
+          PyTuple_SET_ITEM(args, off+i, item);
+      }
+    }
+    Py_DECREF(keys);
+  }
+  // check for an error we may have missed
+  if( PyErr_Occurred() ){
+    Py_DECREF(args);
+    return NULL;
+  }
+  // set hash value
+  if( key_hash(co, args, hash) < 0 ) {
+    Py_DECREF(args);
+    return NULL;
+  }
+
+  return args;
+}
+
+
+/* Builtin scalar types whose hash and equality never run Python code */
+#ifdef _PY2
+#define FAST_TYPE(o) (PyInt_CheckExact(o) || PyLong_CheckExact(o) ||   \
+                      PyString_CheckExact(o) || PyUnicode_CheckExact(o) || \
+                      PyFloat_CheckExact(o))
+#else
+#define FAST_TYPE(o) (PyLong_CheckExact(o) || PyUnicode_CheckExact(o) || \
+                      PyFloat_CheckExact(o) || PyBytes_CheckExact(o))
+#endif
+
+/* Lookup key for a call whose arguments are all builtin scalars, with no
+ * keywords, no extra state and typed=False.  A single argument is its own
+ * key; several arguments are compared in place with stored key tuples.
+ * Returns 0 if the call needs a key from make_key. */
+static int
+fast_key(cacheobject *co, callargs *ca, probekey *pk)
+{
+  Py_ssize_t i;
+
+  if (co->typed || co->ex_state != Py_None || kw_size(ca) > 0)
+    return 0;
+  for(i = 0; i < ca->nargs; i++){
+    if (!FAST_TYPE(ca->stack[i]))
+      return 0;
+  }
+  // hashing builtin scalars cannot fail
+  if (ca->nargs == 1){
+    pk->obj = ca->stack[0];
+    pk->hash = PyObject_Hash(pk->obj);
+  }
+  else {
+    pk->obj = NULL;
+    pk->hash = hash_items(ca->stack, ca->nargs);
+  }
+  pk->items = ca->stack;
+  pk->size = ca->nargs;
+  return 1;
+}
+
+
+/* Key object to store for pk (new reference) */
+static PyObject *
+probe_key_object(probekey *pk)
+{
+  PyObject *args;
+  Py_ssize_t i;
+
+  if (pk->obj != NULL)
+    INC_RETURN(pk->obj);
+  if(!(args = PyTuple_New(pk->size)))
+    return NULL;
+  for(i = 0; i < pk->size; i++){
+    PyObject *tmp = pk->items[i];
+    Py_INCREF(tmp);
+    PyTuple_SET_ITEM(args, i, tmp);
+  }
+  return args;
+}
+
+
+/* Weight of a result.  With weigher='nbytes' the size of the buffer of
+ * results that support the buffer protocol, otherwise co->weigher(result).
+ * Returns -1 with an exception set on failure. */
+static int
+cache_weigh(cacheobject *co, PyObject *result, Py_ssize_t *weight)
+{
+  PyObject *w;
+
+  if (co->weigh_nbytes && PyObject_CheckBuffer(result)){
+    Py_buffer view;
+    if (PyObject_GetBuffer(result, &view, PyBUF_RECORDS_RO) < 0)
+      return -1;
+    *weight = view.len;
+    PyBuffer_Release(&view);
+    return 0;
+  }
+  w = PyObject_CallFunctionObjArgs(co->weigher, result, NULL);
+  if (w == NULL)
+    return -1;
+  *weight = PyNumber_AsSsize_t(w, PyExc_OverflowError);
+  Py_DECREF(w);
+  if (*weight < 0){
+    if (!PyErr_Occurred())
+      PyErr_SetString(PyExc_ValueError, "weigher returned a negative weight");
+    return -1;
+  }
+  return 0;
+}
+
+
+/* Current time for the expiry of entries.  A clock passed to clru_cache is
+ * called for every lookup and store.  The builtin clock is a coarse
+ * monotonic clock, which is a few ns to read and accurate to a few ms. */
+static int
+cache_now(cacheobject *co, double *now)
+{
+  PyObject *t;
+  double d;
+#ifdef MS_WINDOWS
+  if (co->clock == NULL){
+    *now = (double)GetTickCount64() * 1e-3;
+    return 0;
+  }
+#else
+  if (co->clock == NULL){
+    struct timespec ts;
+#if defined(CLOCK_MONOTONIC_COARSE)
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#elif defined(CLOCK_MONOTONIC_RAW_APPROX)
+    clock_gettime(CLOCK_MONOTONIC_RAW_APPROX, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    *now = (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+    return 0;
+  }
+#endif
+  if ((t = PyObject_CallObject(co->clock, NULL)) == NULL)
+    return -1;
+  d = PyFloat_AsDouble(t);
+  Py_DECREF(t);
+  if (d == -1.0 && PyErr_Occurred())
+    return -1;
+  *now = d;
+  return 0;
+}
+
+
+/* Precise monotonic time in seconds, for timing calls */
+static double
+perf_time(void)
+{
+#ifdef MS_WINDOWS
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER t;
+  if (freq.QuadPart == 0)
+    QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&t);
+  return (double)t.QuadPart / (double)freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+
+/* Count a call of the given duration computing a missing result of sh.
+ * Must be called with the shard lock held. */
+static void
+shard_time_miss(cacheshard *sh, double seconds)
+{
+  double us = seconds * 1e6;
+  int b = 0;
+
+  sh->miss_seconds += seconds;
+  while (us >= 1.0 && b < FC_TIME_BUCKETS - 1){
+    us *= 0.5;
+    b++;
+  }
+  sh->miss_time[b]++;
+}
+
+
+/* Look up pk in sh at time now.  The timer wheel is advanced first and an
+ * expired entry is removed into g and reported as missing.  A weakly held
+ * result found is kept alive through g until the lock is released, and an
+ * entry whose result died is reported as missing.
+ * Must be called with the shard lock held. */
+static int
+shard_lookup(cacheshard *sh, probekey *pk, hindex *index, double now,
+             garbage *g)
+{
+  htable *t = &sh->table;
+  Py_ssize_t used = t->used;
+  int found;
+
+  if (t->timers != NULL && (PY_LONG_LONG)floor(now / t->tick) > t->wheel){
+    htable_expire(t, now, g);
+    sh->expirations += used - t->used;
+  }
+  found = htable_lookup(t, pk, index);
+  if (found > 0 && HT_EXPIRED(t, *index, now)){
+    if (garbage_reserve(g) < 0){
+      PyErr_NoMemory();
+      return -1;
+    }
+    htable_remove_into(t, *index, g);
+    sh->expirations++;
+    found = 0;
+  }
+  if (found > 0 && t->weak_values){
+    if (garbage_reserve(g) < 0){
+      PyErr_NoMemory();
+      return -1;
+    }
+    // the callback will find the entry gone if it has not run yet
+    if ((g->items[g->size] = weak_deref(t->slots[*index].result)) == NULL){
+      htable_remove_into(t, *index, g);
+      sh->collected++;
+      found = 0;
+    }
+    else
+      g->size++;
+  }
+  return found;
+}
+
+
+/* Time and weight of a result about to be stored in sh.  The result is
+ * stored as of the time it was computed.  Returns -1 with an exception set
+ * if the clock or the weigher failed. */
+static int
+cache_prepare_store(cacheobject *co, cacheshard *sh, PyObject *result,
+                    double *now, Py_ssize_t *weight)
+{
+  if (sh->table.timers != NULL && cache_now(co, now) < 0)
+    return -1;
+  if (sh->table.weighted && cache_weigh(co, result, weight) < 0)
+    return -1;
+  return 0;
+}
+
+
+/* Record a hit on entry i at time now and return a new reference to its
+ * result.  Returns NULL without an exception, and records nothing, if the
+ * result is held weakly and is gone, which the caller treats as a miss.
+ * Must be called with the shard lock held. */
+static PyObject *
+cache_hit(cacheshard *sh, hindex i, double now)
+{
+  PyObject *result;
+
+  if (sh->table.weak_values){
+    if ((result = weak_deref(sh->table.slots[i].result)) == NULL)
+      return NULL;
+  }
+  else {
+    result = sh->table.slots[i].result;
+    Py_INCREF(result);
+  }
+  sh->hits++;
+  if (sh->table.ttl_access > 0)
+    htable_touch(&sh->table, i, now);
+  if (sh->table.clock)
+    sh->table.marks[i] = 1;
+  else if (sh->table.lfu)
+    htable_lfu_hit(&sh->table, i);
+  /* an unbounded cache never evicts, so it needs no LRU order */
+  else if (SHARD_BOUNDED(sh))
+    ht_make_first(&sh->table, i);
+  return result;
+}
+
+
+/* Move the entries that overflow the TinyLFU window into the main queues.
+ * When the shard is over its bounds the window entry only gets in if the
+ * sketch says it was requested more often than the main queues' victim,
+ * otherwise it is evicted itself.  Evicted entries go to g.
+ * Must be called with the shard lock held. */
+static void
+shard_lfu_balance(cacheshard *sh, garbage *g)
+{
+  htable *t = &sh->table;
+  hindex cand, victim;
+
+  while (t->queued[HT_WINDOW] > t->window_max && garbage_reserve(g) == 0){
+    cand = t->slots[HT_QROOT(t, HT_WINDOW)].prev;
+    if (!SHARD_OVER(sh)){
+      ht_requeue(t, cand, HT_PROBATION);
+      continue;
+    }
+    victim = ht_lfu_main_victim(t);
+    if (victim < t->capacity &&
+        fsketch_frequency(&sh->sketch, t->slots[cand].hash) >
+        fsketch_frequency(&sh->sketch, t->slots[victim].hash)){
+      ht_requeue(t, cand, HT_PROBATION);
+      htable_remove_into(t, victim, g);
+    }
+    else
+      htable_remove_into(t, cand, g);
+    sh->evictions++;
+  }
+  // heavy entries can leave the shard over its weight bound
+  while (t->used > 0 && SHARD_OVER(sh) && garbage_reserve(g) == 0){
+    htable_remove_into(t, htable_victim(t), g);
+    sh->evictions++;
+  }
+}
+
+
+/* Store result under key, a key missing from sh.  Entries are evicted into
+ * g to make room and a result heavier than the shard can hold is not
+ * stored.  Must be called with the shard lock held.  Returns -1 with an
+ * exception set on failure. */
+static int
+shard_store(cacheshard *sh, Py_hash_t hash, PyObject *key, PyObject *result,
+            Py_ssize_t weight, double now, garbage *g)
+{
+  htable *t = &sh->table;
+
+  if(sh->maxweight > 0 && weight > sh->maxweight)
+    return 0;
+  /* while the cache is full, evict the least recently used entry.  TinyLFU
+   * admits new entries through its window and evicts after the insert. */
+  while(t->used > 0 &&
+        (t->lfu ? t->used >= HT_USABLE(HT_MAX_CAPACITY) :
+         SHARD_FULL(sh, weight)) &&
+        garbage_reserve(g) == 0){
+    htable_remove_into(t, htable_victim(t), g);
+    sh->evictions++;
+  }
+  Py_INCREF(key);
+  Py_INCREF(result);
+  if(htable_insert(t, hash, key, result, weight, now) < 0){
+    Py_DECREF(key);
+    Py_DECREF(result);
+    return -1;
+  }
+  if(t->lfu)
+    shard_lfu_balance(sh, g);
+  return 0;
+}
+
+
+#ifdef WITH_THREAD
+/* Find a flight for pk.  Returns 1 and sets *flight to a new reference,
+ * 0 if there is none and -1 if a comparison raised.
+ * Must be called with the shard lock held. */
+static int
+flight_find(cacheshard *sh, probekey *pk, flightobject **flight)
+{
+  flightobject *fl;
+  size_t version;
+  int k;
+
+ restart:
+  for(fl = sh->flights; fl != NULL; fl = fl->next){
+    if (fl->hash != pk->hash)
+      continue;
+    // __eq__ may call back into the cache and land this very flight
+    version = sh->flights_version;
+    Py_INCREF(fl);
+    k = key_equal(fl->key, pk);
+    if (k != 0 || version == sh->flights_version){
+      if (k > 0){
+        *flight = fl;
+        return 1;
+      }
+      Py_DECREF(fl);
+      if (k < 0)
+        return -1;
+      continue;
+    }
+    Py_DECREF(fl);
+    goto restart;
+  }
+  return 0;
+}
+
+
+/* Join the flight for pk on a miss.  Returns 1 and sets *flight to a new
+ * reference of another thread's flight to wait for.  Otherwise returns 0
+ * and sets *flight to a new flight owned by the caller, or to NULL if the
+ * caller must not start one.  Returns -1 on error.
+ * Must be called with the shard lock held, key is the heap key for pk. */
+static int
+flight_join(cacheshard *sh, probekey *pk, PyObject *key,
+            flightobject **flight)
+{
+  flightobject *fl;
+  int k;
+
+  *flight = NULL;
+  /* a thread computing another key must not block, see above */
+  if (flights_owned > 0)
+    return 0;
+  if ((k = flight_find(sh, pk, &fl)) != 0){
+    if (k > 0)
+      *flight = fl;
+    return k;
+  }
+  if ((fl = flight_new(key, pk->hash)) == NULL)
+    return -1;
+  fl->next = sh->flights;
+  sh->flights = fl;
+  sh->flights_version++;
+  *flight = fl;
+  return 0;
+}
+
+
+/* Record the outcome of fl and take it off the list of sh.  result is the
+ * return value of the wrapped function, NULL with an exception set if it
+ * raised.  The waiters are woken by flight_done.
+ * Must be called with the shard lock held. */
+static void
+flight_land(cacheshard *sh, flightobject *fl, PyObject *result)
+{
+  flightobject **p;
+
+  for(p = &sh->flights; *p != NULL; p = &(*p)->next){
+    if (*p == fl){
+      *p = fl->next;
+      sh->flights_version++;
+      break;
+    }
+  }
+  fl->next = NULL;
+  if (result != NULL){
+    Py_INCREF(result);
+    fl->result = result;
+    return;
+  }
+  PyErr_Fetch(&fl->exc_type, &fl->exc_value, &fl->exc_tb);
+  PyErr_NormalizeException(&fl->exc_type, &fl->exc_value, &fl->exc_tb);
+  Py_XINCREF(fl->exc_type);
+  Py_XINCREF(fl->exc_value);
+  Py_XINCREF(fl->exc_tb);
+  PyErr_Restore(fl->exc_type, fl->exc_value, fl->exc_tb);
+}
+#endif /* WITH_THREAD */
+
+
+/***********************************************************
+ coroutine functions
+************************************************************/
+/* Calling a coroutine function returns a coroutine, which can only be
+ * awaited once.  The cache stores a fastcache._async.SharedCall holding it
+ * instead, and every call, hit or miss, returns a new coroutine awaiting
+ * it, see cache_await.  The call runs as a task of the event loop of the
+ * first awaiter, which other awaiters await through asyncio.shield, so
+ * that cancelling one of them leaves the call to the others.  A callback
+ * removes the shared call again if it failed or was cancelled, so that the
+ * next call retries. */
+
+/* Set *async_call to fastcache._async.SharedCall if fo is a coroutine
+ * function and to NULL otherwise.  Returns -1 with an exception set on
+ * failure. */
+static int
+async_detect(PyObject *fo, PyObject **async_call)
+{
+  PyObject *mod, *check, *r;
+  int k;
+
+  *async_call = NULL;
+  if ((mod = PyImport_ImportModule("inspect")) == NULL)
+    return -1;
+  check = PyObject_GetAttrString(mod, "iscoroutinefunction");
+  Py_DECREF(mod);
+  if (check == NULL){
+    // no coroutines before Python 3.5
+    if (!PyErr_ExceptionMatches(PyExc_AttributeError))
+      return -1;
+    PyErr_Clear();
+    return 0;
+  }
+  r = PyObject_CallFunctionObjArgs(check, fo, NULL);
+  Py_DECREF(check);
+  if (r == NULL)
+    return -1;
+  k = PyObject_IsTrue(r);
+  Py_DECREF(r);
+  if (k <= 0)
+    return k;
+  if ((mod = PyImport_ImportModule("fastcache._async")) == NULL)
+    return -1;
+  *async_call = PyObject_GetAttrString(mod, "SharedCall");
+  Py_DECREF(mod);
+  return *async_call != NULL ? 0 : -1;
+}
+
+
+/* Remove the entry for key if it still holds result, e.g. a failed call.
+ * Returns -1 with an exception set on failure. */
+static int
+cache_discard(cacheobject *co, PyObject *key, Py_hash_t hash, PyObject *result)
+{
+  cacheshard *sh = SHARD_OF(co, hash);
+  probekey pk;
+  hindex i;
+  int found;
+  garbage g;
+
+  pk.hash = hash;
+  pk.obj = key;
+  pk.items = NULL;
+  pk.size = 0;
+  garbage_init(&g);
+  if (ACQUIRE_LOCK(sh) == -1)
+    return -1;
+  found = htable_lookup(&sh->table, &pk, &i);
+  if (found > 0 && sh->table.weak_values){
+    PyObject *held = weak_deref(sh->table.slots[i].result);
+    found = held == result;
+    Py_XDECREF(held);
+  }
+  else if (found > 0)
+    found = sh->table.slots[i].result == result;
+  if (found > 0){
+    if (garbage_reserve(&g) == 0)
+      htable_remove_into(&sh->table, i, &g);
+    else {
+      PyErr_NoMemory();
+      found = -1;
+    }
+  }
+  if (RELEASE_LOCK(sh) == -1)
+    found = -1;
+  garbage_release(&g);
+  return found < 0 ? -1 : 0;
+}
+
+
+/* Called by a shared call that failed or was cancelled, with itself, to
+ * remove it from the cache.  It refers to the cache, which refers to the
+ * shared call, so the cycle collector needs to see it. */
+typedef struct {
+  PyObject_HEAD
+  cacheobject *cache;
+  PyObject *key;
+  Py_hash_t hash;
+} futuredoneobject;
+
+
+static int
+futuredone_traverse(futuredoneobject *fd, visitproc visit, void *arg)
+{
+  Py_VISIT(fd->cache);
+  Py_VISIT(fd->key);
+  return 0;
+}
+
+
+static int
+futuredone_tp_clear(futuredoneobject *fd)
+{
+  Py_CLEAR(fd->cache);
+  Py_CLEAR(fd->key);
+  return 0;
+}
+
+
+static void
+futuredone_dealloc(futuredoneobject *fd)
+{
+  PyObject_GC_UnTrack(fd);
+  Py_XDECREF(fd->cache);
+  Py_XDECREF(fd->key);
+  PyObject_GC_Del(fd);
+}
+
+
+static PyObject *
+futuredone_call(futuredoneobject *fd, PyObject *args, PyObject *kw)
+{
+  PyObject *call;
+
+  if (!PyArg_ParseTuple(args, "O", &call))
+    return NULL;
+  if (fd->cache != NULL &&
+      cache_discard(fd->cache, fd->key, fd->hash, call) < 0)
+    return NULL;
+  Py_RETURN_NONE;
+}
+
+
+static PyTypeObject futuredone_type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "_lrucache.futuredone",  /* tp_name */
+  sizeof(futuredoneobject),  /* tp_basicsize */
+  0,                       /* tp_itemsize */
+  (destructor)futuredone_dealloc,  /* tp_dealloc */
+  0,                       /* tp_print */
+  0,                       /* tp_getattr */
+  0,                       /* tp_setattr */
+  0,                       /* tp_reserved */
+  0,                       /* tp_repr */
+  0,                       /* tp_as_number */
+  0,                       /* tp_as_sequence */
+  0,                       /* tp_as_mapping */
+  0,                       /* tp_hash */
+  (ternaryfunc)futuredone_call,  /* tp_call */
+  0,                       /* tp_str */
+  0,                       /* tp_getattro */
+  0,                       /* tp_setattro */
+  0,                       /* tp_as_buffer */
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,  /* tp_flags */
+  0,                       /* tp_doc */
+  (traverseproc)futuredone_traverse,  /* tp_traverse */
+  (inquiry)futuredone_tp_clear,  /* tp_clear */
+};
+
+
+/* Replace *coro, the coroutine returned by a coroutine function, with a
+ * shared call running it that discards itself from the cache under key if
+ * it fails.  On failure the coroutine is closed, *coro is released and -1
+ * is returned with an exception set. */
+static int
+cache_share_call(cacheobject *co, PyObject *key, Py_hash_t hash, PyObject **coro)
+{
+  PyObject *call = NULL, *r;
+  futuredoneobject *fd;
+
+  if ((fd = PyObject_GC_New(futuredoneobject, &futuredone_type)) != NULL){
+    fd->cache = co;
+    Py_INCREF(co);
+    fd->key = key;
+    Py_INCREF(key);
+    fd->hash = hash;
+    PyObject_GC_Track(fd);
+    call = PyObject_CallFunctionObjArgs(co->async_call, *coro,
+                                        (PyObject *)fd, NULL);
+    Py_DECREF(fd);
+  }
+  if (call == NULL){
+    // close it to avoid a warning it was never awaited
+    PyObject *exc_type, *exc_value, *exc_tb;
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    r = PyObject_CallMethod(*coro, "close", NULL);
+    Py_XDECREF(r);
+    PyErr_Restore(exc_type, exc_value, exc_tb);
+    Py_CLEAR(*coro);
+    return -1;
+  }
+  Py_DECREF(*coro);
+  *coro = call;
+  return 0;
+}
+
+
+/* What a call of a coroutine function returns for the shared call stored
+ * in the cache: a new coroutine awaiting it.  Steals the reference to
+ * result, which is returned as is if it is not a shared call, e.g. the
+ * coroutine of a call with unhashable arguments. */
+static PyObject *
+cache_await(cacheobject *co, PyObject *result)
+{
+  PyObject *coro;
+
+  if (result == NULL || co->async_call == NULL ||
+      !PyObject_TypeCheck(result, (PyTypeObject *)co->async_call))
+    return result;
+  coro = PyObject_CallMethod(result, "wait", NULL);
+  Py_DECREF(result);
+  return coro;
+}
+
+
+/***********************************************************
+ weak keys and values
+************************************************************/
+/* Caches made with weak_keys or weak_values hold their keys or results
+ * through weak entries, see the hash table notes, so that an entry goes
+ * away with the object it refers to.  All weak entries of a cache share
+ * one callback, which only refers to the cache weakly.  A cached_method
+ * keeps its per-instance caches the same way. */
+typedef struct {
+  PyObject_HEAD
+  PyObject *owner;        // weak reference to the cache or cached_method
+} weakcbobject;
+
+
+static void
+weakcb_dealloc(weakcbobject *cb)
+{
+  Py_XDECREF(cb->owner);
+  Py_TYPE(cb)->tp_free(cb);
+}
+
+
+/* Unlink the entry of a weak entry whose referent died */
+static PyObject *
+weakcb_call(weakcbobject *cb, PyObject *args, PyObject *kw)
+{
+  PyObject *ref, *owner;
+  Py_hash_t hash;
+  cacheshard *sh;
+  hindex i;
+  garbage g;
+
+  if (!PyArg_ParseTuple(args, "O", &ref))
+    return NULL;
+  if (!WEAK_ENTRY_CHECK(ref) || (owner = weak_deref(cb->owner)) == NULL)
+    Py_RETURN_NONE;
+  hash = ((weakentryobject *)ref)->key_hash;
+  if (Py_TYPE(owner) == &cache_type)
+    sh = SHARD_OF((cacheobject *)owner, hash);
+  else
+    sh = &((cachedmethodobject *)owner)->instances;
+  garbage_init(&g);
+  ACQUIRE_LOCK_NOINTR(sh);
+  // the entry may already be gone, e.g. if the key and result both died
+  i = htable_find_ref(&sh->table, ref);
+  if (i != HT_NONE && garbage_reserve(&g) == 0){
+    htable_remove_into(&sh->table, i, &g);
+    sh->collected++;
+  }
+  RELEASE_LOCK(sh);
+  garbage_release(&g);
+  Py_DECREF(owner);
+  Py_RETURN_NONE;
+}
+
+
+static PyTypeObject weakcb_type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "_lrucache.weakcallback",  /* tp_name */
+  sizeof(weakcbobject),    /* tp_basicsize */
+  0,                       /* tp_itemsize */
+  (destructor)weakcb_dealloc,  /* tp_dealloc */
+  0,                       /* tp_print */
+  0,                       /* tp_getattr */
+  0,                       /* tp_setattr */
+  0,                       /* tp_reserved */
+  0,                       /* tp_repr */
+  0,                       /* tp_as_number */
+  0,                       /* tp_as_sequence */
+  0,                       /* tp_as_mapping */
+  0,                       /* tp_hash */
+  (ternaryfunc)weakcb_call,  /* tp_call */
+  0,                       /* tp_str */
+  0,                       /* tp_getattro */
+  0,                       /* tp_setattro */
+  0,                       /* tp_as_buffer */
+  Py_TPFLAGS_DEFAULT,      /* tp_flags */
+};
+
+
+/* new callback for the weak entries of owner */
+static PyObject *
+weakcb_new(PyObject *owner)
+{
+  weakcbobject *cb = PyObject_New(weakcbobject, &weakcb_type);
+
+  if (cb == NULL)
+    return NULL;
+  if ((cb->owner = PyWeakref_NewRef(owner, NULL)) == NULL){
+    Py_DECREF(cb);
+    return NULL;
+  }
+  return (PyObject *)cb;
+}
+
+
+/* Lookup key of a call to a weak_keys cache: its only argument, held
+ * weakly once stored.  Returns 0 if the call is not cached, since it has
+ * other arguments, its argument has no weak references or is unhashable
+ * and co->err lets it through.  Returns -1 on error. */
+static int
+weak_key(cacheobject *co, callargs *ca, probekey *pk)
+{
+  PyObject *arg;
+
+  if (ca->nargs != 1 || kw_size(ca) > 0)
+    return 0;
+  arg = ca->stack[0];
+  if (!PyType_SUPPORTS_WEAKREFS(Py_TYPE(arg)))
+    return 0;
+  if ((pk->hash = PyObject_Hash(arg)) == -1)
+    return key_unhashable(co);
+  pk->obj = arg;
+  pk->items = NULL;
+  pk->size = 0;
+  return 1;
+}
+
+
+/* Set stored to new references to the objects to store for key and result
+ * in a weak cache, weak entries for those held weakly.  Returns 1 on
+ * success, 0 if the result has no weak references and is not cached, and
+ * -1 with an exception set on failure.  Creating a weak entry can run the
+ * cycle collector, so no lock may be held. */
+static int
+cache_weaken(cacheobject *co, Py_hash_t hash, PyObject *key, PyObject *result,
+             PyObject **stored)
+{
+  PyObject *objs[2];
+  int weak[2], n;
+
+  objs[0] = key;
+  objs[1] = result;
+  weak[0] = co->weak_keys;
+  weak[1] = co->weak_values;
+  stored[0] = stored[1] = NULL;
+  if (weak[1] && !PyType_SUPPORTS_WEAKREFS(Py_TYPE(result)))
+    return 0;
+  for(n = 0; n < 2; n++){
+    if (!weak[n]){
+      Py_INCREF(objs[n]);
+      stored[n] = objs[n];
+      continue;
+    }
+    stored[n] = PyObject_CallFunctionObjArgs((PyObject *)&weakentry_type,
+                                             objs[n], co->weak_callback,
+                                             NULL);
+    if (stored[n] == NULL){
+      Py_CLEAR(stored[0]);
+      return -1;
+    }
+    ((weakentryobject *)stored[n])->key_hash = hash;
+  }
+  return 1;
+}
+
+
+/***********************************************************
+ serialization
+************************************************************/
+/* Helpers shared by the shared tier and cache_dump/cache_load */
+
+/* module.qualname of the wrapped function as UTF-8 bytes */
+static PyObject *
+cache_identity(cacheobject *co)
+{
+  PyObject *name = co->func_qualname != Py_None ? co->func_qualname :
+    co->func_name;
+#ifdef _PY2
+  PyObject *mod = PyObject_Str(co->func_module), *id = NULL;
+  PyObject *qual = PyObject_Str(name);
+  if (mod != NULL && qual != NULL)
+    id = PyString_FromFormat("%s.%s", PyString_AS_STRING(mod),
+                             PyString_AS_STRING(qual));
+  Py_XDECREF(mod);
+  Py_XDECREF(qual);
+  return id;
+#else
+  PyObject *id = PyUnicode_FromFormat("%S.%S", co->func_module, name), *b;
+  if (id == NULL)
+    return NULL;
+  b = PyUnicode_AsUTF8String(id);
+  Py_DECREF(id);
+  return b;
+#endif
+}
+
+
+/* The dumps and loads functions of a serializer, pickle if it is None.
+ * *proto is set to the pickle protocol to pass to dumps, or -2 for none. */
+static int
+dump_serializer(PyObject *serializer, PyObject **dumps, PyObject **loads,
+                int *proto)
+{
+  PyObject *mod = NULL;
+
+  *proto = -2;
+  if (serializer == Py_None){
+    if ((mod = PyImport_ImportModule("pickle")) == NULL)
+      return -1;
+    serializer = mod;
+    *proto = -1;    // the highest protocol
+  }
+  *dumps = PyObject_GetAttrString(serializer, "dumps");
+  *loads = *dumps ? PyObject_GetAttrString(serializer, "loads") : NULL;
+  Py_XDECREF(mod);
+  if (*loads == NULL){
+    Py_CLEAR(*dumps);
+    return -1;
+  }
+  return 0;
+}
+
+
+/* serialize obj to a new bytes object */
+static PyObject *
+dump_object(PyObject *dumps, int proto, PyObject *obj)
+{
+  PyObject *b;
+
+  if (proto == -2)
+    b = PyObject_CallFunctionObjArgs(dumps, obj, NULL);
+  else
+    b = PyObject_CallFunction(dumps, "Oi", obj, proto);
+  if (b != NULL && !PyBytes_Check(b)){
+    PyErr_SetString(PyExc_TypeError, "serializer dumps() must return bytes");
+    Py_CLEAR(b);
+  }
+  if (b != NULL && (PyBytes_GET_SIZE(b) > (Py_ssize_t)0xffffffffL)){
+    PyErr_SetString(PyExc_OverflowError, "cache entries too large to dump");
+    Py_CLEAR(b);
+  }
+  return b;
+}
+
+
+/***********************************************************
+ shared tier
+************************************************************/
+/* With shared=path the results of a cache are also published to a memory
+ * mapped file, so that forked workers, or any process opening the same
+ * file, share them: a miss in one process is a hit for the others.  The
+ * local table stays in front of it, the shared tier is only consulted on
+ * a local miss.
+ *
+ * The file holds a header, an index of SHM slots and an arena.  Entries
+ * are the serialized key, prefixed with the identity of the function, and
+ * the serialized result, appended to the arena.  A slot points to an entry
+ * and is found by linear probing over at most SHM_PROBES slots from the
+ * FNV-1a hash of the key bytes, which unlike Python hashes is the same in
+ * every process.
+ *
+ * Readers take no lock.  Each slot has a sequence number which writers
+ * make odd while they change the slot, and readers retry when it was odd
+ * or moved while they copied the entry (a seqlock).  Writers serialize on
+ * an fcntl lock of the first byte of the file, which the kernel drops when
+ * its process dies, whatever its pid or namespace.  fcntl locks belong to
+ * a process, so the writers of one process serialize on a lock of their
+ * own first, which they also hold to close a file, since closing any
+ * descriptor of a file drops the locks of the process on it.  When the
+ * arena is full it is cleared as a whole, every slot being emptied through
+ * the seqlock first, so readers of old entries notice.  Writers that
+ * cannot get the locks soon skip publishing, the tier is only a cache.
+ *
+ * Results found in the file are deserialized, i.e. unpickled, so the file
+ * is trusted as much as the code of the processes writing to it.  It is
+ * created with mode 0600, an existing file must belong to the user and
+ * not be writable by others, and the documentation says so. */
+#ifdef FC_SHARED
+
+#define SHM_MAGIC "FCSHM001"
+#define SHM_PROBES 8
+#define SHM_MIN_SIZE ((Py_ssize_t)1 << 20)
+#define SHM_DEFAULT_SIZE ((Py_ssize_t)64 << 20)
+
+typedef struct {
+  char magic[8];
+  uint64_t size;            // bytes of the file
+  uint64_t nslots;          // a power of two
+  uint64_t arena;           // offset of the arena
+  uint64_t arena_size;
+  uint64_t top;             // bytes of the arena in use
+  uint64_t clears;          // times the arena was cleared
+  uint64_t unused;
+} shmheader;
+
+typedef struct {
+  uint64_t seq;             // odd while a writer changes the slot
+  uint64_t hash;
+  uint64_t offset;          // of the entry in the arena
+  uint32_t klen;            // 0 for an empty slot
+  uint32_t vlen;
+} shmslot;
+
+struct sharedtier {
+  int fd;                   // open for the writer lock
+  shmheader *header;
+  shmslot *slots;
+  unsigned char *arena;
+  size_t mapsize;
+  PyObject *prefix;         // identity of the function, then a NUL
+  PyObject *dumps, *loads;
+  int proto;
+};
+
+
+static uint64_t
+shm_hash(const unsigned char *p, Py_ssize_t n)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  while (n-- > 0)
+    h = (h ^ *p++) * 0x100000001b3ULL;
+  return h;
+}
+
+
+/* serializes the writers of this process, see above */
+static PyThread_type_lock shm_process_lock;
+
+
+/* Lock or unlock (F_UNLCK) the first byte of the file for writing.  Only
+ * waits for the lock with F_SETLKW. */
+static int
+shm_fcntl_lock(int fd, int cmd, short type)
+{
+  struct flock fl;
+
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 0;
+  fl.l_len = 1;
+  return fcntl(fd, cmd, &fl);
+}
+
+
+/* Take the writer locks, returns 0 if they stayed busy.  The process lock
+ * is waited for with the GIL released.  Then the file lock is tried, and
+ * while it is busy the writer sleeps with the GIL released, doubling the
+ * sleep up to 1ms, and gives up after SHM_LOCK_WAIT microseconds. */
+#define SHM_LOCK_WAIT 50000
+
+static int
+shm_lock(sharedtier *st)
+{
+  long waited = 0, delay = 1;
+  struct timespec ts;
+  int r;
+
+  if (!PyThread_acquire_lock(shm_process_lock, 0)){
+    Py_BEGIN_ALLOW_THREADS
+#ifdef _PY2
+    r = PyThread_acquire_lock(shm_process_lock, 1);
+#else
+    r = PyThread_acquire_lock_timed(shm_process_lock, SHM_LOCK_WAIT, 0) ==
+      PY_LOCK_ACQUIRED;
+#endif
+    Py_END_ALLOW_THREADS
+    if (!r)
+      return 0;
+  }
+  while ((r = shm_fcntl_lock(st->fd, F_SETLK, F_WRLCK)) < 0 &&
+         (errno == EACCES || errno == EAGAIN || errno == EINTR) &&
+         waited < SHM_LOCK_WAIT){
+    ts.tv_sec = 0;
+    ts.tv_nsec = delay * 1000;
+    Py_BEGIN_ALLOW_THREADS
+    nanosleep(&ts, NULL);
+    Py_END_ALLOW_THREADS
+    waited += delay;
+    if (delay < 1000)
+      delay *= 2;
+  }
+  if (r < 0){
+    PyThread_release_lock(shm_process_lock);
+    return 0;
+  }
+  return 1;
+}
+
+
+static void
+shm_unlock(sharedtier *st)
+{
+  shm_fcntl_lock(st->fd, F_SETLK, F_UNLCK);
+  PyThread_release_lock(shm_process_lock);
+}
+
+
+/* Start changing slot s, returns the even sequence number to end with */
+static uint64_t
+shm_slot_begin(shmslot *s)
+{
+  // a writer that died may have left the number odd
+  uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED) | 1;
+  __atomic_store_n(&s->seq, seq, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  return seq + 1;
+}
+
+
+/* Empty the index and the arena.  Must be called with the lock held. */
+static void
+shm_clear(sharedtier *st)
+{
+  shmheader *h = st->header;
+  uint64_t i, seq;
+
+  for(i = 0; i < h->nslots; i++){
+    shmslot *s = &st->slots[i];
+    if (__atomic_load_n(&s->klen, __ATOMIC_RELAXED) == 0)
+      continue;
+    seq = shm_slot_begin(s);
+    __atomic_store_n(&s->klen, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->seq, seq, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&h->top, 0, __ATOMIC_RELAXED);
+  h->clears++;
+}
+
+
+/* Copy of the serialized result stored under the key bytes kb, NULL if
+ * there is none (no exception set) or on failure. */
+static PyObject *
+shm_find(sharedtier *st, PyObject *kb)
+{
+  const unsigned char *k = (const unsigned char *)PyBytes_AS_STRING(kb);
+  uint32_t klen = (uint32_t)PyBytes_GET_SIZE(kb);
+  uint64_t h = shm_hash(k, klen), mask = st->header->nslots - 1;
+  uint64_t arena_size = st->header->arena_size;
+  int p, attempt;
+
+  for(attempt = 0; attempt < 4; attempt++){
+    for(p = 0; p < SHM_PROBES; p++){
+      shmslot *s = &st->slots[(h + p) & mask];
+      uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE), off;
+      uint32_t kl, vl;
+      PyObject *v = NULL;
+
+      if (seq & 1)
+        break;                // being written, try again
+      kl = __atomic_load_n(&s->klen, __ATOMIC_RELAXED);
+      if (kl == 0)
+        return NULL;          // the probe run ends here
+      if (kl != klen || __atomic_load_n(&s->hash, __ATOMIC_RELAXED) != h)
+        continue;
+      off = __atomic_load_n(&s->offset, __ATOMIC_RELAXED);
+      vl = __atomic_load_n(&s->vlen, __ATOMIC_RELAXED);
+      if (off + kl + vl <= arena_size && memcmp(st->arena + off, k, kl) == 0
+          && (v = PyBytes_FromStringAndSize((char *)st->arena + off + kl,
+                                            vl)) == NULL)
+        return NULL;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq){
+        Py_XDECREF(v);
+        break;                // changed while being read, try again
+      }
+      if (v != NULL)
+        return v;
+    }
+    if (p == SHM_PROBES)
+      return NULL;
+  }
+  return NULL;
+}
+
+
+/* Publish the value bytes vb under the key bytes kb */
+static void
+shm_publish(sharedtier *st, PyObject *kb, PyObject *vb)
+{
+  shmheader *h = st->header;
+  const unsigned char *k = (const unsigned char *)PyBytes_AS_STRING(kb);
+  uint32_t klen = (uint32_t)PyBytes_GET_SIZE(kb);
+  uint32_t vlen = (uint32_t)PyBytes_GET_SIZE(vb);
+  uint64_t hash = shm_hash(k, klen), mask = h->nslots - 1, need, off, seq;
+  shmslot *s = NULL;
+  int p;
+
+  // 8 byte aligned, and small enough to leave room for others
+  need = ((uint64_t)klen + vlen + 7) & ~(uint64_t)7;
+  if (need > h->arena_size / 8 || !shm_lock(st))
+    return;
+  if (h->top + need > h->arena_size)
+    shm_clear(st);
+  off = h->top;
+  memcpy(st->arena + off, k, klen);
+  memcpy(st->arena + off + klen, PyBytes_AS_STRING(vb), vlen);
+  __atomic_store_n(&h->top, off + need, __ATOMIC_RELAXED);
+  // an empty slot or the key's own, else evict one of the probe run
+  for(p = 0; p < SHM_PROBES && s == NULL; p++){
+    shmslot *c = &st->slots[(hash + p) & mask];
+    if (c->klen == 0 || (c->hash == hash && c->klen == klen &&
+                         c->offset + klen <= h->arena_size &&
+                         memcmp(st->arena + c->offset, k, klen) == 0))
+      s = c;
+  }
+  if (s == NULL)
+    s = &st->slots[(hash + (hash >> 59) % SHM_PROBES) & mask];
+  seq = shm_slot_begin(s);
+  __atomic_store_n(&s->hash, hash, __ATOMIC_RELAXED);
+  __atomic_store_n(&s->offset, off, __ATOMIC_RELAXED);
+  __atomic_store_n(&s->vlen, vlen, __ATOMIC_RELAXED);
+  __atomic_store_n(&s->klen, klen, __ATOMIC_RELAXED);
+  __atomic_store_n(&s->seq, seq, __ATOMIC_RELEASE);
+  shm_unlock(st);
+}
+
+
+#ifdef _PY2
+#define SHM_DENIED PyExc_OSError
+#else
+#define SHM_DENIED PyExc_PermissionError
+#endif
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+/* Map the shared file at path, creating it with the given size if it is
+ * empty, for the function identified by id.  The file is refused if it is
+ * a symbolic link, not a regular file, owned by another user or writable
+ * by others.  Returns NULL with an exception set on failure. */
+static sharedtier *
+shared_open(PyObject *path, Py_ssize_t size, PyObject *id)
+{
+  sharedtier *st = NULL;
+  shmheader *h;
+  PyObject *bpath = NULL;
+  struct stat sb;
+  void *map = MAP_FAILED;
+  int fd = -1;
+
+#ifdef _PY2
+  if (!PyString_Check(path)){
+    PyErr_SetString(PyExc_TypeError, "Argument <shared> must be a path.");
+    return NULL;
+  }
+  bpath = path;
+  Py_INCREF(bpath);
+#else
+  if (!PyUnicode_FSConverter(path, &bpath))
+    return NULL;
+#endif
+  // the writers of this process stay out while the file is set up, and
+  // while it is closed on failure, see shm_lock
+  Py_BEGIN_ALLOW_THREADS
+  PyThread_acquire_lock(shm_process_lock, 1);
+  Py_END_ALLOW_THREADS
+  if ((fd = open(PyBytes_AS_STRING(bpath),
+                 O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600)) < 0 ||
+      shm_fcntl_lock(fd, F_SETLKW, F_WRLCK) < 0 || fstat(fd, &sb) < 0){
+    PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+    goto error;
+  }
+  if (!S_ISREG(sb.st_mode) || sb.st_uid != geteuid() ||
+      (sb.st_mode & 022) != 0){
+    PyErr_Format(SHM_DENIED, "%.200s must be a regular file of this user "
+                 "that others cannot write to", PyBytes_AS_STRING(bpath));
+    goto error;
+  }
+  if (sb.st_size == 0){
+    // a new file, lay out the header, the index and the arena
+    shmheader init;
+    uint64_t nslots = 1024;
+    while (nslots * 2 * 512 <= (uint64_t)size)
+      nslots <<= 1;
+    memset(&init, 0, sizeof(init));
+    memcpy(init.magic, SHM_MAGIC, 8);
+    init.size = (uint64_t)size;
+    init.nslots = nslots;
+    init.arena = sizeof(shmheader) + nslots * sizeof(shmslot);
+    init.arena_size = init.size - init.arena;
+    if (ftruncate(fd, (off_t)size) < 0 ||
+        pwrite(fd, &init, sizeof(init), 0) != (ssize_t)sizeof(init)){
+      PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+      goto error;
+    }
+    sb.st_size = (off_t)size;
+  }
+  map = mmap(NULL, (size_t)sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+             fd, 0);
+  if (map == MAP_FAILED){
+    PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+    goto error;
+  }
+  h = (shmheader *)map;
+  if ((size_t)sb.st_size < sizeof(shmheader) ||
+      memcmp(h->magic, SHM_MAGIC, 8) != 0 || h->size != (uint64_t)sb.st_size ||
+      (h->nslots & (h->nslots - 1)) != 0 ||
+      h->arena != sizeof(shmheader) + h->nslots * sizeof(shmslot) ||
+      h->arena + h->arena_size != h->size){
+    PyErr_Format(PyExc_ValueError, "%.200s is not a shared cache file",
+                 PyBytes_AS_STRING(bpath));
+    goto error;
+  }
+  if ((st = PyMem_New(sharedtier, 1)) == NULL){
+    PyErr_NoMemory();
+    goto error;
+  }
+  memset(st, 0, sizeof(sharedtier));
+  st->fd = fd;
+  st->header = h;
+  st->slots = (shmslot *)(h + 1);
+  st->arena = (unsigned char *)map + h->arena;
+  st->mapsize = (size_t)sb.st_size;
+  st->prefix = PyBytes_FromStringAndSize(PyBytes_AS_STRING(id),
+                                         PyBytes_GET_SIZE(id) + 1);
+  if (st->prefix == NULL ||
+      dump_serializer(Py_None, &st->dumps, &st->loads, &st->proto) < 0)
+    goto error;
+  shm_fcntl_lock(fd, F_SETLK, F_UNLCK);
+  PyThread_release_lock(shm_process_lock);
+  Py_DECREF(bpath);
+  return st;
+
+ error:
+  if (st != NULL){
+    Py_XDECREF(st->prefix);
+    PyMem_Free(st);
+  }
+  if (map != MAP_FAILED)
+    munmap(map, (size_t)sb.st_size);
+  if (fd >= 0)
+    close(fd);
+  PyThread_release_lock(shm_process_lock);
+  Py_XDECREF(bpath);
+  return NULL;
+}
+
+
+static void
+shared_free(sharedtier *st)
+{
+  munmap(st->header, st->mapsize);
+  Py_BEGIN_ALLOW_THREADS
+  PyThread_acquire_lock(shm_process_lock, 1);
+  Py_END_ALLOW_THREADS
+  close(st->fd);
+  PyThread_release_lock(shm_process_lock);
+  Py_XDECREF(st->prefix);
+  Py_XDECREF(st->dumps);
+  Py_XDECREF(st->loads);
+  PyMem_Free(st);
+}
+
+
+/* Key bytes for key, NULL without an exception if it does not serialize */
+static PyObject *
+shared_key(sharedtier *st, PyObject *key)
+{
+  PyObject *kb, *b;
+
+  if ((b = dump_object(st->dumps, st->proto, key)) == NULL){
+    PyErr_Clear();
+    return NULL;
+  }
+  if (PyBytes_GET_SIZE(b) > (Py_ssize_t)0x0fffffff){
+    Py_DECREF(b);
+    return NULL;
+  }
+  kb = st->prefix;
+  Py_INCREF(kb);
+  PyBytes_ConcatAndDel(&kb, b);
+  if (kb == NULL)
+    PyErr_Clear();
+  return kb;
+}
+
+
+/* Result stored under the key bytes kb by any process, or NULL without an
+ * exception if there is none */
+static PyObject *
+shared_get(sharedtier *st, PyObject *kb)
+{
+  PyObject *vb = shm_find(st, kb), *result;
+
+  if (vb == NULL){
+    PyErr_Clear();
+    return NULL;
+  }
+  result = PyObject_CallFunctionObjArgs(st->loads, vb, NULL);
+  Py_DECREF(vb);
+  if (result == NULL)
+    PyErr_Clear();
+  return result;
+}
+
+
+/* publish result under the key bytes kb, if it serializes */
+static void
+shared_put(sharedtier *st, PyObject *kb, PyObject *result)
+{
+  PyObject *vb = dump_object(st->dumps, st->proto, result);
+
+  if (vb == NULL){
+    PyErr_Clear();
+    return;
+  }
+  if (PyBytes_GET_SIZE(vb) <= (Py_ssize_t)0x0fffffff)
+    shm_publish(st, kb, vb);
+  Py_DECREF(vb);
+}
+
+#endif /* FC_SHARED */
+
+
+/* Result for key published to the shared tier by any process, NULL without
+ * an exception if there is none */
+static PyObject *
+cache_shared_get(cacheobject *co, PyObject *key)
+{
+#ifdef FC_SHARED
+  PyObject *kb, *result;
+
+  if (co->shared == NULL || key == NULL ||
+      (kb = shared_key(co->shared, key)) == NULL)
+    return NULL;
+  result = shared_get(co->shared, kb);
+  Py_DECREF(kb);
+  return result;
+#else
+  return NULL;
+#endif
+}
+
+
+/* publish the result for key to the shared tier */
+static void
+cache_shared_put(cacheobject *co, PyObject *key, PyObject *result)
+{
+#ifdef FC_SHARED
+  PyObject *kb;
+
+  if (co->shared != NULL && key != NULL &&
+      (kb = shared_key(co->shared, key)) != NULL){
+    shared_put(co->shared, kb, result);
+    Py_DECREF(kb);
+  }
+#endif
+}
+
+
+/* Compute the result for key, a key missing from the cache, by calling the
+ * wrapped function.  With a shared tier the result is taken from there if
+ * another process published it, and published otherwise.  *shared_hit is
+ * set if it came from the shared tier. */
+static PyObject *
+cache_compute(cacheobject *co, callargs *ca, PyObject *key, int *shared_hit)
+{
+#ifdef FC_SHARED
+  PyObject *kb, *result;
+
+  *shared_hit = 0;
+  if (co->shared == NULL || key == NULL ||
+      (kb = shared_key(co->shared, key)) == NULL)
+    return call_fn(co, ca);
+  if ((result = shared_get(co->shared, kb)) != NULL)
+    *shared_hit = 1;
+  else if ((result = call_fn(co, ca)) != NULL)
+    shared_put(co->shared, kb, result);
+  Py_DECREF(kb);
+  return result;
+#else
+  *shared_hit = 0;
+  return call_fn(co, ca);
+#endif
+}
+
+
+/***********************************************************
+ * All calls to the cached function go through cache_call_args, either
+ * from tp_call (cache_call) or from vectorcall (cache_vectorcall).
+ * Handles: (1) Generation of key (via fast_key or make_key)
+ *          (2) Lookups and LRU maintenance in the shard of the key
+ *          (3) Calling the wrapped function on a miss
+ * THREAD SAFETY NOTES:
+ * 1. The shard lock is held for every access to its table but released while
+ *    the wrapped function runs, so another thread may have stored the same
+ *    key by the time the result is inserted.  The key is looked up again
+ *    before inserting.
+ * 2. Evicted keys and results are only DECREF'd after the lock has been
+ *    released, since their destructors may run arbitrary Python code.
+ ***********************************************************/
+static PyObject *
+cache_call_args(cacheobject *co, callargs *ca)
+{
+  PyObject *key = NULL, *result, *stored[2] = {NULL, NULL};
+  probekey pk;
+  cacheshard *sh;
+  hindex i;
+  int found, shared_hit = 0, storable = 1;
+  double now = 0, elapsed;
+  Py_ssize_t weight = 0, *stat;
+  garbage g;
+#ifdef WITH_THREAD
+  flightobject *fl = NULL;
+#else
+  void *fl = NULL;
+#endif
+
+  /* no cache, just update stats and return */
+  if (co->maxsize == 0) {
+    FC_STAT_INC(co, misses);
+    return call_fn(co, ca);
+  }
+
+  /* a weak_keys cache keys calls by their only argument */
+  if (co->weak_keys){
+    if ((found = weak_key(co, ca, &pk)) <= 0){
+      if (found < 0)
+        return NULL;
+      FC_STAT_INC(co, misses);
+      return call_fn(co, ca);
+    }
+    key = pk.obj;
+    Py_INCREF(key);
+  }
+  /* builtin scalar arguments are looked up without building a key */
+  else if (!fast_key(co, ca, &pk)){
+    // generate a key from hashing the arguments
+    // THREAD SAFETY NOTES:
+    // Computing the hash will result in many potential calls to __hash__
+    // methods, allowing the GIL to switch threads.  Thus it is possible that
+    // two threads have called this function with the exact same arguments
+    // and are constructing keys
+    key = make_key(co, ca, &pk.hash);
+    if (!key)
+      return NULL;
+
+    /* check for unhashable type */
+    if (pk.hash == -1){
+      // no locking neccessary here
+      Py_DECREF(key);
+      FC_STAT_INC(co, misses);
+      return call_fn(co, ca);
+    }
+    pk.obj = key;
+  }
+  if (co->mrc != NULL)
+    mrc_access(co->mrc, pk.hash);
+  sh = SHARD_OF(co, pk.hash);
+  if (sh->table.timers != NULL && cache_now(co, &now) < 0){
+    Py_XDECREF(key);
+    return NULL;
+  }
+
+#ifndef Py_GIL_DISABLED
+  /* Under the GIL a table is consistent whenever another thread can run,
+   * so hits that do not reorder entries can skip the lock.  The locked
+   * lookup below still orders misses with concurrent inserts. */
+  if((sh->table.clock || !SHARD_BOUNDED(sh)) && sh->table.ttl_access <= 0){
+    found = htable_lookup(&sh->table, &pk, &i);
+    if(found < 0 || (found && !HT_EXPIRED(&sh->table, i, now) &&
+                     !HT_DEAD(&sh->table, i))){
+      result = found > 0 ? cache_hit(sh, i, now) : NULL;
+      if (result != NULL || found < 0){
+        Py_XDECREF(key);
+        return result;
+      }
+    }
+  }
+#endif
+
+  garbage_init(&g);
+  if(ACQUIRE_LOCK(sh) == -1){
+    Py_XDECREF(key);
+    return NULL;
+  }
+  found = shard_lookup(sh, &pk, &i, now, &g);
+  if(found < 0){
+    RELEASE_LOCK(sh);
+    garbage_release(&g);
+    Py_XDECREF(key);
+    return NULL;
+  }
+  if(sh->table.lfu)
+    fsketch_increment(&sh->sketch, pk.hash);
+  /* a weak result that died since the lookup is a miss */
+  if(found && (result = cache_hit(sh, i, now)) == NULL)
+    found = 0;
+  if(found){
+    if(RELEASE_LOCK(sh) == -1){
+      Py_DECREF(result);
+      result = NULL;
+    }
+    garbage_release(&g);
+    Py_XDECREF(key);
+    return result;
+  }
+#ifdef WITH_THREAD
+  /* wait for a concurrent miss on the same key instead of calling again */
+  if(co->single_flight){
+    int k;
+    if(!key && !(key = probe_key_object(&pk))){
+      RELEASE_LOCK(sh);
+      garbage_release(&g);
+      return NULL;
+    }
+    if((k = flight_join(sh, &pk, key, &fl)) != 0){
+      RELEASE_LOCK(sh);
+      garbage_release(&g);
+      Py_DECREF(key);
+      if(k < 0)
+        return NULL;
+      result = flight_wait(fl);
+      Py_DECREF(fl);
+      if(result && ACQUIRE_LOCK_NOINTR(sh) == 1){
+        sh->hits++;
+        RELEASE_LOCK(sh);
+      }
+      return result;
+    }
+  }
+#endif
+  if(RELEASE_LOCK(sh) == -1){
+    if(fl){
+      flight_land(sh, fl, NULL);
+      flight_done(fl);
+    }
+    garbage_release(&g);
+    Py_XDECREF(key);
+    return NULL;
+  }
+  garbage_release(&g);
+
+#ifdef WITH_THREAD
+  if(fl){
+    flights_owned++;
+    elapsed = perf_time();
+    result = cache_compute(co, ca, key, &shared_hit);
+    elapsed = perf_time() - elapsed;
+    flights_owned--;
+    if(result && co->async_call)
+      cache_share_call(co, key, pk.hash, &result);
+    if(result && cache_prepare_store(co, sh, result, &now, &weight) < 0)
+      Py_CLEAR(result);
+    if(result && co->weak_callback &&
+       (storable = cache_weaken(co, pk.hash, key, result, stored)) < 0)
+      Py_CLEAR(result);
+    /* the flight must land even if a signal arrives, waiters depend on it */
+    ACQUIRE_LOCK_NOINTR(sh);
+    flight_land(sh, fl, result);
+    if(!result){
+      RELEASE_LOCK(sh);
+      flight_done(fl);
+      Py_DECREF(key);
+      return NULL;
+    }
+    goto recheck;
+  }
+#endif
+  // the shared tier is keyed by the arguments, so build the key up front
+  if(CACHE_SHARED(co) && !key && !(key = probe_key_object(&pk)))
+    return NULL;
+  elapsed = perf_time();
+  result = cache_compute(co, ca, key, &shared_hit); // refcount is one
+  elapsed = perf_time() - elapsed;
+  if(!result){
+    Py_XDECREF(key);
+    return NULL;
+  }
+  // the key is stored in the table so it must live on the heap
+  if(!key && !(key = probe_key_object(&pk))){
+    Py_DECREF(result);
+    return NULL;
+  }
+  // a coroutine is stored as a call that every caller can await
+  if(co->async_call && cache_share_call(co, key, pk.hash, &result) < 0){
+    Py_DECREF(key);
+    return NULL;
+  }
+  if(cache_prepare_store(co, sh, result, &now, &weight) < 0){
+    Py_DECREF(key);
+    Py_DECREF(result);
+    return NULL;
+  }
+  // a weak cache stores weak entries, made before taking the lock
+  if(co->weak_callback &&
+     (storable = cache_weaken(co, pk.hash, key, result, stored)) < 0){
+    Py_DECREF(key);
+    Py_DECREF(result);
+    return NULL;
+  }
+
+  /* Need to reacquire the lock here and make sure that the key,result were
+   * not added to the cache while we were waiting.  Even a single thread can
+   * get here twice for the same key through a recursive call. */
+  if(ACQUIRE_LOCK(sh) == -1){
+    Py_XDECREF(stored[0]);
+    Py_XDECREF(stored[1]);
+    Py_DECREF(key);
+    Py_DECREF(result);
+    return NULL;
+  }
+#ifdef WITH_THREAD
+ recheck:
+#endif
+  if(!shared_hit)
+    shard_time_miss(sh, elapsed);
+  found = shard_lookup(sh, &pk, &i, now, &g);
+  if(found){
+    // the result computed here is dropped for the one stored meanwhile
+    if(found > 0){
+      sh->hits++;
+      sh->duplicates++;
+    }
+    RELEASE_LOCK(sh);
+    flight_done(fl);
+    garbage_release(&g);
+    Py_XDECREF(stored[0]);
+    Py_XDECREF(stored[1]);
+    Py_DECREF(key);
+    if(found < 0){
+      Py_DECREF(result);
+      return NULL;
+    }
+    return result;
+  }
+  // a result another process computed counts as a hit
+  stat = shared_hit ? &sh->hits : &sh->misses;
+  (*stat)++;
+  if(storable &&
+     shard_store(sh, pk.hash, stored[0] ? stored[0] : key,
+                 stored[1] ? stored[1] : result, weight, now, &g) < 0){
+    (*stat)--;
+    RELEASE_LOCK(sh);
+    flight_done(fl);
+    garbage_release(&g);
+    Py_XDECREF(stored[0]);
+    Py_XDECREF(stored[1]);
+    Py_DECREF(key);
+    Py_DECREF(result);
+    return NULL;
+  }
+  if(RELEASE_LOCK(sh) == -1){
+    Py_DECREF(result);
+    result = NULL;
+  }
+  flight_done(fl);
+  // the table is consistent again, release the evicted entries
+  garbage_release(&g);
+  Py_XDECREF(stored[0]);
+  Py_XDECREF(stored[1]);
+  Py_DECREF(key);
+  return result;
+}
+
+
+/* tp_call entry point */
+static PyObject *
+cache_call(cacheobject *co, PyObject *args, PyObject *kw)
+{
+  callargs ca;
+
+  ca.stack = ((PyTupleObject *)args)->ob_item;
+  ca.nargs = PyTuple_GET_SIZE(args);
+  ca.args = args;
+  ca.kw = kw;
+#ifdef _FC_VECTORCALL
+  ca.nargsf = (size_t)ca.nargs;
+  ca.kwnames = NULL;
+#endif
+  return cache_await(co, cache_call_args(co, &ca));
+}
+
+
+#ifdef _FC_VECTORCALL
+/* vectorcall entry point - no argument tuple or keyword dict is built */
+static PyObject *
+cache_vectorcall(cacheobject *co, PyObject *const *args, size_t nargsf,
+                 PyObject *kwnames)
+{
+  callargs ca;
+
+  ca.stack = args;
+  ca.nargs = PyVectorcall_NARGS(nargsf);
+  ca.args = NULL;
+  ca.kw = NULL;
+  ca.nargsf = nargsf;
+  ca.kwnames = (kwnames && PyTuple_GET_SIZE(kwnames)) ? kwnames : NULL;
+  return cache_await(co, cache_call_args(co, &ca));
+}
+#endif
+
+
+PyDoc_STRVAR(cacheclear__doc__,
+"cache_clear(self)\n\
+\n\
+Clear the cache and cache statistics.  The old entries are released\n\
+before it returns, but outside of the cache locks, so other calls to the\n\
+cache do not wait for a large cache to be cleared.");
+static PyObject *
+cache_clear(PyObject *self)
+{
+  cacheobject *co = (cacheobject *)self;
+  Py_ssize_t n;
+  htable old;
+
+  for(n = 0; n < co->nshards; n++){
+    cacheshard *sh = &co->shards[n];
+    // swap in an empty table under the lock, release the old entries after
+    if(ACQUIRE_LOCK(sh) == -1)
+      return NULL;
+    old = sh->table;
+    // keep the room reserved by cache_resize
+    if(htable_init(&sh->table, htable_size_for(sh->reserved)) < 0){
+      sh->table = old;
+      RELEASE_LOCK(sh);
+      return NULL;
+    }
+    sh->hits = 0;
+    sh->misses = 0;
+    sh->evictions = sh->expirations = sh->duplicates = sh->contended = 0;
+    sh->collected = 0;
+    sh->table.eq_calls = 0;
+    memset(sh->miss_time, 0, sizeof(sh->miss_time));
+    sh->miss_seconds = 0;
+    fsketch_clear(&sh->sketch);
+    if(RELEASE_LOCK(sh) == -1){
+      htable_release_slots(old.slots, old.capacity);
+      return NULL;
+    }
+    htable_release_slots(old.slots, old.capacity);
+  }
+  FC_STORE(&co->misses, 0);
+  if (co->mrc != NULL){
+    MRC_LOCK(co->mrc);
+    mrc_reset(co->mrc, co->mrc_rate);
+    MRC_UNLOCK(co->mrc);
+  }
+  Py_RETURN_NONE;
+}
+
+
+PyDoc_STRVAR(cacheresize__doc__,
+"cache_resize(self, maxsize)\n\
+\n\
+Change the maximum number of entries, keeping the cached ones.  Growing\n\
+reserves table room for the new size up front, kept by cache_clear(), so\n\
+that later stores do not rehash, and shrinking evicts the entries over the new size in one\n\
+pass.  Only caches with a positive maxsize can be resized, and the new\n\
+size must be at least the number of shards.");
+static PyObject *
+cache_resize(PyObject *self, PyObject *arg)
+{
+  cacheobject *co = (cacheobject *)self;
+  Py_ssize_t maxsize, n, used;
+  garbage g;
+  fsketch fs;
+
+  maxsize = PyNumber_AsSsize_t(arg, PyExc_OverflowError);
+  if (maxsize == -1 && PyErr_Occurred())
+    return NULL;
+  // unbounded caches keep no LRU order to evict by
+  if (co->maxsize <= 0){
+    PyErr_SetString(PyExc_ValueError,
+                    "Only caches with a positive maxsize can be resized.");
+    return NULL;
+  }
+  if (maxsize < co->nshards){
+    PyErr_Format(PyExc_ValueError,
+                 "Argument <maxsize> must be at least the number of "
+                 "shards (%zd).", co->nshards);
+    return NULL;
+  }
+
+  for(n = 0; n < co->nshards; n++){
+    cacheshard *sh = &co->shards[n];
+    htable *t = &sh->table;
+    Py_ssize_t bound = maxsize / co->nshards + (n < maxsize % co->nshards);
+
+    // the sketch is sized for the bound, made before taking the lock
+    fs.table = NULL;
+    if (t->lfu && fsketch_init(&fs, bound) < 0)
+      return PyErr_NoMemory();
+    garbage_init(&g);
+    if (ACQUIRE_LOCK(sh) == -1){
+      PyMem_Free(fs.table);
+      return NULL;
+    }
+    if (bound > sh->maxsize && htable_reserve(t, bound) < 0){
+      RELEASE_LOCK(sh);
+      PyMem_Free(fs.table);
+      return NULL;
+    }
+    if (bound > sh->maxsize || sh->reserved > bound)
+      sh->reserved = bound;
+    sh->maxsize = bound;
+    if (t->lfu){
+      if (fs.mask == sh->sketch.mask)
+        // same number of counters, keep the frequencies seen so far
+        sh->sketch.sample = fs.sample;
+      else {
+        fsketch old = sh->sketch;
+        sh->sketch = fs;
+        fs = old;
+      }
+      shard_lfu_bounds(sh);
+      while (t->queued[HT_PROTECTED] > t->protected_max)
+        ht_requeue(t, t->slots[HT_QROOT(t, HT_PROTECTED)].prev,
+                   HT_PROBATION);
+    }
+    used = t->used;
+    while (t->used > 0 && SHARD_OVER(sh) && garbage_reserve(&g) == 0)
+      htable_remove_into(t, htable_victim(t), &g);
+    sh->evictions += used - t->used;
+    // window entries over the new bound move to probation
+    if (t->lfu)
+      shard_lfu_balance(sh, &g);
+    RELEASE_LOCK(sh);
+    garbage_release(&g);
+    PyMem_Free(fs.table);
+  }
+  co->maxsize = maxsize;
+  Py_RETURN_NONE;
+}
+
+
+PyDoc_STRVAR(cacheinfo__doc__,
+"cache_info(self)\n\
+\n\
+Report cache statistics.");
+static PyObject *
+cache_info(PyObject *self)
+{
+  cacheobject * co = (cacheobject *) self;
+  Py_ssize_t n, hits = 0, misses, currsize = 0, weight = 0;
+
+  misses = FC_LOAD(&co->misses);
+  for(n = 0; n < co->nshards; n++){
+    cacheshard *sh = &co->shards[n];
+    if(ACQUIRE_LOCK(sh) == -1)
+      return NULL;
+    hits += sh->hits;
+    misses += sh->misses;
+    currsize += sh->table.used;
+    weight += sh->table.weight;
+    if(RELEASE_LOCK(sh) == -1)
+      return NULL;
+  }
+  // weighted caches report their weight as well
+  if (co->maxweight > 0 && co->maxsize >= 0)
+    return PyObject_CallFunction(co->cinfo,"nnnnnn",hits,
+                                 misses, co->maxsize,
+                                 currsize, co->maxweight, weight);
+  else if (co->maxweight > 0)
+    return PyObject_CallFunction(co->cinfo,"nnOnnn",hits,
+                                 misses, Py_None,
+                                 currsize, co->maxweight, weight);
+  if (co->maxsize >= 0)
+    return PyObject_CallFunction(co->cinfo,"nnnn",hits,
+                                 misses, co->maxsize,
+                                 currsize);
+  else
+    return PyObject_CallFunction(co->cinfo,"nnOn",hits,
+                                 misses, Py_None,
+                                 currsize);
+}
+
+
+static int
+list_append_ssize(PyObject *list, Py_ssize_t v)
+{
+  PyObject *item = PyLong_FromSsize_t(v);
+  int r;
+
+  if (item == NULL)
+    return -1;
+  r = PyList_Append(list, item);
+  Py_DECREF(item);
+  return r;
+}
+
+
+PyDoc_STRVAR(cachemrc__doc__,
+"cache_mrc(self, sizes=None)\n\
+\n\
+Estimate the hit ratio an LRU cache of each of the given sizes would\n\
+have had on the calls since the cache was created or cleared.  Returns a\n\
+list of (size, hit_ratio) pairs.  The default sizes are the powers of two\n\
+up to twice the largest reuse distance seen, and maxsize.  Needs the mrc\n\
+option.");
+static PyObject *
+cache_mrc(PyObject *self, PyObject *args, PyObject *kw)
+{
+  static char *kwlist[] = {"sizes", NULL};
+  cacheobject *co = (cacheobject *)self;
+  PyObject *sizes = Py_None, *fast, *result, *item;
+  double hist[MRC_BUCKETS], cold, top = 1, sampled;
+  Py_ssize_t i, n, size, calls = 0;
+  int b, placed;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "|O:cache_mrc", kwlist, &sizes))
+    return NULL;
+  if (co->mrc == NULL){
+    PyErr_SetString(PyExc_ValueError,
+                    "cache_mrc() needs a cache created with the mrc option.");
+    return NULL;
+  }
+  for(i = 0; i < co->nshards; i++){
+    cacheshard *sh = &co->shards[i];
+    if(ACQUIRE_LOCK(sh) == -1)
+      return NULL;
+    calls += sh->hits + sh->misses;
+    if(RELEASE_LOCK(sh) == -1)
+      return NULL;
+  }
+  MRC_LOCK(co->mrc);
+  memcpy(hist, co->mrc->hist, sizeof(hist));
+  cold = co->mrc->cold;
+  MRC_UNLOCK(co->mrc);
+  /* The sample over or under represents the most used keys by chance.  As
+   * in SHARDS_adj the difference between the calls made and the calls the
+   * sample stands for is put at distance 0, where it matters least. */
+  for(sampled = cold, b = 0; b < MRC_BUCKETS; b++)
+    sampled += hist[b];
+  if (sampled > 0 && calls > 0 && hist[0] + calls - sampled >= 0)
+    hist[0] += calls - sampled;
+
+  if (sizes == Py_None){
+    // powers of two past the end of the last bucket used, and maxsize
+    for(b = MRC_BUCKETS - 1; b >= 0 && hist[b] == 0; b--);
+    if (b >= 0)
+      top = mrc_bucket_start(b + 1);
+    if ((sizes = PyList_New(0)) == NULL)
+      return NULL;
+    placed = co->maxsize <= 0;
+    for(size = 1; (!placed || size < 2 * top) && size <= PY_SSIZE_T_MAX / 2;
+        size *= 2){
+      // maxsize goes before the first power of two above it
+      if (!placed && co->maxsize <= size){
+        placed = 1;
+        if (co->maxsize < size && list_append_ssize(sizes, co->maxsize) < 0){
+          Py_DECREF(sizes);
+          return NULL;
+        }
+      }
+      if (list_append_ssize(sizes, size) < 0){
+        Py_DECREF(sizes);
+        return NULL;
+      }
+    }
+  }
+  else
+    Py_INCREF(sizes);
+  fast = PySequence_Fast(sizes, "sizes must be a sequence of ints");
+  Py_DECREF(sizes);
+  if (fast == NULL)
+    return NULL;
+  n = PySequence_Fast_GET_SIZE(fast);
+  if ((result = PyList_New(n)) == NULL){
+    Py_DECREF(fast);
+    return NULL;
+  }
+  for(i = 0; i < n; i++){
+    PyObject *s = PySequence_Fast_GET_ITEM(fast, i);
+    size = PyNumber_AsSsize_t(s, PyExc_OverflowError);
+    if ((size == -1 && PyErr_Occurred()) ||
+        (item = Py_BuildValue("(Od)", s, mrc_hit_ratio(hist, cold,
+                                                      (double)size))) == NULL){
+      Py_DECREF(result);
+      Py_DECREF(fast);
+      return NULL;
+    }
+    PyList_SET_ITEM(result, i, item);
+  }
+  Py_DECREF(fast);
+  return result;
+}
+
+
+PyDoc_STRVAR(cachestats__doc__,
+"cache_stats(self)\n\
+\n\
+Report detailed cache statistics as a dict.  Besides the fields of\n\
+cache_info() it holds the number of evictions and expirations, eq_calls\n\
+for keys compared after their hashes matched, duplicates for computed\n\
+results dropped since another call stored the key first, collected for\n\
+entries dropped as their weakly held key or result died and contended\n\
+for lock acquisitions that had to wait.  miss_time is a histogram of the\n\
+time taken by calls computing a missing result: entry 0 counts calls\n\
+under 1 microsecond, entry i calls under 2**i microseconds and the last\n\
+entry all longer calls.  miss_seconds is the total time of these calls.");
+static PyObject *
+cache_stats(PyObject *self)
+{
+  cacheobject *co = (cacheobject *)self;
+  Py_ssize_t n, b, hits = 0, misses, currsize = 0, weight = 0;
+  Py_ssize_t evictions = 0, expirations = 0, eq_calls = 0, duplicates = 0;
+  Py_ssize_t collected = 0, contended = 0, miss_time[FC_TIME_BUCKETS];
+  double miss_seconds = 0;
+  PyObject *d, *hist;
+
+  memset(miss_time, 0, sizeof(miss_time));
+  misses = FC_LOAD(&co->misses);
+  for(n = 0; n < co->nshards; n++){
+    cacheshard *sh = &co->shards[n];
+    if(ACQUIRE_LOCK(sh) == -1)
+      return NULL;
+    hits += sh->hits;
+    misses += sh->misses;
+    currsize += sh->table.used;
+    weight += sh->table.weight;
+    evictions += sh->evictions;
+    expirations += sh->expirations;
+    eq_calls += sh->table.eq_calls;
+    duplicates += sh->duplicates;
+    collected += sh->collected;
+    contended += sh->contended;
+    for(b = 0; b < FC_TIME_BUCKETS; b++)
+      miss_time[b] += sh->miss_time[b];
+    miss_seconds += sh->miss_seconds;
+    if(RELEASE_LOCK(sh) == -1)
+      return NULL;
+  }
+  if ((hist = PyTuple_New(FC_TIME_BUCKETS)) == NULL)
+    return NULL;
+  for(b = 0; b < FC_TIME_BUCKETS; b++){
+    PyObject *v = PyLong_FromSsize_t(miss_time[b]);
+    if (v == NULL){
+      Py_DECREF(hist);
+      return NULL;
+    }
+    PyTuple_SET_ITEM(hist, b, v);
+  }
+  d = Py_BuildValue("{sn,sn,sn,sn,sn,sn,sn,sn,sn,sn,sN,sd}",
+                    "hits", hits, "misses", misses, "maxsize", co->maxsize,
+                    "currsize", currsize, "evictions", evictions,
+                    "expirations", expirations, "eq_calls", eq_calls,
+                    "duplicates", duplicates, "collected", collected,
+                    "contended", contended,
+                    "miss_time", hist, "miss_seconds", miss_seconds);
+  if (d != NULL && co->maxsize < 0 &&
+      PyDict_SetItemString(d, "maxsize", Py_None) < 0)
+    Py_CLEAR(d);
+  // weighted caches report their weight as well, like cache_info
+  if (d != NULL && co->maxweight > 0){
+    PyObject *mw = PyLong_FromSsize_t(co->maxweight);
+    PyObject *cw = PyLong_FromSsize_t(weight);
+    if (mw == NULL || cw == NULL ||
+        PyDict_SetItemString(d, "maxweight", mw) < 0 ||
+        PyDict_SetItemString(d, "currweight", cw) < 0)
+      Py_CLEAR(d);
+    Py_XDECREF(mw);
+    Py_XDECREF(cw);
+  }
+  return d;
+}
+
+
+/***********************************************************
+ batched calls
+************************************************************/
+/* cache_map and cache_get_many handle a whole batch of calls with one lock
+ * acquisition per shard for the lookups and one for the inserts.  The keys
+ * are built first, outside of any lock.  The items are then visited shard
+ * by shard in a stable order, so that an item always follows the earlier
+ * items of the batch with an equal key.  A key missing more than once is
+ * computed once and the repeats count as hits.  Batches do not join or
+ * register single_flight flights. */
+typedef struct {
+  PyObject *args;         // argument tuple (borrowed from the batch)
+  PyObject *key;          // stored key, NULL to bypass the cache
+  Py_hash_t hash;
+  PyObject *result;       // NULL until known
+  Py_ssize_t src;         // the item computing the result of this key
+  int computed;           // 1 if computed by this batch, 2 if shared
+  double elapsed;         // seconds spent computing the result
+  double now;
+  Py_ssize_t weight;
+  PyObject *stored[2];    // key and result to store in a weak cache
+} batchitem;
+
+
+/* set up ca for calling with the argument tuple args */
+static void
+batch_callargs(PyObject *args, callargs *ca)
+{
+  ca->stack = ((PyTupleObject *)args)->ob_item;
+  ca->nargs = PyTuple_GET_SIZE(args);
+  ca->args = args;
+  ca->kw = NULL;
+#ifdef _FC_VECTORCALL
+  ca->nargsf = (size_t)ca->nargs;
+  ca->kwnames = NULL;
+#endif
+}
+
+
+/* Compute the results of the items that need one, through loader if it is
+ * not NULL.  The loader gets a list of the argument tuples, or of their
+ * only item if single is set.  Returns -1 with an exception set on
+ * failure. */
+static int
+batch_compute(cacheobject *co, batchitem *items, Py_ssize_t n,
+              PyObject *loader, int single)
+{
+  PyObject *missing, *loaded, *fast;
+  callargs ca;
+  Py_ssize_t i, j;
+  int shared_hit;
+  double elapsed;
+
+  if (loader == NULL){
+    for(i = 0; i < n; i++){
+      if (items[i].result != NULL || items[i].src != i)
+        continue;
+      batch_callargs(items[i].args, &ca);
+      elapsed = perf_time();
+      items[i].result = cache_compute(co, &ca, items[i].key, &shared_hit);
+      if (items[i].result == NULL)
+        return -1;
+      items[i].elapsed = perf_time() - elapsed;
+      items[i].computed = 1 + shared_hit;
+    }
+    return 0;
+  }
+  // only load what no other process published
+  for(i = 0; CACHE_SHARED(co) && i < n; i++){
+    if (items[i].result == NULL && items[i].src == i &&
+        (items[i].result = cache_shared_get(co, items[i].key)) != NULL)
+      items[i].computed = 2;
+  }
+  if ((missing = PyList_New(0)) == NULL)
+    return -1;
+  for(i = 0; i < n; i++){
+    if (items[i].result == NULL && items[i].src == i &&
+        PyList_Append(missing, single ? PyTuple_GET_ITEM(items[i].args, 0) :
+                      items[i].args) < 0){
+      Py_DECREF(missing);
+      return -1;
+    }
+  }
+  if (PyList_GET_SIZE(missing) == 0){
+    Py_DECREF(missing);
+    return 0;
+  }
+  elapsed = perf_time();
+  loaded = PyObject_CallFunctionObjArgs(loader, missing, NULL);
+  // every result is timed at its share of the loader call
+  elapsed = (perf_time() - elapsed) / PyList_GET_SIZE(missing);
+  if (loaded == NULL){
+    Py_DECREF(missing);
+    return -1;
+  }
+  fast = PySequence_Fast(loaded, "loader must return a sequence");
+  Py_DECREF(loaded);
+  if (fast == NULL){
+    Py_DECREF(missing);
+    return -1;
+  }
+  if (PySequence_Fast_GET_SIZE(fast) != PyList_GET_SIZE(missing)){
+    PyErr_Format(PyExc_ValueError,
+                 "loader returned %zd results for %zd calls",
+                 PySequence_Fast_GET_SIZE(fast), PyList_GET_SIZE(missing));
+    Py_DECREF(fast);
+    Py_DECREF(missing);
+    return -1;
+  }
+  for(i = j = 0; i < n; i++){
+    if (items[i].result == NULL && items[i].src == i){
+      items[i].result = PySequence_Fast_GET_ITEM(fast, j++);
+      Py_INCREF(items[i].result);
+      items[i].computed = 1;
+      items[i].elapsed = elapsed;
+      cache_shared_put(co, items[i].key, items[i].result);
+    }
+  }
+  Py_DECREF(fast);
+  Py_DECREF(missing);
+  return 0;
+}
+
+
+/* Sort the indices of the items with a key by shard into order, keeping
+ * the batch order within each shard.  start[s] is set to the first
+ * position of shard s and the number of sorted items is returned. */
+static Py_ssize_t
+batch_sort(cacheobject *co, batchitem *items, Py_ssize_t n, Py_ssize_t *order,
+           Py_ssize_t *start)
+{
+  Py_ssize_t i, s, nkeyed;
+
+  memset(start, 0, co->nshards * sizeof(Py_ssize_t));
+  for(i = 0; i < n; i++){
+    if (items[i].key != NULL)
+      start[SHARD_OF(co, items[i].hash) - co->shards]++;
+  }
+  for(s = 1; s < co->nshards; s++)
+    start[s] += start[s - 1];
+  nkeyed = start[co->nshards - 1];
+  for(i = n - 1; i >= 0; i--){
+    if (items[i].key != NULL)
+      order[--start[SHARD_OF(co, items[i].hash) - co->shards]] = i;
+  }
+  return nkeyed;
+}
+
+
+/* Store the computed results of the sorted items with one lock acquisition
+ * per shard.  Keys already in the cache keep their entry.  Repeats of a
+ * missing key get the result of its first item.  With stats, stored items
+ * count as misses and the others as hits.  Returns -1 with an exception
+ * set on failure. */
+static int
+batch_store(cacheobject *co, batchitem *items, Py_ssize_t *order,
+            Py_ssize_t *start, Py_ssize_t nkeyed, int stats)
+{
+  Py_ssize_t s, k, n;
+  cacheshard *sh;
+  probekey pk;
+  hindex idx;
+  garbage g;
+  int found, err;
+
+  pk.items = NULL;
+  pk.size = 0;
+  for(s = 0; s < co->nshards; s++){
+    Py_ssize_t e = s + 1 < co->nshards ? start[s + 1] : nkeyed;
+    if (start[s] == e)
+      continue;
+    sh = &co->shards[s];
+    garbage_init(&g);
+    if (ACQUIRE_LOCK(sh) == -1)
+      return -1;
+    // grow the table once for the whole batch
+    n = sh->table.used + e - start[s];
+    if (sh->maxsize > 0 && n > sh->maxsize + 1)
+      n = sh->maxsize + 1;
+    err = htable_reserve(&sh->table, n) < 0;
+    for(k = start[s]; k < e && !err; k++){
+      batchitem *it = &items[order[k]];
+      if (it->src != order[k]){
+        // a repeat of a missing key, its first item came before it
+        it->result = items[it->src].result;
+        Py_INCREF(it->result);
+        sh->hits += stats;
+        continue;
+      }
+      if (!it->computed)
+        continue;
+      if (stats && it->computed == 1)
+        shard_time_miss(sh, it->elapsed);
+      pk.hash = it->hash;
+      pk.obj = it->key;
+      // another thread may have stored the key in the meantime
+      found = shard_lookup(sh, &pk, &idx, it->now, &g);
+      if (found > 0){
+        sh->hits += stats;
+        sh->duplicates += stats && it->computed == 1;
+      }
+      else if (found < 0 ||
+               shard_store(sh, it->hash,
+                           it->stored[0] ? it->stored[0] : it->key,
+                           it->stored[1] ? it->stored[1] : it->result,
+                           it->weight, it->now, &g) < 0)
+        err = 1;
+      else if (it->computed == 2)
+        sh->hits += stats;    // from the shared tier
+      else
+        sh->misses += stats;
+    }
+    if (RELEASE_LOCK(sh) == -1)
+      err = 1;
+    garbage_release(&g);
+    if (err)
+      return -1;
+  }
+  return 0;
+}
+
+
+/* Results of calling the cached function with each argument tuple of the
+ * list batch, as a new list.  See batch_compute for loader and single. */
+static PyObject *
+cache_batch(cacheobject *co, PyObject *batch, PyObject *loader, int single)
+{
+  Py_ssize_t n = PyList_GET_SIZE(batch), i, k, s;
+  batchitem *items;
+  Py_ssize_t *order = NULL, *start = NULL, nkeyed;
+  PyObject *pending = NULL, *out = NULL;
+  cacheshard *sh;
+  probekey pk;
+  callargs ca;
+  hindex idx;
+  garbage g;
+  int found, err;
+
+  if ((items = PyMem_New(batchitem, n + 1)) == NULL ||
+      (order = PyMem_New(Py_ssize_t, n + 1)) == NULL ||
+      (start = PyMem_New(Py_ssize_t, co->nshards)) == NULL){
+    PyErr_NoMemory();
+    goto done;
+  }
+  memset(items, 0, (n + 1) * sizeof(batchitem));
+  pk.items = NULL;
+  pk.size = 0;
+
+  // keys, hashing may run Python code so no lock is held
+  for(i = 0; i < n; i++){
+    batchitem *it = &items[i];
+    it->args = PyList_GET_ITEM(batch, i);
+    it->src = i;
+    if (co->maxsize == 0)
+      continue;
+    batch_callargs(it->args, &ca);
+    if (co->weak_keys){
+      // calls that cannot be keyed weakly are made without caching
+      if ((found = weak_key(co, &ca, &pk)) < 0)
+        goto done;
+      if (found){
+        it->key = pk.obj;
+        Py_INCREF(it->key);
+        it->hash = pk.hash;
+      }
+    }
+    else if (fast_key(co, &ca, &pk)){
+      if ((it->key = probe_key_object(&pk)) == NULL)
+        goto done;
+      it->hash = pk.hash;
+    }
+    else {
+      if ((it->key = make_key(co, &ca, &it->hash)) == NULL)
+        goto done;
+      if (it->hash == -1)
+        Py_CLEAR(it->key);    // unhashable, call without caching
+    }
+    if (co->mrc != NULL && it->key != NULL)
+      mrc_access(co->mrc, it->hash);
+  }
+  nkeyed = batch_sort(co, items, n, order, start);
+
+  // look up every key with one lock acquisition per shard
+  for(s = 0; s < co->nshards; s++){
+    Py_ssize_t e = s + 1 < co->nshards ? start[s + 1] : nkeyed;
+    double now = 0;
+    if (start[s] == e)
+      continue;
+    sh = &co->shards[s];
+    if (sh->table.timers != NULL && cache_now(co, &now) < 0)
+      goto done;
+    garbage_init(&g);
+    if (ACQUIRE_LOCK(sh) == -1)
+      goto done;
+    err = 0;
+    for(k = start[s]; k < e && !err; k++){
+      batchitem *it = &items[order[k]];
+      pk.hash = it->hash;
+      pk.obj = it->key;
+      found = shard_lookup(sh, &pk, &idx, now, &g);
+      if (found < 0)
+        err = 1;
+      else {
+        if (sh->table.lfu)
+          fsketch_increment(&sh->sketch, pk.hash);
+        if (found)
+          it->result = cache_hit(sh, idx, now);
+      }
+    }
+    if (RELEASE_LOCK(sh) == -1)
+      err = 1;
+    garbage_release(&g);
+    if (err)
+      goto done;
+  }
+
+  // a key missing more than once is computed by its first item
+  if ((pending = PyDict_New()) == NULL)
+    goto done;
+  for(i = 0; i < n; i++){
+    batchitem *it = &items[i];
+    PyObject *src;
+    if (it->key == NULL || it->result != NULL)
+      continue;
+    if ((found = PyDict_Contains(pending, it->key)) < 0)
+      goto done;
+    if (found)
+      it->src = PyLong_AsSsize_t(PyDict_GetItem(pending, it->key));
+    else if ((src = PyLong_FromSsize_t(i)) == NULL)
+      goto done;
+    else {
+      found = PyDict_SetItem(pending, it->key, src);
+      Py_DECREF(src);
+      if (found < 0)
+        goto done;
+    }
+  }
+
+  if (batch_compute(co, items, n, loader, single) < 0)
+    goto done;
+  for(i = 0; i < n; i++){
+    batchitem *it = &items[i];
+    if (!it->computed)
+      continue;
+    if (it->key == NULL){
+      FC_STAT_INC(co, misses);
+      continue;
+    }
+    sh = SHARD_OF(co, it->hash);
+    // a coroutine is stored as a call that every caller can await
+    if (co->async_call &&
+        cache_share_call(co, it->key, it->hash, &it->result) < 0)
+      goto done;
+    if (cache_prepare_store(co, sh, it->result, &it->now, &it->weight) < 0)
+      goto done;
+    if (co->weak_callback != NULL){
+      if ((found = cache_weaken(co, it->hash, it->key, it->result,
+                                it->stored)) < 0)
+        goto done;
+      if (!found){
+        it->computed = 0;
+        FC_STAT_INC(co, misses);
+      }
+    }
+  }
+
+  if (batch_store(co, items, order, start, nkeyed, 1) < 0)
+    goto done;
+
+  if ((out = PyList_New(n)) == NULL)
+    goto done;
+  for(i = 0; i < n; i++){
+    PyObject *r = items[i].result;
+    Py_INCREF(r);
+    if ((r = cache_await(co, r)) == NULL){
+      Py_CLEAR(out);
+      break;
+    }
+    PyList_SET_ITEM(out, i, r);
+  }
+
+ done:
+  if (items != NULL){
+    for(i = 0; i < n; i++){
+      Py_XDECREF(items[i].key);
+      Py_XDECREF(items[i].result);
+      Py_XDECREF(items[i].stored[0]);
+      Py_XDECREF(items[i].stored[1]);
+    }
+  }
+  Py_XDECREF(pending);
+  PyMem_Free(items);
+  PyMem_Free(order);
+  PyMem_Free(start);
+  return out;
+}
+
+
+PyDoc_STRVAR(cachemap__doc__,
+"cache_map(self, iterable_of_args, loader=None)\n\
+\n\
+Return a list of the results of calling the cached function with each\n\
+tuple of positional arguments, like itertools.starmap.  The keys of the\n\
+whole batch are looked up, and the new results stored, with one lock\n\
+acquisition per shard.  Misses are computed by calling the function, or\n\
+with a single call loader(list_of_args) returning the results in order.\n\
+If a call raises, none of the new results are stored.");
+static PyObject *
+cache_map(PyObject *self, PyObject *args, PyObject *kw)
+{
+  PyObject *iterable, *loader = Py_None, *batch, *out;
+  static char *kwlist[] = {"iterable_of_args", "loader", NULL};
+  Py_ssize_t i;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "O|O:cache_map", kwlist,
+                                   &iterable, &loader))
+    return NULL;
+  if ((batch = PySequence_List(iterable)) == NULL)
+    return NULL;
+  for(i = 0; i < PyList_GET_SIZE(batch); i++){
+    if (!PyTuple_Check(PyList_GET_ITEM(batch, i))){
+      PyErr_SetString(PyExc_TypeError,
+                      "cache_map() needs an iterable of argument tuples");
+      Py_DECREF(batch);
+      return NULL;
+    }
+  }
+  out = cache_batch((cacheobject *)self, batch,
+                    loader == Py_None ? NULL : loader, 0);
+  Py_DECREF(batch);
+  return out;
+}
+
+
+PyDoc_STRVAR(cachegetmany__doc__,
+"cache_get_many(self, keys, loader=None)\n\
+\n\
+Return a dict mapping each key to the result of calling the cached\n\
+function with it as the only argument, batched like cache_map.  The\n\
+loader, if given, is called with a list of the missing keys.");
+static PyObject *
+cache_get_many(PyObject *self, PyObject *args, PyObject *kw)
+{
+  PyObject *keys, *loader = Py_None, *batch, *results, *out = NULL;
+  static char *kwlist[] = {"keys", "loader", NULL};
+  Py_ssize_t i;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "O|O:cache_get_many", kwlist,
+                                   &keys, &loader))
+    return NULL;
+  if ((batch = PySequence_List(keys)) == NULL)
+    return NULL;
+  for(i = 0; i < PyList_GET_SIZE(batch); i++){
+    PyObject *t = PyTuple_Pack(1, PyList_GET_ITEM(batch, i));
+    if (t == NULL){
+      Py_DECREF(batch);
+      return NULL;
+    }
+    PyList_SetItem(batch, i, t);
+  }
+  results = cache_batch((cacheobject *)self, batch,
+                        loader == Py_None ? NULL : loader, 1);
+  if (results != NULL && (out = PyDict_New()) != NULL){
+    for(i = 0; i < PyList_GET_SIZE(batch); i++){
+      if (PyDict_SetItem(out, PyTuple_GET_ITEM(PyList_GET_ITEM(batch, i), 0),
+                         PyList_GET_ITEM(results, i)) < 0){
+        Py_CLEAR(out);
+        break;
+      }
+    }
+  }
+  Py_XDECREF(results);
+  Py_DECREF(batch);
+  return out;
+}
+
+/***********************************************************
+ dump and load
+************************************************************/
+/* cache_dump writes the entries of a cache to a file that cache_load reads
+ * back, e.g. to start a new process with a warm cache.  All integers are
+ * little endian.  The file starts with
+ *
+ *   magic        8 bytes, FC_DUMP_MAGIC
+ *   version      u32, FC_DUMP_VERSION
+ *   identity     u32 length and UTF-8 bytes of module.qualname
+ *   dumped_at    i64 wall clock time of the dump in microseconds
+ *   count        u64 number of entries
+ *
+ * followed by the entries of each shard from the least to the most
+ * recently used one, in blocks of up to FC_DUMP_BLOCK entries so that the
+ * serializer is called twice per block rather than per entry:
+ *
+ *   n            u32 number of entries in the block
+ *   keys size    u32
+ *   values size  u32
+ *   kinds        n u8, 1 if the key is a tuple of arguments
+ *   ages         n i64 microseconds since the entry was stored, -1 if unknown
+ *   keys         the serialized list of the n keys
+ *   values       the serialized list of the n results
+ *
+ * Hashes are not stored, since str hashes differ between processes. */
+#define FC_DUMP_MAGIC "FCDUMP\r\n"
+#define FC_DUMP_VERSION 1
+#define FC_DUMP_HEADER 32     // fixed part of the header
+#define FC_DUMP_BLOCK 4096
+#define FC_DUMP_ENTRY 9       // kind and age of an entry
+
+static void
+put_u32(unsigned char *p, uint32_t v)
+{
+  int i;
+  for(i = 0; i < 4; i++)
+    p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void
+put_u64(unsigned char *p, uint64_t v)
+{
+  int i;
+  for(i = 0; i < 8; i++)
+    p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint32_t
+get_u32(const unsigned char *p)
+{
+  uint32_t v = 0;
+  int i;
+  for(i = 3; i >= 0; i--)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+static uint64_t
+get_u64(const unsigned char *p)
+{
+  uint64_t v = 0;
+  int i;
+  for(i = 7; i >= 0; i--)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+
+/* wall clock time in microseconds, -1 with an exception set on failure */
+static PY_LONG_LONG
+wall_time_us(void)
+{
+  PyObject *mod = PyImport_ImportModule("time"), *t;
+  double d;
+
+  if (mod == NULL)
+    return -1;
+  t = PyObject_CallMethod(mod, "time", NULL);
+  Py_DECREF(mod);
+  if (t == NULL)
+    return -1;
+  d = PyFloat_AsDouble(t);
+  Py_DECREF(t);
+  if (d == -1.0 && PyErr_Occurred())
+    return -1;
+  return (PY_LONG_LONG)(d * 1e6);
+}
+
+
+/* Output to a file object, buffered to keep the write calls few */
+#define FC_DUMP_BUFFER 65536
+
+typedef struct {
+  PyObject *write;
+  Py_ssize_t len;
+  unsigned char buf[FC_DUMP_BUFFER];
+} dumpwriter;
+
+
+static int
+dw_flush(dumpwriter *w)
+{
+  PyObject *b, *r;
+
+  if (w->len == 0)
+    return 0;
+  if ((b = PyBytes_FromStringAndSize((char *)w->buf, w->len)) == NULL)
+    return -1;
+  w->len = 0;
+  r = PyObject_CallFunctionObjArgs(w->write, b, NULL);
+  Py_DECREF(b);
+  Py_XDECREF(r);
+  return r != NULL ? 0 : -1;
+}
+
+
+static int
+dw_write(dumpwriter *w, const void *p, Py_ssize_t n)
+{
+  PyObject *b, *r;
+
+  if (w->len + n <= FC_DUMP_BUFFER){
+    memcpy(w->buf + w->len, p, n);
+    w->len += n;
+    return 0;
+  }
+  if (dw_flush(w) < 0)
+    return -1;
+  if (n <= FC_DUMP_BUFFER)
+    return dw_write(w, p, n);
+  if ((b = PyBytes_FromStringAndSize((const char *)p, n)) == NULL)
+    return -1;
+  r = PyObject_CallFunctionObjArgs(w->write, b, NULL);
+  Py_DECREF(b);
+  Py_XDECREF(r);
+  return r != NULL ? 0 : -1;
+}
+
+
+/* write a block of the m entries at items */
+static int
+dump_block(dumpwriter *w, PyObject *dumps, int proto, batchitem *items,
+           Py_ssize_t m)
+{
+  PyObject *keys, *values, *kb = NULL, *vb = NULL;
+  unsigned char head[12], entry[8];
+  Py_ssize_t j;
+  int err = -1;
+
+  keys = PyList_New(m);
+  values = PyList_New(m);
+  if (keys == NULL || values == NULL)
+    goto done;
+  for(j = 0; j < m; j++){
+    PyObject *key = items[j].key;
+    Py_INCREF(key);
+    PyList_SET_ITEM(keys, j, key);
+    Py_INCREF(items[j].result);
+    PyList_SET_ITEM(values, j, items[j].result);
+  }
+  if ((kb = dump_object(dumps, proto, keys)) == NULL ||
+      (vb = dump_object(dumps, proto, values)) == NULL)
+    goto done;
+  put_u32(head, (uint32_t)m);
+  put_u32(head + 4, (uint32_t)PyBytes_GET_SIZE(kb));
+  put_u32(head + 8, (uint32_t)PyBytes_GET_SIZE(vb));
+  if (dw_write(w, head, 12) < 0)
+    goto done;
+  for(j = 0; j < m; j++){
+    entry[0] = PyTuple_CheckExact(items[j].key);
+    if (dw_write(w, entry, 1) < 0)
+      goto done;
+  }
+  for(j = 0; j < m; j++){
+    put_u64(entry, (uint64_t)(items[j].now < 0 ? -1 :
+                              (PY_LONG_LONG)(items[j].now * 1e6)));
+    if (dw_write(w, entry, 8) < 0)
+      goto done;
+  }
+  if (dw_write(w, PyBytes_AS_STRING(kb), PyBytes_GET_SIZE(kb)) < 0 ||
+      dw_write(w, PyBytes_AS_STRING(vb), PyBytes_GET_SIZE(vb)) < 0)
+    goto done;
+  err = 0;
+
+ done:
+  Py_XDECREF(keys);
+  Py_XDECREF(values);
+  Py_XDECREF(kb);
+  Py_XDECREF(vb);
+  return err;
+}
+
+
+/* Copy the live entries of every shard, from least to most recently used,
+ * into a new array of items with the age of each entry in now. */
+static batchitem *
+cache_snapshot(cacheobject *co, Py_ssize_t *count)
+{
+  batchitem *items = NULL, *tmp;
+  Py_ssize_t n = 0, allocated = 0, s;
+  int q;
+
+  for(s = 0; s < co->nshards; s++){
+    cacheshard *sh = &co->shards[s];
+    htable *t = &sh->table;
+    double now = 0;
+    if (t->timers != NULL && cache_now(co, &now) < 0)
+      goto error;
+    if (ACQUIRE_LOCK(sh) == -1)
+      goto error;
+    if (n + t->used > allocated){
+      allocated = n + t->used;
+      tmp = items;
+      if (PyMem_Resize(tmp, batchitem, allocated) == NULL){
+        RELEASE_LOCK(sh);
+        PyErr_NoMemory();
+        goto error;
+      }
+      items = tmp;
+    }
+    // the window comes last among the TinyLFU queues
+    for(q = HT_ROOTS(t) - 1; q >= 0; q--){
+      hindex root = HT_QROOT(t, q), i;
+      for(i = t->slots[root].prev; i != root; i = t->slots[i].prev){
+        if (HT_EXPIRED(t, i, now))
+          continue;
+        items[n].key = t->slots[i].key;
+        items[n].result = t->slots[i].result;
+        Py_INCREF(items[n].key);
+        Py_INCREF(items[n].result);
+        items[n].now = t->timers != NULL ? now - t->timers[i].written : -1;
+        n++;
+      }
+    }
+    if (RELEASE_LOCK(sh) == -1)
+      goto error;
+  }
+  *count = n;
+  return items;
+
+ error:
+  for(s = 0; s < n; s++){
+    Py_DECREF(items[s].key);
+    Py_DECREF(items[s].result);
+  }
+  PyMem_Free(items);
+  return NULL;
+}
+
+
+PyDoc_STRVAR(cachedump__doc__,
+"cache_dump(self, path, serializer=None)\n\
+\n\
+Write the cache entries to the file at path, for cache_load to read\n\
+back later, e.g. in a new process.  Keys and results are serialized with\n\
+serializer.dumps, an object like the pickle module which is the default.\n\
+Returns the number of entries written.");
+static PyObject *
+cache_dump(PyObject *self, PyObject *args, PyObject *kw)
+{
+  cacheobject *co = (cacheobject *)self;
+  PyObject *path, *serializer = Py_None, *dumps = NULL, *loads = NULL;
+  PyObject *mod, *file = NULL, *id = NULL, *r, *out = NULL;
+  static char *kwlist[] = {"path", "serializer", NULL};
+  dumpwriter *w = NULL;
+  batchitem *items = NULL;
+  unsigned char head[16];
+  Py_ssize_t n = 0, i;
+  PY_LONG_LONG dumped_at;
+  int proto;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "O|O:cache_dump", kwlist,
+                                   &path, &serializer))
+    return NULL;
+  // weakly held objects loaded back would be gone again at once
+  if (co->weak_callback != NULL){
+    PyErr_SetString(PyExc_TypeError,
+                    "A cache with weak keys or values cannot be dumped.");
+    return NULL;
+  }
+  if (dump_serializer(serializer, &dumps, &loads, &proto) < 0)
+    return NULL;
+  if ((id = cache_identity(co)) == NULL ||
+      (dumped_at = wall_time_us()) == -1 ||
+      (items = cache_snapshot(co, &n)) == NULL)
+    goto done;
+  if ((w = PyMem_New(dumpwriter, 1)) == NULL){
+    PyErr_NoMemory();
+    goto done;
+  }
+  w->len = 0;
+  w->write = NULL;
+  if ((mod = PyImport_ImportModule("io")) == NULL)
+    goto done;
+  file = PyObject_CallMethod(mod, "open", "Os", path, "wb");
+  Py_DECREF(mod);
+  if (file == NULL || (w->write = PyObject_GetAttrString(file, "write")) == NULL)
+    goto done;
+
+  memcpy(head, FC_DUMP_MAGIC, 8);
+  put_u32(head + 8, FC_DUMP_VERSION);
+  put_u32(head + 12, (uint32_t)PyBytes_GET_SIZE(id));
+  if (dw_write(w, head, 16) < 0 ||
+      dw_write(w, PyBytes_AS_STRING(id), PyBytes_GET_SIZE(id)) < 0)
+    goto done;
+  put_u64(head, (uint64_t)dumped_at);
+  put_u64(head + 8, (uint64_t)n);
+  if (dw_write(w, head, 16) < 0)
+    goto done;
+  for(i = 0; i < n; i += FC_DUMP_BLOCK){
+    Py_ssize_t m = n - i < FC_DUMP_BLOCK ? n - i : FC_DUMP_BLOCK;
+    if (dump_block(w, dumps, proto, items + i, m) < 0)
+      goto done;
+  }
+  if (dw_flush(w) < 0)
+    goto done;
+  out = PyLong_FromSsize_t(n);
+
+ done:
+  if (file != NULL){
+    // close the file in any case, keeping an earlier exception
+    PyObject *exc_type, *exc_value, *exc_tb;
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    r = PyObject_CallMethod(file, "close", NULL);
+    if (r == NULL && exc_type == NULL)
+      Py_CLEAR(out);
+    else if (exc_type != NULL)
+      PyErr_Restore(exc_type, exc_value, exc_tb);
+    Py_XDECREF(r);
+    Py_DECREF(file);
+  }
+  if (w != NULL){
+    Py_XDECREF(w->write);
+    PyMem_Free(w);
+  }
+  for(i = 0; i < n; i++){
+    Py_DECREF(items[i].key);
+    Py_DECREF(items[i].result);
+  }
+  PyMem_Free(items);
+  Py_XDECREF(id);
+  Py_XDECREF(dumps);
+  Py_XDECREF(loads);
+  return out;
+}
+
+
+/* deserialize the n bytes at p */
+static PyObject *
+load_object(PyObject *loads, const unsigned char *p, Py_ssize_t n)
+{
+  PyObject *b, *obj;
+
+#if PY_VERSION_HEX >= 0x03030000
+  // a view of the mapped file, nothing is copied
+  b = PyMemoryView_FromMemory((char *)p, n, PyBUF_READ);
+#else
+  b = PyBytes_FromStringAndSize((const char *)p, n);
+#endif
+  if (b == NULL)
+    return NULL;
+  obj = PyObject_CallFunctionObjArgs(loads, b, NULL);
+  Py_DECREF(b);
+  return obj;
+}
+
+
+/* Read the block of m entries at p into items, which then own their keys
+ * and results.  Returns -1 with an exception set on failure. */
+static int
+load_block(cacheobject *co, PyObject *loads, const unsigned char *p,
+           Py_ssize_t m, uint32_t klen, uint32_t vlen, batchitem *items,
+           Py_ssize_t base, double now, double elapsed)
+{
+  const unsigned char *kinds = p, *ages = p + m;
+  htable *t = &co->shards[0].table;
+  PyObject *keys, *values = NULL;
+  Py_ssize_t j;
+  int err = -1;
+
+  p += m * FC_DUMP_ENTRY;
+  if ((keys = load_object(loads, p, klen)) == NULL ||
+      (values = load_object(loads, p + klen, vlen)) == NULL)
+    goto done;
+  if (!PyList_Check(keys) || !PyList_Check(values) ||
+      PyList_GET_SIZE(keys) != m || PyList_GET_SIZE(values) != m){
+    PyErr_SetString(PyExc_ValueError, "corrupt cache dump");
+    goto done;
+  }
+  for(j = 0; j < m; j++){
+    batchitem *it = &items[j];
+    PyObject *key = PyList_GET_ITEM(keys, j);
+    PY_LONG_LONG age = (PY_LONG_LONG)get_u64(ages + 8 * j);
+
+    if (kinds[j] == 1){
+      // a tuple of arguments, hashed by its items
+      if (!PyTuple_CheckExact(key)){
+        PyErr_SetString(PyExc_ValueError, "corrupt cache dump");
+        goto done;
+      }
+      it->hash = hash_items(((PyTupleObject *)key)->ob_item,
+                            PyTuple_GET_SIZE(key));
+    }
+    else if (PyTuple_CheckExact(key)){
+      PyErr_SetString(PyExc_ValueError, "corrupt cache dump");
+      goto done;
+    }
+    else
+      it->hash = PyObject_Hash(key);
+    Py_INCREF(key);
+    it->key = key;
+    it->result = PyList_GET_ITEM(values, j);
+    Py_INCREF(it->result);
+    it->src = base + j;
+    it->computed = 1;
+    if (it->hash == -1)
+      goto done;
+    if (co->maxweight > 0 && cache_weigh(co, it->result, &it->weight) < 0)
+      goto done;
+    // keep the time the entry was stored, so that it expires on time
+    it->now = now - elapsed - (age > 0 ? age / 1e6 : 0);
+    if ((t->ttl_write > 0 && it->now + t->ttl_write <= now) ||
+        (t->ttl_access > 0 && it->now + t->ttl_access <= now))
+      Py_CLEAR(it->key);      // expired, do not store
+  }
+  err = 0;
+
+ done:
+  Py_XDECREF(keys);
+  Py_XDECREF(values);
+  return err;
+}
+
+
+/* Parse the size bytes of the dump at p into a new array of items ready to be stored.
+ * Returns NULL with an exception set on failure. */
+static batchitem *
+load_items(cacheobject *co, PyObject *loads, const unsigned char *p,
+           Py_ssize_t size, Py_ssize_t *count)
+{
+  const unsigned char *end = p + size;
+  PyObject *id;
+  batchitem *items;
+  uint32_t idlen;
+  uint64_t n;
+  Py_ssize_t i;
+  PY_LONG_LONG dumped_at, wall;
+  double elapsed, now = 0;
+  Py_ssize_t m;
+  int k;
+
+  if (size < 16 || memcmp(p, FC_DUMP_MAGIC, 8) != 0){
+    PyErr_SetString(PyExc_ValueError, "not a cache dump");
+    return NULL;
+  }
+  if (get_u32(p + 8) != FC_DUMP_VERSION){
+    PyErr_Format(PyExc_ValueError, "unsupported cache dump version %lu",
+                 (unsigned long)get_u32(p + 8));
+    return NULL;
+  }
+  idlen = get_u32(p + 12);
+  if ((uint64_t)(end - p) < (uint64_t)idlen + FC_DUMP_HEADER){
+    PyErr_SetString(PyExc_ValueError, "truncated cache dump");
+    return NULL;
+  }
+  // refuse the entries of another function
+  if ((id = cache_identity(co)) == NULL)
+    return NULL;
+  k = PyBytes_GET_SIZE(id) == (Py_ssize_t)idlen &&
+    memcmp(PyBytes_AS_STRING(id), p + 16, idlen) == 0;
+  if (!k){
+    PyObject *dumped = PyBytes_FromStringAndSize((const char *)p + 16, idlen);
+    if (dumped != NULL)
+      PyErr_Format(PyExc_ValueError, "cache dump of %.200s, not of %.200s",
+                   PyBytes_AS_STRING(dumped), PyBytes_AS_STRING(id));
+    Py_XDECREF(dumped);
+  }
+  Py_DECREF(id);
+  if (!k)
+    return NULL;
+  p += 16 + idlen;
+  dumped_at = (PY_LONG_LONG)get_u64(p);
+  n = get_u64(p + 8);
+  p += 16;
+  if (n > (uint64_t)(end - p) / FC_DUMP_ENTRY){
+    PyErr_SetString(PyExc_ValueError, "truncated cache dump");
+    return NULL;
+  }
+  if ((wall = wall_time_us()) == -1)
+    return NULL;
+  // time that passed between the dump and now, in seconds
+  elapsed = wall > dumped_at ? (wall - dumped_at) / 1e6 : 0;
+  if (co->shards[0].table.timers != NULL && cache_now(co, &now) < 0)
+    return NULL;
+  if ((items = PyMem_New(batchitem, (Py_ssize_t)n + 1)) == NULL){
+    PyErr_NoMemory();
+    return NULL;
+  }
+  memset(items, 0, ((Py_ssize_t)n + 1) * sizeof(batchitem));
+  for(i = 0; i < (Py_ssize_t)n; i += m){
+    uint32_t klen, vlen;
+    if (end - p < 12)
+      goto truncated;
+    m = get_u32(p);
+    klen = get_u32(p + 4);
+    vlen = get_u32(p + 8);
+    p += 12;
+    if (m == 0 || m > (Py_ssize_t)n - i ||
+        (uint64_t)(end - p) < (uint64_t)m * FC_DUMP_ENTRY + klen + vlen)
+      goto truncated;
+    if (load_block(co, loads, p, m, klen, vlen, items + i, i, now,
+                   elapsed) < 0)
+      goto error;
+    p += m * FC_DUMP_ENTRY + klen + vlen;
+  }
+  *count = (Py_ssize_t)n;
+  return items;
+
+ truncated:
+  PyErr_SetString(PyExc_ValueError, "truncated cache dump");
+ error:
+  for(i = 0; i < (Py_ssize_t)n; i++){
+    Py_XDECREF(items[i].key);
+    Py_XDECREF(items[i].result);
+  }
+  PyMem_Free(items);
+  return NULL;
+}
+
+
+PyDoc_STRVAR(cacheload__doc__,
+"cache_load(self, path, serializer=None)\n\
+\n\
+Read the entries written by cache_dump into the cache.  The dump must be\n\
+of a function with the same module and qualified name.  The file is\n\
+memory mapped and read in one pass, results are deserialized with\n\
+serializer.loads.  Keys already in the cache keep their entry, the least\n\
+recently used entries are evicted if they do not all fit, and entries\n\
+that expired since they were stored are skipped.  Returns the number of\n\
+entries read.");
+static PyObject *
+cache_load(PyObject *self, PyObject *args, PyObject *kw)
+{
+  cacheobject *co = (cacheobject *)self;
+  PyObject *path, *serializer = Py_None, *dumps = NULL, *loads = NULL;
+  PyObject *mod, *file = NULL, *map = NULL, *r, *out = NULL;
+  PyObject *fileno, *access, *mmap_fn, *mmap_args = NULL, *mmap_kw = NULL;
+  PyObject *exc_type, *exc_value, *exc_tb;
+  static char *kwlist[] = {"path", "serializer", NULL};
+  batchitem *items = NULL;
+  Py_ssize_t n = 0, i, *order = NULL, *start = NULL;
+  int proto;
+#ifdef _PY2
+  const void *buf;
+  Py_ssize_t size;
+#else
+  Py_buffer view;
+#endif
+
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "O|O:cache_load", kwlist,
+                                   &path, &serializer))
+    return NULL;
+  // weakly held objects loaded back would be gone again at once
+  if (co->weak_callback != NULL){
+    PyErr_SetString(PyExc_TypeError,
+                    "A cache with weak keys or values cannot be loaded.");
+    return NULL;
+  }
+  if (dump_serializer(serializer, &dumps, &loads, &proto) < 0)
+    return NULL;
+  if ((mod = PyImport_ImportModule("io")) == NULL)
+    goto done;
+  file = PyObject_CallMethod(mod, "open", "Os", path, "rb");
+  Py_DECREF(mod);
+  if (file == NULL || (mod = PyImport_ImportModule("mmap")) == NULL)
+    goto done;
+  // mmap.mmap(file.fileno(), 0, access=mmap.ACCESS_READ)
+  fileno = PyObject_CallMethod(file, "fileno", NULL);
+  access = PyObject_GetAttrString(mod, "ACCESS_READ");
+  mmap_fn = PyObject_GetAttrString(mod, "mmap");
+  Py_DECREF(mod);
+  if (fileno != NULL && access != NULL && mmap_fn != NULL &&
+      (mmap_args = Py_BuildValue("(Oi)", fileno, 0)) != NULL &&
+      (mmap_kw = Py_BuildValue("{sO}", "access", access)) != NULL)
+    map = PyObject_Call(mmap_fn, mmap_args, mmap_kw);
+  Py_XDECREF(fileno);
+  Py_XDECREF(access);
+  Py_XDECREF(mmap_fn);
+  Py_XDECREF(mmap_args);
+  Py_XDECREF(mmap_kw);
+  if (map == NULL)
+    goto done;
+#ifdef _PY2
+  if (PyObject_AsReadBuffer(map, &buf, &size) < 0)
+    goto done;
+  items = load_items(co, loads, (const unsigned char *)buf, size, &n);
+#else
+  if (PyObject_GetBuffer(map, &view, PyBUF_SIMPLE) < 0)
+    goto done;
+  items = load_items(co, loads, (const unsigned char *)view.buf, view.len,
+                     &n);
+  PyBuffer_Release(&view);
+#endif
+  if (items == NULL)
+    goto done;
+
+  // store the entries with one lock acquisition per shard
+  if ((order = PyMem_New(Py_ssize_t, n + 1)) == NULL ||
+      (start = PyMem_New(Py_ssize_t, co->nshards)) == NULL){
+    PyErr_NoMemory();
+    goto done;
+  }
+  if (co->maxsize != 0 &&
+      batch_store(co, items, order, start,
+                  batch_sort(co, items, n, order, start), 0) < 0)
+    goto done;
+  out = PyLong_FromSsize_t(n);
+
+ done:
+  // close the map and the file, keeping an earlier exception
+  PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+  if (map != NULL){
+    // fails if a serializer kept a view, the map then closes once freed
+    r = PyObject_CallMethod(map, "close", NULL);
+    Py_XDECREF(r);
+    Py_DECREF(map);
+  }
+  if (file != NULL){
+    r = PyObject_CallMethod(file, "close", NULL);
+    Py_XDECREF(r);
+    Py_DECREF(file);
+  }
+  PyErr_Clear();
+  PyErr_Restore(exc_type, exc_value, exc_tb);
+  if (items != NULL){
+    for(i = 0; i < n; i++){
+      Py_XDECREF(items[i].key);
+      Py_XDECREF(items[i].result);
+    }
+  }
+  PyMem_Free(items);
+  PyMem_Free(order);
+  PyMem_Free(start);
+  Py_XDECREF(dumps);
+  Py_XDECREF(loads);
+  return out;
+}
+
+
+/* The cache of a cached method pickles like a bound method, as the
+ * attribute of its instance, so that a copy of the instance gets a cache
+ * of its own.  Other caches cannot be pickled. */
+static PyObject *
+cache_reduce(PyObject *self)
+{
+  cacheobject *co = (cacheobject *)self;
+  PyObject *obj, *getattr, *r;
+
+  if (co->instance == NULL || co->method_name == NULL){
+    PyErr_Format(PyExc_TypeError, "cannot pickle '%.100s' object",
+                 Py_TYPE(self)->tp_name);
+    return NULL;
+  }
+  if ((obj = weak_deref(co->instance)) == NULL){
+    PyErr_SetString(PyExc_ReferenceError,
+                    "the instance of the cached method is gone");
+    return NULL;
+  }
+  getattr = PyDict_GetItemString(PyEval_GetBuiltins(), "getattr");
+  r = getattr != NULL ?
+    Py_BuildValue("O(OO)", getattr, obj, co->method_name) : NULL;
+  if (getattr == NULL && !PyErr_Occurred())
+    PyErr_SetString(PyExc_RuntimeError, "getattr() is missing");
+  Py_DECREF(obj);
+  return r;
+}
+
+
+static PyMethodDef cache_methods[] = {
+  {"cache_clear", (PyCFunction) cache_clear, METH_NOARGS,
+   cacheclear__doc__},
+  {"cache_info", (PyCFunction) cache_info, METH_NOARGS,
+   cacheinfo__doc__},
+  {"cache_resize", (PyCFunction) cache_resize, METH_O,
+   cacheresize__doc__},
+  {"cache_stats", (PyCFunction) cache_stats, METH_NOARGS,
+   cachestats__doc__},
+  {"cache_mrc", (PyCFunction) cache_mrc, METH_VARARGS | METH_KEYWORDS,
+   cachemrc__doc__},
+  {"cache_map", (PyCFunction) cache_map, METH_VARARGS | METH_KEYWORDS,
+   cachemap__doc__},
+  {"cache_get_many", (PyCFunction) cache_get_many,
+   METH_VARARGS | METH_KEYWORDS, cachegetmany__doc__},
+  {"cache_dump", (PyCFunction) cache_dump, METH_VARARGS | METH_KEYWORDS,
+   cachedump__doc__},
+  {"cache_load", (PyCFunction) cache_load, METH_VARARGS | METH_KEYWORDS,
+   cacheload__doc__},
+  {"__reduce__", (PyCFunction) cache_reduce, METH_NOARGS, NULL},
+  {NULL, NULL} /* sentinel */
+};
+
+
+PyDoc_STRVAR(fn_doc,
+             "Cached function.");
+
+
+static PyTypeObject cache_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "fastcache.clru_cache",                /* tp_name */
+    sizeof(cacheobject),                       /* tp_basicsize */
+    0,                                  /* tp_itemsize */
+    /* methods */
+    (destructor)cache_dealloc,            /* tp_dealloc */
+    0,                                  /* tp_print */
+    0,                                  /* tp_getattr */
+    0,                                  /* tp_setattr */
+    0,                                  /* tp_reserved */
+    0,                                  /* tp_repr */
+    0,                                  /* tp_as_number */
+    0,                                  /* tp_as_sequence */
+    0,                                  /* tp_as_mapping */
+    0,                                  /* tp_hash */
+    (ternaryfunc)cache_call,              /* tp_call */
+    0,                                  /* tp_str */
+    0,                                  /* tp_getattro */
+    0,                                  /* tp_setattro */
+    0,                                  /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,  /* tp_flags */
+    fn_doc,                                  /* tp_doc */
+    (traverseproc)cache_traverse,       /* tp_traverse */
+    (inquiry)cache_tp_clear,            /* tp_clear */
+    0,                                  /* tp_richcompare */
+    OFF(weakreflist),                   /* tp_weaklistoffset */
+    0,                                  /* tp_iter */
+    0,                                  /* tp_iternext */
+    cache_methods,                      /* tp_methods */
+    cache_memberlist,                   /* tp_members */
+    cache_getset,                       /* tp_getset */
+    0,                                  /* tp_base */
+    0,                                  /* tp_dict */
+    cache_descr_get,                    /* tp_descr_get */
+    0,                                  /* tp_descr_set */
+    OFF(func_dict),                     /* tp_dictoffset */
+    0,                                  /* tp_init */
+    0,                                  /* tp_alloc */
+    0,                                  /* tp_new */
+    0,                                  /* tp_free */
+};
+
+
+/***********************************************************
+ registry
+************************************************************/
+/* Every cache is registered with a weak reference, so that all_caches()
+ * finds them without keeping them alive.  References to caches that are
+ * gone are dropped whenever the list doubled since it was last pruned. */
+static PyObject *registry;          // list of weak references
+static Py_ssize_t registry_live;    // length after the last pruning
+#ifdef Py_GIL_DISABLED
+static PyMutex registry_mutex;
+#define REGISTRY_LOCK() PyMutex_Lock(&registry_mutex)
+#define REGISTRY_UNLOCK() PyMutex_Unlock(&registry_mutex)
+#else
+#define REGISTRY_LOCK()
+#define REGISTRY_UNLOCK()
+#endif
+
+
+/* Add co to the registry.  Returns -1 with an exception set on failure. */
+static int
+registry_add(cacheobject *co)
+{
+  PyObject *ref, *live = NULL, *old = NULL;
+  Py_ssize_t i;
+  int err = 0;
+
+  if ((ref = PyWeakref_NewRef((PyObject *)co, NULL)) == NULL)
+    return -1;
+  // allocate before locking, creating a list may run the collector
+  if (PyList_GET_SIZE(registry) >= 2 * registry_live + 16 &&
+      (live = PyList_New(0)) == NULL){
+    Py_DECREF(ref);
+    return -1;
+  }
+  REGISTRY_LOCK();
+  for(i = 0; live != NULL && i < PyList_GET_SIZE(registry) && !err; i++){
+    PyObject *r = PyList_GET_ITEM(registry, i), *c = weak_deref(r);
+    if (c != NULL){
+      err = PyList_Append(live, r) < 0;
+      Py_DECREF(c);
+    }
+  }
+  if (live != NULL && !err){
+    old = registry;
+    registry = live;
+    registry_live = PyList_GET_SIZE(live);
+    live = NULL;
+  }
+  if (!err)
+    err = PyList_Append(registry, ref) < 0;
+  REGISTRY_UNLOCK();
+  Py_DECREF(ref);
+  // the references to caches that are gone are released last
+  Py_XDECREF(live);
+  Py_XDECREF(old);
+  return err ? -1 : 0;
+}
+
+
+PyDoc_STRVAR(all_caches__doc__,
+"all_caches()\n\n"
+"Return a list of all live caches created by clru_cache (and lru_cache)\n"
+"in this process, oldest first.  Caches are registered with weak\n"
+"references, the registry does not keep them alive.");
+
+static PyObject *
+all_caches(PyObject *self)
+{
+  PyObject *result, *refs, *co;
+  Py_ssize_t i;
+
+  REGISTRY_LOCK();
+  refs = PyList_GetSlice(registry, 0, PY_SSIZE_T_MAX);
+  REGISTRY_UNLOCK();
+  if (refs == NULL || (result = PyList_New(0)) == NULL){
+    Py_XDECREF(refs);
+    return NULL;
+  }
+  for(i = 0; i < PyList_GET_SIZE(refs); i++){
+    if ((co = weak_deref(PyList_GET_ITEM(refs, i))) == NULL)
+      continue;
+    if (PyList_Append(result, co) < 0){
+      Py_DECREF(co);
+      Py_DECREF(result);
+      Py_DECREF(refs);
+      return NULL;
+    }
+    Py_DECREF(co);
+  }
+  Py_DECREF(refs);
+  return result;
+}
+
+
+/* lruobject -
+ * the callable object returned by lrucache(all, my, cache, args)
+ * [lrucache is known as clru_cache in python land]
+ * records arguments to clru_cache and passes them along to the
+ * cacheobject created when lruobject is called with a function
+ * as an argument */
+typedef struct {
+  PyObject_HEAD
+  Py_ssize_t maxsize;
+  PyObject *state;
+  int typed;
+  enum unhashable err;
+  int single_flight;
+  Py_ssize_t shards;
+  enum policy policy;
+  double ttl_write, ttl_access;
+  PyObject *clock;
+  Py_ssize_t maxweight;
+  PyObject *weigher;
+  int weigh_nbytes;
+  PyObject *shared;         // path of the shared tier, NULL for none
+  Py_ssize_t shared_size;
+  double mrc_rate;          // 0 without miss ratio curve
+  int weak_keys, weak_values;
+  int method;               // make a cached_method descriptor
+} lruobject;
+
+
+static void lru_dealloc(lruobject *lru)
+{
+  Py_CLEAR(lru->state);
+  Py_CLEAR(lru->clock);
+  Py_CLEAR(lru->weigher);
+  Py_CLEAR(lru->shared);
+  Py_TYPE(lru)->tp_free(lru);
+}
+
+
+static PyObject *
+get_func_attr(PyObject *fo, const char *name)
+{
+  if( !PyObject_HasAttrString(fo,name))
+    Py_RETURN_NONE;
+  else{
+    PyObject *attr = PyObject_GetAttrString(fo, name);
+    if (attr == NULL)
+      return NULL;
+    return attr;
+  }
+}
+
+
+/* A new cache of fo as configured by lru, tracked but not registered.
+ * The attributes of fo, the CacheInfo type and the coroutine check are
+ * taken from proto if it is not NULL, e.g. for the per-instance caches of
+ * a cached_method, so that making one costs no imports. */
+static cacheobject *
+cache_new(lruobject *lru, PyObject *fo, cacheobject *proto)
+{
+  PyObject *mod, *nt;
+  cacheobject *co;
+  Py_ssize_t n;
+
+  co = PyObject_GC_New(cacheobject, &cache_type);
+  if (co == NULL)
+    return NULL;
+  // clear everything after the object header so early failures can dealloc
+  memset((char *)co + sizeof(PyObject), 0,
+         sizeof(cacheobject) - sizeof(PyObject));
+
+  co->maxsize = lru->maxsize;
+  co->nshards = lru->shards;
+  // a bounded cache needs room for at least one entry per shard
+  while (co->maxsize >= 0 && co->nshards > 1 && co->nshards > co->maxsize)
+    co->nshards >>= 1;
+  co->shards = PyMem_New(cacheshard, co->nshards);
+  if (co->shards == NULL){
+    co->nshards = 0;
+    Py_DECREF(co);
+    PyErr_NoMemory();
+    return NULL;
+  }
+  memset(co->shards, 0, co->nshards * sizeof(cacheshard));
+  co->policy = lru->policy;
+  co->clock = lru->clock;
+  Py_XINCREF(co->clock);
+  co->maxweight = lru->maxweight;
+  co->weigher = lru->weigher;
+  Py_XINCREF(co->weigher);
+  co->weigh_nbytes = lru->weigh_nbytes;
+  for(n = 0; n < co->nshards; n++){
+    cacheshard *sh = &co->shards[n];
+    // split maxsize so that the shard bounds add up to it
+    if (co->maxsize > 0)
+      sh->maxsize = co->maxsize / co->nshards +
+        (n < co->maxsize % co->nshards);
+    else
+      sh->maxsize = co->maxsize;
+    if (lru->maxweight > 0)
+      sh->maxweight = lru->maxweight / co->nshards +
+        (n < lru->maxweight % co->nshards);
+    sh->table.weighted = lru->maxweight > 0;
+    sh->table.weak_values = lru->weak_values;
+    sh->table.clock = co->policy == FC_CLOCK && SHARD_BOUNDED(sh);
+    if (co->policy == FC_TINYLFU){
+      sh->table.lfu = 1;
+      shard_lfu_bounds(sh);
+      if (fsketch_init(&sh->sketch, sh->maxsize) < 0){
+        Py_DECREF(co);
+        PyErr_NoMemory();
+        return NULL;
+      }
+    }
+    sh->table.ttl_write = lru->ttl_write;
+    sh->table.ttl_access = lru->ttl_access;
+    // every deadline lies within one turn of the timer wheel
+    if (lru->ttl_write > 0 || lru->ttl_access > 0)
+      sh->table.tick = (lru->ttl_write > lru->ttl_access ?
+                        lru->ttl_write : lru->ttl_access) / (HT_WHEEL_SIZE - 1);
+#ifdef WITH_THREAD
+    if ((sh->lock = PyThread_allocate_lock()) == NULL){
+      Py_DECREF(co);
+      PyErr_NoMemory();
+      return NULL;
+    }
+#endif
+    if (htable_init(&sh->table, HT_MIN_CAPACITY) < 0){
+      Py_DECREF(co);
+      return NULL;
+    }
   }
 
-  return (PyObject *)hs;
-}
-
-
-/***********************************************************
- * All calls to the cached function go through cache_call
- * Handles: (1) Generation of key (via make_key)
- *          (2) Maintenance of circular doubly linked list
- *          (3) Actual updates to cache dictionary
- * THREAD SAFETY NOTES:
- * 1. The GIL may switch threads between all PyDict_Get/Set/DelItem
- *    If another thread were to call cache_clear while the dict was in
- *    an indetermined state, that could be very very bad.  Must lock all
- *    updates to cache_dict
- ***********************************************************/
-static PyObject *
-cache_call(cacheobject *co, PyObject *args, PyObject *kw)
-{
-  PyObject *key, *result, *link, *first;
-
-  /* no cache, just update stats and return */
-  if (co->maxsize == 0) {
-    co->misses++;
-    return PyObject_Call(co->fn, args, kw);
+  if (proto != NULL){
+    co->cinfo = proto->cinfo;
+    co->async_call = proto->async_call;
+    co->func_module = proto->func_module;
+    co->func_annotations = proto->func_annotations;
+    co->func_name = proto->func_name;
+    co->func_qualname = proto->func_qualname;
+    Py_XINCREF(co->cinfo);
+    Py_XINCREF(co->async_call);
+    Py_XINCREF(co->func_module);
+    Py_XINCREF(co->func_annotations);
+    Py_XINCREF(co->func_name);
+    Py_XINCREF(co->func_qualname);
+    co->fn = fo;
+    Py_INCREF(co->fn);
+    // attributes set on one instance's cache are its own
+    if (proto->func_dict != NULL && PyDict_Size(proto->func_dict) > 0 &&
+        (co->func_dict = PyDict_Copy(proto->func_dict)) == NULL){
+      Py_DECREF(co);
+      return NULL;
+    }
+    goto configured;
   }
 
-  // generate a key from hashing the arguments
-  // THREAD SAFETY NOTES:
-  // Computing the hash will result in many potential calls to __hash__
-  // methods, allowing the GIL to switch threads.  Thus it is possible that
-  // two threads have called this function with the exact same arguments
-  // and are constructing keys
-  key = make_key(co, args, kw);
-  if (!key)
+  // get namedtuple for cache_info()
+  mod = PyImport_ImportModule("collections");
+  if (mod == NULL){
+    Py_DECREF(co);
     return NULL;
-
-  /* check for unhashable type */
-  if ( ((HashedArgs *)key)->hashvalue == -1){
-    // no locking neccessary here
-    Py_DECREF(key);
-    co->misses++;
-    return PyObject_Call(co->fn, args, kw);
   }
-
-  /* For an unbounded cache, link is simply the result of the function call
-   * For an LRU cache, link is a pointer to a clist node */
-  if(ACQUIRE_LOCK(co) == -1){
-    Py_DECREF(key);
+  nt = PyObject_GetAttrString(mod, "namedtuple");
+  if (nt == NULL){
+    Py_DECREF(co);
     return NULL;
   }
-  link = PyDict_GetItem(co->cache_dict, key);
-  if(PyErr_Occurred()){
-    RELEASE_LOCK(co);
-    Py_XDECREF(link);
-    Py_DECREF(key);
+  co->cinfo = PyObject_CallFunction(nt,"ss","CacheInfo",
+                                    lru->maxweight > 0 ?
+                                    "hits misses maxsize currsize "
+                                    "maxweight currweight" :
+                                    "hits misses maxsize currsize");
+  if (co->cinfo == NULL){
+    Py_DECREF(co);
     return NULL;
   }
-  if(RELEASE_LOCK(co) == -1){
-    Py_XDECREF(link);
-    Py_DECREF(key);
+
+  if (async_detect(fo, &co->async_call) < 0){
+    Py_DECREF(co);
     return NULL;
   }
 
-  if (!link){
-    result = PyObject_Call(co->fn, args, kw); // result refcount is one
-    if(PyErr_Occurred() || !result){
-      Py_XDECREF(result);
-      Py_DECREF(key);
+  co->func_dict = get_func_attr(fo, "__dict__");
+
+  co->fn = fo; // __wrapped__
+  Py_INCREF(co->fn);
+
+  co->func_module = get_func_attr(fo, "__module__");
+  co->func_annotations = get_func_attr(fo, "__annotations__");
+  co->func_name = get_func_attr(fo, "__name__");
+  co->func_qualname = get_func_attr(fo, "__qualname__");
+
+#ifdef FC_SHARED
+  // results in the shared file are namespaced by the function's identity
+  if (lru->shared != NULL){
+    PyObject *id;
+    if (co->async_call != NULL){
+      PyErr_SetString(PyExc_ValueError,
+                      "A shared cache cannot hold coroutine results.");
+      Py_DECREF(co);
       return NULL;
     }
-    /* Unbounded cache, no clist maintenance, no locks needed */
-    if (co->maxsize < 0){
-      if( PyDict_SetItem(co->cache_dict, key, result) == -1 ||
-          PyErr_Occurred()){
-        Py_DECREF(key);
-        Py_DECREF(result);
-        return NULL;
-      }
-      Py_DECREF(key);
-      return co->misses++, result;
-    }
-    /* Least Recently Used cache */
-    /* Need to reacquire the lock here and make sure that the key,result were
-     * not added to the cache while we were waiting */
-    if(ACQUIRE_LOCK(co) == -1){
-      Py_DECREF(key);
-      Py_DECREF(result);
+    if ((id = cache_identity(co)) == NULL){
+      Py_DECREF(co);
       return NULL;
     }
-#ifdef WITH_THREAD
-    link = PyDict_GetItem(co->cache_dict, key);
-    if(PyErr_Occurred()){
-      RELEASE_LOCK(co);
-      Py_DECREF(key);
-      Py_DECREF(result);
-      Py_XDECREF(link);
+    co->shared = shared_open(lru->shared, lru->shared_size, id);
+    Py_DECREF(id);
+    if (co->shared == NULL){
+      Py_DECREF(co);
       return NULL;
     }
-    if(link){
-      Py_DECREF(key);
-      if(RELEASE_LOCK(co) == -1){
-        Py_DECREF(result);
-        return NULL;
-      }
-      return co->hits++, result;
-    }
-#endif
-    /* if cache is full, repurpose the last link rather than
-     * passing it off to garbage collection.  */
-    if (((PyDictObject *)co->cache_dict)->ma_used == co->maxsize){
-      /* Note that the old key will be used to delete the link from the dictionary
-       * Be sure to INCREF old link so we don't lose it before
-       * we add it when the PyDict_DelItem occurs */
-      clist *last = co->root->prev;
-      PyObject *old_key = last->key;
-      PyObject *old_res = last->result;
-      // set new items
-      last->key = key;
-      last->result = result;
-      // bump to the front (get back the result we just set).
-      result = make_first(co->root, last);
-      // Increase ref count of repurposed link so we don't trigger GC
-      // save the first position since the global co->root->next may change
-      first = (PyObject *) co->root->next;
-      // Increases first->refcount to 2
-      if(PyDict_SetItem(co->cache_dict, key, first) == -1){
-        Py_DECREF(first);
-        Py_DECREF(first);
-        Py_DECREF(key);
-        Py_DECREF(old_key);
-        Py_DECREF(old_res);
-        Py_DECREF(result);
-        RELEASE_LOCK(co);
-        return NULL;
-      }
-      // handle deletions
-      if(PyDict_DelItem(co->cache_dict, old_key) == -1){
-        Py_DECREF(old_key);
-        Py_DECREF(old_res);
-        Py_DECREF(result);
-        RELEASE_LOCK(co);
-        return NULL;
-      }
-      // These would have been decrefed had we simply deleted the link
-      Py_DECREF(old_key);
-      Py_DECREF(old_res);
-      if(PyErr_Occurred()){
-        Py_DECREF(result);
-        RELEASE_LOCK(co);
-        return NULL;
-      }
-      if(RELEASE_LOCK(co) == -1){
-        Py_DECREF(result);
-        return NULL;
-      }
-      return co->misses++, result;
-    }
-    else {
-      if(insert_first(co->root, key, result) < 0) {
-        Py_DECREF(key);
-        Py_DECREF(result);
-        RELEASE_LOCK(co);
-        return NULL;
-      }
-      first = (PyObject *) co->root->next; // insert_first sets refcount to 1
-      // key and first count++
-      if(PyDict_SetItem(co->cache_dict, key, first) == -1 || PyErr_Occurred()){
-        Py_DECREF(first);
-        Py_DECREF(result);
-        RELEASE_LOCK(co);
-        return NULL;
-      }
-      Py_DECREF(first);
-      // Don't DECREF key here since we want both the dict and the node 'first'
-      // To be able to have a valid copy
-      co->misses++;
-      if(RELEASE_LOCK(co) == -1){
-        Py_DECREF(result);
-        return NULL;
-      }
-      return result;
-    }
-  } // link != NULL
-  else {
-    if( co->maxsize < 0){
-      Py_DECREF(key);
-      co->hits++;
-      INC_RETURN(link);
-    }
-    /* bump link to the front of the list and get result from link */
-    result = make_first(co->root, (clist *) link);
-    Py_DECREF(key);
-    co->hits++;
-    return result;
   }
-}
-
+#endif
 
-PyDoc_STRVAR(cacheclear__doc__,
-"cache_clear(self)\n\
-\n\
-Clear the cache and cache statistics.");
-static PyObject *
-cache_clear(PyObject *self)
-{
-  cacheobject *co = (cacheobject *)self;
-  // delete dictionary - use a lock to keep dict in a fully determined state
-  if(ACQUIRE_LOCK(co) == -1)
-    return NULL;
-  PyDict_Clear(co->cache_dict);
-  co->hits = 0;
-  co->misses = 0;
-  if(RELEASE_LOCK(co) == -1)
+ configured:
+  co->ex_state = lru->state;
+  Py_INCREF(co->ex_state);
+  co->typed = lru->typed;
+  co->err = lru->err;
+  co->single_flight = lru->single_flight;
+  co->weak_keys = lru->weak_keys;
+  co->weak_values = lru->weak_values;
+  // weak entries refer back to the cache weakly through their callback
+  if ((co->weak_keys || co->weak_values) &&
+      (co->weak_callback = weakcb_new((PyObject *)co)) == NULL){
+    Py_DECREF(co);
     return NULL;
-  Py_RETURN_NONE;
-}
+  }
+#ifdef _FC_VECTORCALL
+  co->vectorcall = (vectorcallfunc)cache_vectorcall;
+#endif
 
+  // estimate the miss ratio curve from a sample of the keys
+  if (lru->mrc_rate > 0){
+    if ((co->mrc = PyMem_New(mrctracker, 1)) == NULL){
+      Py_DECREF(co);
+      PyErr_NoMemory();
+      return NULL;
+    }
+    memset(co->mrc, 0, sizeof(mrctracker));
+    co->mrc_rate = lru->mrc_rate;
+    mrc_reset(co->mrc, co->mrc_rate);
+  }
 
-PyDoc_STRVAR(cacheinfo__doc__,
-"cache_info(self)\n\
-\n\
-Report cache statistics.");
-static PyObject *
-cache_info(PyObject *self)
-{
-  cacheobject * co = (cacheobject *) self;
-  if (co->maxsize >= 0)
-    return PyObject_CallFunction(co->cinfo,"nnnn",co->hits,
-                                 co->misses, co->maxsize,
-                                 ((PyDictObject *)co->cache_dict)->ma_used);
-  else
-    return PyObject_CallFunction(co->cinfo,"nnOn",co->hits,
-                                 co->misses, Py_None,
-                                 ((PyDictObject *)co->cache_dict)->ma_used);
+  PyObject_GC_Track(co);
+  return co;
 }
 
 
-static PyMethodDef cache_methods[] = {
-  {"cache_clear", (PyCFunction) cache_clear, METH_NOARGS,
-   cacheclear__doc__},
-  {"cache_info", (PyCFunction) cache_info, METH_NOARGS,
-   cacheinfo__doc__},
-  {NULL, NULL} /* sentinel */
-};
+static PyObject *cachedmethod_new(lruobject *lru, PyObject *fo);
 
+/* takes a function as an argument and returns a cacheobject, or the
+ * cached_method descriptor of a method */
+static PyObject *
+lru_call(lruobject *lru, PyObject *args, PyObject *kw)
+{
+  PyObject *fo;
+  cacheobject *co;
 
-PyDoc_STRVAR(fn_doc,
-             "Cached function.");
+  if(! PyArg_ParseTuple(args, "O", &fo))
+    return NULL;
+
+  if(! PyCallable_Check(fo)){
+    PyErr_SetString(PyExc_TypeError, "Argument must be callable.");
+    return NULL;
+  }
+  if (lru->method)
+    return cachedmethod_new(lru, fo);
+  if ((co = cache_new(lru, fo, NULL)) == NULL)
+    return NULL;
+  if (registry_add(co) < 0){
+    Py_DECREF(co);
+    return NULL;
+  }
+  return (PyObject *)co;
+}
 
 
-static PyTypeObject cache_type = {
+static PyTypeObject lru_type = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    "fastcache.clru_cache",                /* tp_name */
-    sizeof(cacheobject),                       /* tp_basicsize */
+    "fastcache.lru",                /* tp_name */
+    sizeof(lruobject),                       /* tp_basicsize */
     0,                                  /* tp_itemsize */
     /* methods */
-    (destructor)cache_dealloc,            /* tp_dealloc */
+    (destructor)lru_dealloc,            /* tp_dealloc */
     0,                                  /* tp_print */
     0,                                  /* tp_getattr */
     0,                                  /* tp_setattr */
@@ -879,178 +5972,504 @@ static PyTypeObject cache_type = {
     0,                                  /* tp_as_sequence */
     0,                                  /* tp_as_mapping */
     0,                                  /* tp_hash */
-    (ternaryfunc)cache_call,              /* tp_call */
+    (ternaryfunc)lru_call,              /* tp_call */
     0,                                  /* tp_str */
     0,                                  /* tp_getattro */
     0,                                  /* tp_setattro */
     0,                                  /* tp_as_buffer */
     Py_TPFLAGS_DEFAULT ,                /* tp_flags */
-    fn_doc,                                  /* tp_doc */
-    0,                                  /* tp_traverse */
-    0,                                  /* tp_clear */
-    0,                                  /* tp_richcompare */
-    0,                                  /* tp_weaklistoffset */
-    0,                                  /* tp_iter */
-    0,                                  /* tp_iternext */
-    cache_methods,                      /* tp_methods */
-    cache_memberlist,                   /* tp_members */
-    cache_getset,                       /* tp_getset */
-    0,                                  /* tp_base */
-    0,                                  /* tp_dict */
-    cache_descr_get,                    /* tp_descr_get */
-    0,                                  /* tp_descr_set */
-    OFF(func_dict),                     /* tp_dictoffset */
-    0,                                  /* tp_init */
-    0,                                  /* tp_alloc */
-    0,                                  /* tp_new */
-    0,                                  /* tp_free */
 };
 
 
-/* lruobject -
- * the callable object returned by lrucache(all, my, cache, args)
- * [lrucache is known as clru_cache in python land]
- * records arguments to clru_cache and passes them along to the
- * cacheobject created when lruobject is called with a function
- * as an argument */
-typedef struct {
-  PyObject_HEAD
-  Py_ssize_t maxsize;
-  PyObject *state;
-  int typed;
-  enum unhashable err;
-} lruobject;
+/***********************************************************
+ cached methods
+************************************************************/
+/* A cached_method descriptor keeps one cache per instance in the instance
+ * __dict__, under a key made from the attribute name.  The cycle collector
+ * sees the cache there, so an instance whose results refer back to it is
+ * still freed.  Instances without a __dict__ get their caches from a table
+ * of the descriptor, keyed by the identity of the instance through a weak
+ * entry, which goes away with the instance.  The instances need neither be
+ * hashable nor comparable.  The per-instance caches refer to their instance
+ * weakly and pass it as the first argument of the function, so their keys
+ * are built from the other arguments only.
+ *
+ * obj.f(x) is looked up as an unbound method (Py_TPFLAGS_METHOD_DESCRIPTOR)
+ * and the descriptor's vectorcall finds the cache of args[0] and calls it
+ * with the rest, without making a bound method object.  obj.f itself
+ * returns the per-instance cache, e.g. for obj.f.cache_info(). */
+
+/* the hash of an instance is its address, aligned objects drop 4 bits */
+#define METHOD_HASH(obj) ((Py_hash_t)((size_t)(obj) >> 4))
+
+
+/* The entry of the cache of obj, by identity, or HT_NONE.  Runs no
+ * Python code, so under the GIL it does not need the lock. */
+static hindex
+method_find(htable *t, PyObject *obj)
+{
+  hindex p = HT_HOME(t, METHOD_HASH(obj)), i;
+
+  while ((i = t->index[p]) != 0){
+    i--;
+    if (WEAK_REFERENT(t->slots[i].key) == obj)
+      return i;
+    p = HT_NEXT(t, p);
+  }
+  return HT_NONE;
+}
+
+
+/* new reference to the interned __dict__ key of the caches of the method
+ * named name, NULL without an exception if name is not a string */
+static PyObject *
+method_dict_key(PyObject *name)
+{
+  PyObject *key;
+
+#ifdef _PY2
+  if (name == NULL || !PyString_Check(name))
+    return NULL;
+  key = PyString_FromFormat("__cached_method_%s", PyString_AS_STRING(name));
+  if (key != NULL)
+    PyString_InternInPlace(&key);
+#else
+  if (name == NULL || !PyUnicode_Check(name))
+    return NULL;
+  key = PyUnicode_FromFormat("__cached_method_%U", name);
+  if (key != NULL)
+    PyUnicode_InternInPlace(&key);
+#endif
+  return key;
+}
+
+
+/* new reference to the __dict__ of obj, NULL without an exception if it
+ * has none */
+static PyObject *
+method_instance_dict(PyObject *obj)
+{
+#ifdef _PY2
+  PyObject **dictptr = _PyObject_GetDictPtr(obj);
+
+  if (dictptr == NULL)
+    return NULL;
+  if (*dictptr == NULL && (*dictptr = PyDict_New()) == NULL)
+    return NULL;
+  Py_INCREF(*dictptr);
+  return *dictptr;
+#else
+  PyObject *dict;
+
+  if (Py_TYPE(obj)->tp_dictoffset == 0)
+    return NULL;
+  if ((dict = PyObject_GenericGetDict(obj, NULL)) == NULL &&
+      PyErr_ExceptionMatches(PyExc_AttributeError))
+    PyErr_Clear();
+  return dict;
+#endif
+}
+
+
+/* a new cache of the method for the instance obj */
+static cacheobject *
+method_new_cache(cachedmethodobject *cm, PyObject *obj)
+{
+  cacheobject *co;
+
+  if (cm->proto == NULL){
+    PyErr_SetString(PyExc_RuntimeError,
+                    "the cached method was cleared by the garbage collector");
+    return NULL;
+  }
+  if (!PyType_SUPPORTS_WEAKREFS(Py_TYPE(obj))){
+    PyErr_Format(PyExc_TypeError,
+                 "cannot create weak reference to '%.100s' object, "
+                 "needed to cache its methods", Py_TYPE(obj)->tp_name);
+    return NULL;
+  }
+  if ((co = cache_new((lruobject *)cm->lru, cm->proto->fn, cm->proto)) == NULL)
+    return NULL;
+  if ((co->instance = PyWeakref_NewRef(obj, NULL)) == NULL){
+    Py_DECREF(co);
+    return NULL;
+  }
+  co->method_name = cm->name;
+  Py_XINCREF(co->method_name);
+  return co;
+}
+
+
+/* new reference to the cache of obj kept in its __dict__, made on first
+ * use, or when the one there belongs to the instance obj was copied from */
+static cacheobject *
+method_dict_cache(cachedmethodobject *cm, PyObject *obj, PyObject *dict)
+{
+  PyObject *found, *self = NULL;
+  cacheobject *co;
+
+#if PY_VERSION_HEX >= 0x030D0000
+  if (PyDict_GetItemRef(dict, cm->dict_key, &found) < 0)
+    return NULL;
+#elif defined(_PY2)
+  found = PyDict_GetItem(dict, cm->dict_key);
+  Py_XINCREF(found);
+#else
+  if ((found = PyDict_GetItemWithError(dict, cm->dict_key)) == NULL &&
+      PyErr_Occurred())
+    return NULL;
+  Py_XINCREF(found);
+#endif
+  if (found != NULL && Py_TYPE(found) == &cache_type &&
+      ((cacheobject *)found)->instance != NULL &&
+      (self = weak_deref(((cacheobject *)found)->instance)) == obj){
+    Py_DECREF(self);
+    return (cacheobject *)found;
+  }
+  Py_XDECREF(self);
+  Py_XDECREF(found);
+  if ((co = method_new_cache(cm, obj)) == NULL)
+    return NULL;
+  if (PyDict_SetItem(dict, cm->dict_key, (PyObject *)co) < 0){
+    Py_DECREF(co);
+    return NULL;
+  }
+  return co;
+}
+
+
+/* new reference to the cache of the instance obj, made on first use */
+static cacheobject *
+method_get_cache(cachedmethodobject *cm, PyObject *obj)
+{
+  cacheshard *sh = &cm->instances;
+  cacheobject *co;
+  PyObject *ref, *dict;
+  hindex i;
+
+  if (cm->dict_key != NULL && (dict = method_instance_dict(obj)) != NULL){
+    co = method_dict_cache(cm, obj, dict);
+    Py_DECREF(dict);
+    return co;
+  }
+  if (PyErr_Occurred())
+    return NULL;
+
+#ifdef Py_GIL_DISABLED
+  if (ACQUIRE_LOCK(sh) == -1)
+    return NULL;
+#endif
+  i = method_find(&sh->table, obj);
+  co = i != HT_NONE ? (cacheobject *)sh->table.slots[i].result : NULL;
+  Py_XINCREF(co);
+#ifdef Py_GIL_DISABLED
+  RELEASE_LOCK(sh);
+#endif
+  if (co != NULL)
+    return co;
+
+  // the cache is made outside of the lock, its weak references may run
+  // Python code
+  if ((co = method_new_cache(cm, obj)) == NULL)
+    return NULL;
+  if ((ref = PyObject_CallFunctionObjArgs((PyObject *)&weakentry_type, obj,
+                                          cm->weak_callback, NULL)) == NULL){
+    Py_DECREF(co);
+    return NULL;
+  }
+  ((weakentryobject *)ref)->key_hash = METHOD_HASH(obj);
+
+  if (ACQUIRE_LOCK(sh) == -1){
+    Py_DECREF(ref);
+    Py_DECREF(co);
+    return NULL;
+  }
+  // another thread may have made a cache for obj meanwhile
+  if ((i = method_find(&sh->table, obj)) != HT_NONE){
+    PyObject *other = sh->table.slots[i].result;
+    Py_INCREF(other);
+    RELEASE_LOCK(sh);
+    Py_DECREF(ref);
+    Py_DECREF(co);
+    return (cacheobject *)other;
+  }
+  Py_INCREF(co);
+  if (htable_insert(&sh->table, METHOD_HASH(obj), ref, (PyObject *)co, 1,
+                    0.0) < 0){
+    RELEASE_LOCK(sh);
+    Py_DECREF(ref);
+    Py_DECREF(co);
+    Py_DECREF(co);
+    return NULL;
+  }
+  RELEASE_LOCK(sh);
+  return co;
+}
+
+
+static PyObject *
+cachedmethod_descr_get(PyObject *self, PyObject *obj, PyObject *type)
+{
+  if (obj == Py_None || obj == NULL)
+    INC_RETURN(self);
+  return (PyObject *)method_get_cache((cachedmethodobject *)self, obj);
+}
 
 
-static void lru_dealloc(lruobject *lru)
+static PyObject *
+cachedmethod_noinstance(void)
 {
-  Py_CLEAR(lru->state);
-  Py_TYPE(lru)->tp_free(lru);
+  PyErr_SetString(PyExc_TypeError,
+                  "a cached method needs an instance as first argument");
+  return NULL;
 }
 
 
+/* tp_call entry point, e.g. for C.f(obj, x) */
 static PyObject *
-get_func_attr(PyObject *fo, const char *name)
+cachedmethod_call(cachedmethodobject *cm, PyObject *args, PyObject *kw)
 {
-  if( !PyObject_HasAttrString(fo,name))
-    Py_RETURN_NONE;
-  else{
-    PyObject *attr = PyObject_GetAttrString(fo, name);
-    if (attr == NULL)
-      return NULL;
-    return attr;
-  }
+  PyObject *rest, *result;
+  cacheobject *co;
+
+  if (PyTuple_GET_SIZE(args) < 1)
+    return cachedmethod_noinstance();
+  if ((co = method_get_cache(cm, PyTuple_GET_ITEM(args, 0))) == NULL)
+    return NULL;
+  rest = PyTuple_GetSlice(args, 1, PY_SSIZE_T_MAX);
+  result = rest != NULL ? cache_call(co, rest, kw) : NULL;
+  Py_XDECREF(rest);
+  Py_DECREF(co);
+  return result;
 }
 
 
-/* takes a function as an argument and returns a cacheobject */
+#ifdef _FC_VECTORCALL
+/* vectorcall entry point: args[0] is the instance and, with
+ * PY_VECTORCALL_ARGUMENTS_OFFSET, its slot is lent to the cache which
+ * puts self back there to call the function on a miss */
 static PyObject *
-lru_call(lruobject *lru, PyObject *args, PyObject *kw)
+cachedmethod_vectorcall(cachedmethodobject *cm, PyObject *const *args,
+                        size_t nargsf, PyObject *kwnames)
 {
-  PyObject *fo, *mod, *nt;
+  Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
+  PyObject *result;
   cacheobject *co;
 
-  if(! PyArg_ParseTuple(args, "O", &fo))
+  if (nargs < 1)
+    return cachedmethod_noinstance();
+  if ((co = method_get_cache(cm, args[0])) == NULL)
     return NULL;
+  result = cache_vectorcall(co, args + 1,
+                            (size_t)(nargs - 1) |
+                            PY_VECTORCALL_ARGUMENTS_OFFSET, kwnames);
+  Py_DECREF(co);
+  return result;
+}
+#endif
 
-  if(! PyCallable_Check(fo)){
-    PyErr_SetString(PyExc_TypeError, "Argument must be callable.");
+
+/* Keep the caches of the instances under a key made from name.  Without
+ * a string name, they all go to the table of the descriptor. */
+static int
+cachedmethod_set_key(cachedmethodobject *cm, PyObject *name)
+{
+  PyObject *key = method_dict_key(name), *old_name, *old_key;
+
+  if (key == NULL && PyErr_Occurred())
+    return -1;
+  old_name = cm->name;
+  old_key = cm->dict_key;
+  cm->name = key != NULL ? name : NULL;
+  Py_XINCREF(cm->name);
+  cm->dict_key = key;
+  Py_XDECREF(old_name);
+  Py_XDECREF(old_key);
+  return 0;
+}
+
+
+/* the attribute the descriptor is stored under, once the class is made */
+static PyObject *
+cachedmethod_set_name(cachedmethodobject *cm, PyObject *args)
+{
+  PyObject *owner, *name;
+
+  if (!PyArg_ParseTuple(args, "OO:__set_name__", &owner, &name))
     return NULL;
-  }
-  co = PyObject_New(cacheobject, &cache_type);
-  if (co == NULL)
+  if (cachedmethod_set_key(cm, name) < 0)
     return NULL;
+  Py_RETURN_NONE;
+}
 
-#ifdef WITH_THREAD
-  if ((co->lock = PyThread_allocate_lock()) == NULL){
-    Py_DECREF(co);
+
+static PyMethodDef cachedmethod_methods[] = {
+  {"__set_name__", (PyCFunction)cachedmethod_set_name, METH_VARARGS, NULL},
+  {NULL, NULL} /* sentinel */
+};
+
+
+static PyObject *
+cachedmethod_new(lruobject *lru, PyObject *fo)
+{
+  cachedmethodobject *cm;
+
+  cm = PyObject_GC_New(cachedmethodobject, &cachedmethod_type);
+  if (cm == NULL)
     return NULL;
+  memset((char *)cm + sizeof(PyObject), 0,
+         sizeof(cachedmethodobject) - sizeof(PyObject));
+#ifdef _FC_VECTORCALL
+  cm->vectorcall = (vectorcallfunc)cachedmethod_vectorcall;
+#endif
+  cm->lru = (PyObject *)lru;
+  Py_INCREF(cm->lru);
+#ifdef WITH_THREAD
+  if ((cm->instances.lock = PyThread_allocate_lock()) == NULL){
+    Py_DECREF(cm);
+    return PyErr_NoMemory();
   }
-  // We need to initialize the rlock count and owner here
-  co->rlock_count = 0;
-  co->rlock_owner = 0;
 #endif
-  if ((co->cache_dict = PyDict_New()) == NULL){
-    Py_DECREF(co);
+  cm->instances.maxsize = -1;
+  if (htable_init(&cm->instances.table, HT_MIN_CAPACITY) < 0 ||
+      (cm->proto = cache_new(lru, fo, NULL)) == NULL ||
+      (cm->weak_callback = weakcb_new((PyObject *)cm)) == NULL ||
+      cachedmethod_set_key(cm, cm->proto->func_name) < 0){
+    Py_DECREF(cm);
     return NULL;
   }
+  PyObject_GC_Track(cm);
+  return (PyObject *)cm;
+}
 
-  // initialize circular doubly linked list
-  co->root = PyObject_New(clist, &clist_type);
-  if(co->root == NULL){
-    Py_DECREF(co);
-    return NULL;
-  }
 
-  // get namedtuple for cache_info()
-  mod = PyImport_ImportModule("collections");
-  if (mod == NULL){
-    Py_DECREF(co);
-    return NULL;
-  }
-  nt = PyObject_GetAttrString(mod, "namedtuple");
-  if (nt == NULL){
-    Py_DECREF(co);
-    return NULL;
-  }
-  co->cinfo = PyObject_CallFunction(nt,"ss","CacheInfo",
-                                    "hits misses maxsize currsize");
-  if (co->cinfo == NULL){
-    Py_DECREF(co);
-    return NULL;
+static int
+cachedmethod_traverse(cachedmethodobject *cm, visitproc visit, void *arg)
+{
+  htable *t = &cm->instances.table;
+  hindex i;
+
+  Py_VISIT(cm->proto);
+  if (t->slots != NULL){
+    for(i = 0; i < t->fill; i++){
+      if (t->slots[i].key != NULL)
+        Py_VISIT(t->slots[i].result);
+    }
   }
+  return 0;
+}
 
-  co->func_dict = get_func_attr(fo, "__dict__");
 
-  co->fn = fo; // __wrapped__
-  Py_INCREF(co->fn);
+/* Drop the per-instance caches, through an empty table as in
+ * cache_drop_entries, and the prototype. */
+static int
+cachedmethod_tp_clear(cachedmethodobject *cm)
+{
+  htable old = cm->instances.table;
+
+  if (old.slots != NULL && old.used > 0 &&
+      htable_init(&cm->instances.table, HT_MIN_CAPACITY) == 0)
+    htable_free_slots(old.slots, old.capacity);
+  PyErr_Clear();
+  Py_CLEAR(cm->proto);
+  return 0;
+}
 
-  co->func_module = get_func_attr(fo, "__module__");
-  co->func_annotations = get_func_attr(fo, "__annotations__");
-  co->func_name = get_func_attr(fo, "__name__");
-  co->func_qualname = get_func_attr(fo, "__qualname__");
 
-  co->ex_state = lru->state;
-  Py_INCREF(co->ex_state);
-  co->maxsize = lru->maxsize;
-  co->hits = 0;
-  co->misses = 0;
-  co->typed = lru->typed;
-  co->err = lru->err;
-  // start with self-referencing root node
-  co->root->prev = co->root;
-  co->root->next = co->root;
-  co->root->key = Py_None;
-  co->root->result = Py_None;
-  Py_INCREF(co->root->key);
-  Py_INCREF(co->root->result);
+static void
+cachedmethod_dealloc(cachedmethodobject *cm)
+{
+  PyObject_GC_UnTrack(cm);
+  if (cm->weakreflist != NULL)
+    PyObject_ClearWeakRefs((PyObject *)cm);
+  if (cm->instances.table.slots != NULL)
+    htable_free_slots(cm->instances.table.slots,
+                      cm->instances.table.capacity);
+  FREE_LOCK(&cm->instances);
+  Py_CLEAR(cm->proto);
+  Py_CLEAR(cm->lru);
+  Py_CLEAR(cm->weak_callback);
+  Py_CLEAR(cm->name);
+  Py_CLEAR(cm->dict_key);
+  Py_TYPE(cm)->tp_free(cm);
+}
 
-  return (PyObject *)co;
+
+/* attributes of the wrapped function, from the prototype cache */
+static PyObject *
+cachedmethod_get_attr(cachedmethodobject *cm, void *closure)
+{
+  PyObject *attr;
+
+  if (cm->proto == NULL)
+    Py_RETURN_NONE;
+  attr = *(PyObject **)((char *)cm->proto + (size_t)closure);
+  if (attr == NULL)
+    Py_RETURN_NONE;
+  INC_RETURN(attr);
 }
 
 
-static PyTypeObject lru_type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "fastcache.lru",                /* tp_name */
-    sizeof(lruobject),                       /* tp_basicsize */
-    0,                                  /* tp_itemsize */
-    /* methods */
-    (destructor)lru_dealloc,            /* tp_dealloc */
-    0,                                  /* tp_print */
-    0,                                  /* tp_getattr */
-    0,                                  /* tp_setattr */
-    0,                                  /* tp_reserved */
-    0,                                  /* tp_repr */
-    0,                                  /* tp_as_number */
-    0,                                  /* tp_as_sequence */
-    0,                                  /* tp_as_mapping */
-    0,                                  /* tp_hash */
-    (ternaryfunc)lru_call,              /* tp_call */
-    0,                                  /* tp_str */
-    0,                                  /* tp_getattro */
-    0,                                  /* tp_setattro */
-    0,                                  /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT ,                /* tp_flags */
+static PyObject *
+cachedmethod_get_doc(cachedmethodobject *cm, void *closure)
+{
+  if (cm->proto == NULL)
+    Py_RETURN_NONE;
+  return cache_get_doc(cm->proto, closure);
+}
+
+
+static PyGetSetDef cachedmethod_getset[] = {
+  {"__wrapped__", (getter)cachedmethod_get_attr, NULL, NULL,
+   (void *)OFF(fn)},
+  {"__module__", (getter)cachedmethod_get_attr, NULL, NULL,
+   (void *)OFF(func_module)},
+  {"__name__", (getter)cachedmethod_get_attr, NULL, NULL,
+   (void *)OFF(func_name)},
+  {"__qualname__", (getter)cachedmethod_get_attr, NULL, NULL,
+   (void *)OFF(func_qualname)},
+  {"__annotations__", (getter)cachedmethod_get_attr, NULL, NULL,
+   (void *)OFF(func_annotations)},
+  {"__doc__", (getter)cachedmethod_get_doc, NULL, NULL, NULL},
+  {NULL} /* Sentinel */
+};
+
+
+static PyTypeObject cachedmethod_type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "fastcache.cached_method",      /* tp_name */
+  sizeof(cachedmethodobject),     /* tp_basicsize */
+  0,                              /* tp_itemsize */
+  /* methods */
+  (destructor)cachedmethod_dealloc,   /* tp_dealloc */
+  0,                              /* tp_print */
+  0,                              /* tp_getattr */
+  0,                              /* tp_setattr */
+  0,                              /* tp_reserved */
+  0,                              /* tp_repr */
+  0,                              /* tp_as_number */
+  0,                              /* tp_as_sequence */
+  0,                              /* tp_as_mapping */
+  0,                              /* tp_hash */
+  (ternaryfunc)cachedmethod_call, /* tp_call */
+  0,                              /* tp_str */
+  0,                              /* tp_getattro */
+  0,                              /* tp_setattro */
+  0,                              /* tp_as_buffer */
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,  /* tp_flags */
+  0,                              /* tp_doc */
+  (traverseproc)cachedmethod_traverse,  /* tp_traverse */
+  (inquiry)cachedmethod_tp_clear, /* tp_clear */
+  0,                              /* tp_richcompare */
+  offsetof(cachedmethodobject, weakreflist),  /* tp_weaklistoffset */
+  0,                              /* tp_iter */
+  0,                              /* tp_iternext */
+  cachedmethod_methods,           /* tp_methods */
+  0,                              /* tp_members */
+  cachedmethod_getset,            /* tp_getset */
+  0,                              /* tp_base */
+  0,                              /* tp_dict */
+  cachedmethod_descr_get,         /* tp_descr_get */
 };
 
 
@@ -1087,9 +6506,99 @@ process_uh(PyObject *arg, PyObject *(*f)(const char *))
 }
 
 
+/* helper function for processing 'policy' */
+static enum policy
+process_policy(PyObject *arg)
+{
+  static const char *names[] = {"lru", "clock", "tinylfu"};
+  enum policy vals[] = {FC_LRU, FC_CLOCK, FC_TINYLFU};
+  int i;
+
+  for(i=0; i<3; i++){
+    PyObject *name = PyUnicode_FromString(names[i]);
+    int k;
+    if (name == NULL)
+      return FC_POLICY_FAIL;
+    k = PyObject_RichCompareBool(arg, name, Py_EQ);
+    Py_DECREF(name);
+    if (k < 0)
+      return FC_POLICY_FAIL;
+    if (k)
+      return vals[i];
+  }
+  PyErr_SetString(PyExc_ValueError,
+                  "Argument <policy> must be 'lru', 'clock' or 'tinylfu'");
+  return FC_POLICY_FAIL;
+}
+
+
+/* helper function for processing expiry durations, None is no expiry */
+static int
+process_duration(PyObject *arg, double *seconds)
+{
+  *seconds = 0;
+  if (arg == Py_None)
+    return 0;
+  *seconds = PyFloat_AsDouble(arg);
+  if (*seconds == -1.0 && PyErr_Occurred())
+    return -1;
+  // also rejects nan and inf
+  if (!(*seconds > 0 && *seconds < 1e300)){
+    PyErr_SetString(PyExc_ValueError,
+                    "Expiry durations must be positive numbers of seconds.");
+    return -1;
+  }
+  return 0;
+}
+
+
+/* Helper function for processing 'weigher'.  Returns a new reference to
+ * the callable weighing results, sys.getsizeof for the builtin weighers.
+ * Sets *nbytes for 'nbytes', which uses it for results without a buffer. */
+static PyObject *
+process_weigher(PyObject *arg, int *nbytes)
+{
+  static const char *names[] = {"sizeof", "nbytes"};
+  PyObject *getsizeof;
+  int i;
+
+  *nbytes = 0;
+  if (arg != Py_None && PyCallable_Check(arg))
+    INC_RETURN(arg);
+  for(i=0; arg != Py_None && i<2; i++){
+    PyObject *name = PyUnicode_FromString(names[i]);
+    int k;
+    if (name == NULL)
+      return NULL;
+    k = PyObject_RichCompareBool(arg, name, Py_EQ);
+    Py_DECREF(name);
+    if (k < 0)
+      return NULL;
+    if (k)
+      break;
+  }
+  if (i == 2){
+    PyErr_SetString(PyExc_TypeError,
+                    "Argument <weigher> must be callable, 'sizeof' or 'nbytes'");
+    return NULL;
+  }
+  *nbytes = i == 1;
+  if ((getsizeof = PySys_GetObject("getsizeof")) == NULL){
+    PyErr_SetString(PyExc_RuntimeError, "lost sys.getsizeof");
+    return NULL;
+  }
+  INC_RETURN(getsizeof);
+}
+
+
 /* LRU cache decorator */
 PyDoc_STRVAR(lrucache__doc__,
-"clru_cache(maxsize=128, typed=False, state=None, unhashable='error')\n\n"
+"clru_cache(maxsize=128, typed=False, state=None, unhashable='error',\n"
+"           single_flight=False, shards=None, policy='lru', ttl=None,\n"
+"           expire_after_write=None, expire_after_access=None,\n"
+"           clock=None, maxweight=None, weigher=None, shared=None,\n"
+"           shared_size=None, mrc=None, weak_keys=False,\n"
+"           weak_values=False)\n\n"
 "Least-recently-used cache decorator.\n\n"
 "If *maxsize* is set to None, the LRU features are disabled and the\n"
 "cache can grow without bound.\n\n"
@@ -1107,9 +6616,92 @@ PyDoc_STRVAR(lrucache__doc__,
 "    If *unhashable* is 'ignore', the wrapped function will be called\n"
 "    with the supplied arguments. A miss will will be recorded in\n"
 "    the cache statistics.\n\n"
+"If *single_flight* is True, threads that miss on a key which is already\n"
+"being computed wait for that call and share its result (or exception)\n"
+"instead of calling the wrapped function again.  A shared result is\n"
+"recorded as a hit.\n\n"
+"*shards* splits the cache into that many independently locked parts\n"
+"(rounded up to a power of two), each holding an equal share of *maxsize*\n"
+"with its own LRU order.  Threads using different shards do not contend,\n"
+"which matters on free-threaded builds where it defaults to 16; otherwise\n"
+"the default is a single shard.\n\n"
+"*policy* selects the entry evicted from a full cache.  'lru' evicts the\n"
+"least recently used one.  'clock' approximates LRU: a hit only marks the\n"
+"entry as referenced and eviction gives marked entries a second chance.\n"
+"Hits are then read-only and do not need the cache lock.  'tinylfu'\n"
+"admits a new entry into the main cache only if it was requested more\n"
+"often than the entry it would evict, according to a frequency sketch.\n"
+"New entries first pass a small LRU window, so bursts still hit, while\n"
+"one-off scans no longer flush popular entries.  It needs a positive\n"
+"*maxsize*.\n\n"
+"If *ttl* (or its alias *expire_after_write*) is set, entries expire that\n"
+"many seconds after they were stored.  If *expire_after_access* is set,\n"
+"entries expire that many seconds after they were last used.  Expired\n"
+"entries are dropped when looked up and reaped in bulk as time passes.\n"
+"*clock* is a callable returning the current time in seconds and defaults\n"
+"to a coarse monotonic clock.\n\n"
+"If *maxweight* is set, the total weight of the cached results is kept\n"
+"at or below it by evicting entries, and a result heavier than that is\n"
+"not cached.  *weigher* gives the weight of a result: a callable taking\n"
+"the result, 'sizeof' for sys.getsizeof (the default) or 'nbytes' for the\n"
+"size of the buffer of bytes, arrays and the like.  *maxsize* still\n"
+"applies, use maxsize=None to bound the cache by weight alone.  Weighted\n"
+"caches add maxweight and currweight to cache_info().\n\n"
+"If the wrapped function is a coroutine function (async def), every call\n"
+"returns a new coroutine awaiting one shared call of the function, which\n"
+"is what the cache stores.  The call runs as a task of the event loop of\n"
+"the first awaiter, and the others await it through asyncio.shield, so a\n"
+"caller that is cancelled, e.g. by a timeout, leaves it to the rest.  A\n"
+"call that failed or was cancelled is dropped from the cache once done.\n\n"
+"Batches of calls can be made with f.cache_map(iterable_of_args) and\n"
+"f.cache_get_many(keys), which look up all keys and store the new\n"
+"results with one lock acquisition per shard.  Misses are computed by\n"
+"calling the function, or by a single call of an optional loader given\n"
+"the list of missing arguments.\n\n"
+"f.cache_dump(path) writes the entries to a file from which\n"
+"f.cache_load(path) reads them back, e.g. to warm up a new process.  The\n"
+"dump records the module and qualified name of the function and is read\n"
+"through a memory map.  Keys and results are pickled unless another\n"
+"*serializer* with dumps() and loads() is given.\n\n"
+"If *shared* is the path of a file, results are also published to that\n"
+"file, memory mapped by every process using it, and looked up there on a\n"
+"local miss.  Forked workers thus compute each result once between them.\n"
+"Keys and results are pickled, and entries are namespaced by the module\n"
+"and qualified name of the function.  *shared_size* is the size in bytes\n"
+"of a new file (64 MiB by default).  A full file is emptied as a whole,\n"
+"cache_clear() only clears the local cache.  Not available on Windows.\n"
+"Results read from the file are unpickled, so any process that can write\n"
+"to it can run code in every process using it: only share files with\n"
+"processes you trust.  A new file is made readable by its owner only,\n"
+"and an existing one must be a regular file of the user that others\n"
+"cannot write to.\n\n"
+"If *mrc* is a rate in (0, 1], or True for 0.01, the cache samples that\n"
+"fraction of its keys to track their reuse distances, and\n"
+"f.cache_mrc(sizes) estimates the hit ratio an LRU cache of each size\n"
+"would have had (a miss ratio curve).  Sample more keys for functions\n"
+"called with few distinct arguments.  At most 4096 keys are tracked, the\n"
+"rate is lowered as more keys show up.\n\n"
+"If *weak_values* is True, results are held through weak references and\n"
+"an entry goes away as soon as nothing else refers to its result.\n"
+"Results that cannot be weakly referenced (int, str, tuple, ...) are not\n"
+"cached.  If *weak_keys* is True, calls are keyed by their only\n"
+"positional argument, held through a weak reference, and an entry goes\n"
+"away with its argument, e.g. with self for a method taking no other\n"
+"arguments.  Other calls, and arguments that cannot be weakly referenced,\n"
+"are not cached.  Either way the memory held by the cache follows the\n"
+"objects in use rather than *maxsize*, which still applies.  Weak caches\n"
+"cannot be dumped or loaded, and cache_stats() counts the entries dropped\n"
+"as collected.\n\n"
 "View the cache statistics named tuple (hits, misses, maxsize, currsize)\n"
-"with f.cache_info().  Clear the cache and statistics with\n"
-"f.cache_clear(). Access the underlying function with f.__wrapped__.\n\n"
+"with f.cache_info().  f.cache_stats() adds evictions, expirations, key\n"
+"comparisons, discarded duplicate results, lock contention and a\n"
+"histogram of the time taken by misses.  Clear the cache and statistics with\n"
+"f.cache_clear(). Access the underlying function with f.__wrapped__.\n"
+"f.cache_resize(maxsize) changes the maxsize of a bounded cache and keeps\n"
+"the entries that still fit.\n\n"
+"Caches are registered with weak references: fastcache.all_caches() lists\n"
+"the live ones and fastcache.export_stats() writes the cache_stats() of\n"
+"all of them in the Prometheus text format or as JSON.\n\n"
 "See:  http://en.wikipedia.org/wiki/Cache_algorithms#Least_Recently_Used");
 
 static PyObject *
@@ -1117,25 +6709,63 @@ lrucache(PyObject *self, PyObject *args, PyObject *kwargs)
 {
   PyObject *state = Py_None;
   int typed = 0;
+  int single_flight = 0;
   PyObject *omaxsize = Py_False;
   PyObject *oerr = Py_None;
-  Py_ssize_t maxsize = 128;
-  static char *kwlist[] = {"maxsize", "typed", "state", "unhashable", NULL};
+  PyObject *oshards = Py_None;
+  PyObject *opolicy = Py_None;
+  enum policy policy = FC_LRU;
+  PyObject *ottl = Py_None, *owrite = Py_None, *oaccess = Py_None;
+  PyObject *clock = Py_None;
+  double ttl_write, ttl_access;
+  PyObject *omaxweight = Py_None, *oweigher = Py_None, *weigher = NULL;
+  Py_ssize_t maxweight = 0;
+  int weigh_nbytes = 0;
+  PyObject *shared = Py_None, *oshared_size = Py_None;
+  Py_ssize_t shared_size = 0;
+  PyObject *omrc = Py_None;
+  double mrc_rate = 0;
+  int weak_keys = 0, weak_values = 0;
+  Py_ssize_t maxsize = 128, shards = FC_DEFAULT_SHARDS;
+  static char *kwlist[] = {"maxsize", "typed", "state", "unhashable",
+                           "single_flight", "shards", "policy", "ttl",
+                           "expire_after_write", "expire_after_access",
+                           "clock", "maxweight", "weigher", "shared",
+                           "shared_size", "mrc", "weak_keys", "weak_values",
+                           NULL};
   lruobject *lru;
   enum unhashable err;
 #if defined(_PY2) || defined (_PY32)
-  PyObject *otyped = Py_False;
-  if(! PyArg_ParseTupleAndKeywords(args, kwargs, "|OOOO:lrucache",
+  PyObject *otyped = Py_False, *osingle = Py_False;
+  PyObject *oweak_keys = Py_False, *oweak_values = Py_False;
+  if(! PyArg_ParseTupleAndKeywords(args, kwargs,
+                                   "|OOOOOOOOOOOOOOOOOO:lrucache",
                                    kwlist,
-                                   &omaxsize, &otyped, &state, &oerr))
+                                   &omaxsize, &otyped, &state, &oerr,
+                                   &osingle, &oshards, &opolicy, &ottl,
+                                   &owrite, &oaccess, &clock, &omaxweight,
+                                   &oweigher, &shared, &oshared_size,
+                                   &omrc, &oweak_keys, &oweak_values))
     return NULL;
   typed = PyObject_IsTrue(otyped);
   if (typed < -1)
     return NULL;
+  single_flight = PyObject_IsTrue(osingle);
+  if (single_flight < 0)
+    return NULL;
+  if ((weak_keys = PyObject_IsTrue(oweak_keys)) < 0 ||
+      (weak_values = PyObject_IsTrue(oweak_values)) < 0)
+    return NULL;
 #else
-  if(! PyArg_ParseTupleAndKeywords(args, kwargs, "|OpOO:lrucache",
+  if(! PyArg_ParseTupleAndKeywords(args, kwargs,
+                                   "|OpOOpOOOOOOOOOOOpp:lrucache",
                                    kwlist,
-                                   &omaxsize, &typed, &state, &oerr))
+                                   &omaxsize, &typed, &state, &oerr,
+                                   &single_flight, &oshards, &opolicy,
+                                   &ottl, &owrite, &oaccess, &clock,
+                                   &omaxweight, &oweigher, &shared,
+                                   &oshared_size, &omrc, &weak_keys,
+                                   &weak_values))
     return NULL;
 #endif
   if (omaxsize != Py_False){
@@ -1160,6 +6790,113 @@ lrucache(PyObject *self, PyObject *args, PyObject *kwargs)
     }
   }
 
+  // round the number of shards up to a power of two
+  if (oshards != Py_None){
+    Py_ssize_t n = PyNumber_AsSsize_t(oshards, PyExc_OverflowError);
+    if (n == -1 && PyErr_Occurred())
+      return NULL;
+    if (n < 1 || n > FC_MAX_SHARDS){
+      PyErr_Format(PyExc_ValueError,
+                   "Argument <shards> must be between 1 and %d.",
+                   FC_MAX_SHARDS);
+      return NULL;
+    }
+    for(shards = 1; shards < n; shards <<= 1);
+  }
+
+  // check eviction policy
+  if (opolicy != Py_None && (policy = process_policy(opolicy)) == FC_POLICY_FAIL)
+    return NULL;
+  if (policy == FC_TINYLFU && maxsize <= 0){
+    PyErr_SetString(PyExc_ValueError,
+                    "Policy 'tinylfu' requires a positive <maxsize>.");
+    return NULL;
+  }
+
+  // check expiry, ttl is short for expire_after_write
+  if (ottl != Py_None && owrite != Py_None){
+    PyErr_SetString(PyExc_TypeError,
+                    "Arguments <ttl> and <expire_after_write> are aliases.");
+    return NULL;
+  }
+  if (process_duration(ottl != Py_None ? ottl : owrite, &ttl_write) < 0 ||
+      process_duration(oaccess, &ttl_access) < 0)
+    return NULL;
+  if (clock != Py_None && !PyCallable_Check(clock)){
+    PyErr_SetString(PyExc_TypeError, "Argument <clock> must be callable.");
+    return NULL;
+  }
+
+  // check weight bound and weigher
+  if (omaxweight != Py_None){
+    maxweight = PyNumber_AsSsize_t(omaxweight, PyExc_OverflowError);
+    if (maxweight == -1 && PyErr_Occurred())
+      return NULL;
+    if (maxweight < 1){
+      PyErr_SetString(PyExc_ValueError,
+                      "Argument <maxweight> must be positive.");
+      return NULL;
+    }
+    if ((weigher = process_weigher(oweigher, &weigh_nbytes)) == NULL)
+      return NULL;
+  }
+  else if (oweigher != Py_None){
+    PyErr_SetString(PyExc_TypeError,
+                    "Argument <weigher> requires <maxweight>.");
+    return NULL;
+  }
+
+  // check the shared tier
+  if (shared != Py_None){
+#ifdef FC_SHARED
+    if (maxsize == 0){
+      PyErr_SetString(PyExc_ValueError,
+                      "Argument <shared> requires a nonzero <maxsize>.");
+      return NULL;
+    }
+    shared_size = SHM_DEFAULT_SIZE;
+    if (oshared_size != Py_None){
+      shared_size = PyNumber_AsSsize_t(oshared_size, PyExc_OverflowError);
+      if (shared_size == -1 && PyErr_Occurred())
+        return NULL;
+      if (shared_size < SHM_MIN_SIZE){
+        PyErr_Format(PyExc_ValueError,
+                     "Argument <shared_size> must be at least %zd bytes.",
+                     SHM_MIN_SIZE);
+        return NULL;
+      }
+    }
+#else
+    PyErr_SetString(PyExc_NotImplementedError,
+                    "Argument <shared> is not supported on this platform.");
+    return NULL;
+#endif
+  }
+  else if (oshared_size != Py_None){
+    PyErr_SetString(PyExc_TypeError,
+                    "Argument <shared_size> requires <shared>.");
+    return NULL;
+  }
+
+  // check the sampling rate of the miss ratio curve, True for 1%
+  if (omrc == Py_True)
+    mrc_rate = 0.01;
+  else if (omrc != Py_None && omrc != Py_False){
+    mrc_rate = PyFloat_AsDouble(omrc);
+    if (mrc_rate == -1.0 && PyErr_Occurred())
+      return NULL;
+    if (!(mrc_rate > 0 && mrc_rate <= 1)){
+      PyErr_SetString(PyExc_ValueError,
+                      "Argument <mrc> must be a rate in (0, 1].");
+      return NULL;
+    }
+  }
+  if (mrc_rate > 0 && maxsize == 0){
+    PyErr_SetString(PyExc_ValueError,
+                    "Argument <mrc> requires a nonzero <maxsize>.");
+    return NULL;
+  }
+
   // ensure state is a list or dict
   if (state != Py_None && !(PyList_Check(state) || PyDict_CheckExact(state))){
     PyErr_SetString(PyExc_TypeError,
@@ -1167,6 +6904,13 @@ lrucache(PyObject *self, PyObject *args, PyObject *kwargs)
     return NULL;
   }
 
+  // weak keys are the only argument of a call, nothing else goes in them
+  if (weak_keys && (typed || state != Py_None)){
+    PyErr_SetString(PyExc_ValueError,
+                    "Argument <weak_keys> excludes <typed> and <state>.");
+    return NULL;
+  }
+
   // check unhashable
   if (oerr == Py_None)
     err = FC_ERROR;
@@ -1192,15 +6936,67 @@ lrucache(PyObject *self, PyObject *args, PyObject *kwargs)
   lru->state = state;
   lru->typed = typed;
   lru->err = err;
+  lru->single_flight = single_flight;
+  lru->shards = shards;
+  lru->policy = policy;
+  lru->ttl_write = ttl_write;
+  lru->ttl_access = ttl_access;
+  lru->clock = clock != Py_None ? clock : NULL;
+  Py_XINCREF(lru->clock);
+  lru->maxweight = maxweight;
+  lru->weigher = weigher; // new reference
+  lru->weigh_nbytes = weigh_nbytes;
+  lru->shared = shared != Py_None ? shared : NULL;
+  Py_XINCREF(lru->shared);
+  lru->shared_size = shared_size;
+  lru->mrc_rate = mrc_rate;
+  lru->weak_keys = weak_keys;
+  lru->weak_values = weak_values;
+  lru->method = 0;
   Py_INCREF(lru->state);
 
   return (PyObject *) lru;
 }
 
 
+PyDoc_STRVAR(cachedmethod__doc__,
+"cached_method(maxsize=128, ...)\n\n"
+"Method cache decorator taking the arguments of clru_cache.\n\n"
+"Every instance gets a cache of its own, made on first use and freed\n"
+"with the instance, which is held through a weak reference.  The cache\n"
+"of obj.f is kept in obj.__dict__ as '__cached_method_f', or by the\n"
+"decorator for instances without a __dict__, and a copy of obj gets a\n"
+"new one.  Keys are built from the arguments after self, so instances\n"
+"need not be hashable but must support weak references, and *maxsize*\n"
+"bounds each cache.  obj.f(x) finds the cache of obj without making a\n"
+"bound method, and obj.f is that cache, e.g. obj.f.cache_info() or\n"
+"obj.f.cache_clear().  The *shared* option is not supported.");
+
+static PyObject *
+cachedmethod(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+  lruobject *lru = (lruobject *)lrucache(self, args, kwargs);
+
+  if (lru == NULL)
+    return NULL;
+  if (lru->shared != NULL){
+    PyErr_SetString(PyExc_ValueError,
+                    "Argument <shared> is not supported by cached_method.");
+    Py_DECREF(lru);
+    return NULL;
+  }
+  lru->method = 1;
+  return (PyObject *)lru;
+}
+
+
 static PyMethodDef lrucachemethods[] = {
   {"clru_cache", (PyCFunction) lrucache, METH_VARARGS | METH_KEYWORDS,
    lrucache__doc__},
+  {"cached_method", (PyCFunction) cachedmethod, METH_VARARGS | METH_KEYWORDS,
+   cachedmethod__doc__},
+  {"all_caches", (PyCFunction) all_caches, METH_NOARGS,
+   all_caches__doc__},
   {NULL, NULL} /* sentinel */
 };
 
@@ -1237,15 +7033,42 @@ PyInit__lrucache(void)
     _PYINIT_ERROR_RET;
 
   cache_type.tp_new = PyType_GenericNew;
+#ifdef _FC_VECTORCALL
+  cache_type.tp_vectorcall_offset = OFF(vectorcall);
+  cache_type.tp_flags |= Py_TPFLAGS_HAVE_VECTORCALL;
+#endif
   if (PyType_Ready(&cache_type) < 0)
     _PYINIT_ERROR_RET;
 
-  HashedArgs_type.tp_new = PyType_GenericNew;
-  if (PyType_Ready(&HashedArgs_type) < 0)
+#ifdef WITH_THREAD
+  if (PyType_Ready(&flight_type) < 0)
+    _PYINIT_ERROR_RET;
+#endif
+
+  if (PyType_Ready(&futuredone_type) < 0)
+    _PYINIT_ERROR_RET;
+
+#ifdef FC_SHARED
+  if ((shm_process_lock = PyThread_allocate_lock()) == NULL)
+    _PYINIT_ERROR_RET;
+#endif
+
+#ifdef _FC_VECTORCALL
+  cachedmethod_type.tp_vectorcall_offset =
+    offsetof(cachedmethodobject, vectorcall);
+  cachedmethod_type.tp_flags |= Py_TPFLAGS_HAVE_VECTORCALL;
+#endif
+#ifdef Py_TPFLAGS_METHOD_DESCRIPTOR
+  cachedmethod_type.tp_flags |= Py_TPFLAGS_METHOD_DESCRIPTOR;
+#endif
+  if (PyType_Ready(&cachedmethod_type) < 0)
+    _PYINIT_ERROR_RET;
+
+  weakentry_type.tp_base = &_PyWeakref_RefType;
+  if (PyType_Ready(&weakentry_type) < 0 || PyType_Ready(&weakcb_type) < 0)
     _PYINIT_ERROR_RET;
 
-  clist_type.tp_new = PyType_GenericNew;
-  if (PyType_Ready(&clist_type) < 0)
+  if (registry == NULL && (registry = PyList_New(0)) == NULL)
     _PYINIT_ERROR_RET;
 
 #ifdef _PY2
@@ -1255,12 +7078,13 @@ PyInit__lrucache(void)
   m = PyModule_Create(&lrucachemodule);
   if (m == NULL)
     return NULL;
+#ifdef Py_GIL_DISABLED
+  PyUnstable_Module_SetGIL(m, Py_MOD_GIL_NOT_USED);
+#endif
 #endif
 
   Py_INCREF(&lru_type);
   Py_INCREF(&cache_type);
-  Py_INCREF(&HashedArgs_type);
-  Py_INCREF(&clist_type);
 
 #ifndef _PY2
   return m;